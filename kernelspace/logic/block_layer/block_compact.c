@@ -0,0 +1,186 @@
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+
+#include "block_layer.h"
+
+/**
+ * Long-running devices end up with valid data interleaved with free blocks,
+ * so a sequential read of the stream hops around the device. The compactor
+ * relocates the k-th block of the used list in the k-th data block of the
+ * device, swapping physical blocks through the block map so that offsets
+ * returned to users stay valid.
+ * 
+ * Read states and list links only know logical indexes, so ongoing reads are
+ * not affected by relocations. See bldms_block_map_swap() for how a single
+ * relocation is kept safe for readers.
+*/
+
+/**
+ * Brings the given block in the physical block target.
+ * If target holds valid data of a later block of the used list, such block
+ * is parked in the physical block of the first free block beforehand.
+ * @return 0 if success, 1 if there is no room to move blocks, -1 if error
+*/
+static int bldms_compact_block(struct bldms_block_layer *b_layer,
+ struct bldms_block *block, int target){
+
+    struct bldms_block *occupant, *spare;
+    int res = 0;
+
+    occupant = bldms_block_alloc(b_layer->block_size);
+    spare = bldms_block_alloc(b_layer->block_size);
+    if (!occupant || !spare){
+        pr_err("%s: failed to allocate blocks\n", __func__);
+        res = -1;
+        goto bldms_compact_block_exit;
+    }
+    occupant->header.index = b_layer->map.logical[target];
+    if (bldms_move_block(b_layer, occupant, READ) < 0){
+        res = -1;
+        goto bldms_compact_block_exit;
+    }
+
+    if (bldms_block_contains_valid_data(b_layer, occupant)){
+        if (b_layer->free_blocks.first_bi == -1){
+            res = 1;
+            goto bldms_compact_block_exit;
+        }
+        spare->header.index = b_layer->free_blocks.first_bi;
+        if (bldms_move_block(b_layer, spare, READ) < 0
+         || bldms_block_map_swap(b_layer, occupant, spare) < 0){
+            res = -1;
+            goto bldms_compact_block_exit;
+        }
+        atomic64_inc(&b_layer->compactor.nr_blocks_moved);
+        atomic64_add(occupant->header.data_size, &b_layer->compactor.nr_bytes_moved);
+        // now target is held by the spare free block
+        swap(occupant, spare);
+    }
+
+    if (bldms_block_map_swap(b_layer, block, occupant) < 0){
+        res = -1;
+        goto bldms_compact_block_exit;
+    }
+    atomic64_inc(&b_layer->compactor.nr_blocks_moved);
+    atomic64_add(block->header.data_size, &b_layer->compactor.nr_bytes_moved);
+
+bldms_compact_block_exit:
+    bldms_block_free(occupant);
+    bldms_block_free(spare);
+    return res;
+}
+
+/**
+ * Walks the used list relocating out of place blocks, up to the batch size
+ * of the compactor. Each relocation waits for a couple of grace periods, so
+ * the write section is left between two of them to let put_data() and
+ * invalidate_data() in. The pass ends if the last relocated block has been
+ * invalidated meanwhile, and the next one starts again from the head.
+*/
+static void bldms_compact_pass(struct bldms_block_layer *b_layer){
+
+    struct bldms_compactor *compactor;
+    struct bldms_block *block;
+    int target;
+    int moved, in_place;
+    int res;
+
+    compactor = &b_layer->compactor;
+    block = bldms_block_alloc(b_layer->block_size);
+    if (!block){
+        pr_err("%s: failed to allocate block\n", __func__);
+        return;
+    }
+    bldms_start_write(b_layer);
+    block->header.index = b_layer->used_blocks.first_bi;
+    target = b_layer->start_data_index;
+    moved = 0;
+    in_place = 0;
+
+    bldms_blocks_foreach_index(block){
+
+        if (moved == compactor->batch) break;
+        if (bldms_move_block(b_layer, block, READ) < 0){
+            pr_err("%s: failed to read block %d\n", __func__, block->header.index);
+            break;
+        }
+
+        if (bldms_block_phys(b_layer, block->header.index) != target){
+            res = bldms_compact_block(b_layer, block, target);
+            if (res){
+                if (res < 0){
+                    pr_err("%s: failed to relocate block %d in %d\n", __func__,
+                     block->header.index, target);
+                }
+                break;
+            }
+            moved ++;
+
+            bldms_end_write(b_layer);
+            cond_resched();
+            bldms_start_write(b_layer);
+            // links of the block may have changed while writers were let in
+            if (bldms_move_block(b_layer, block, READ) < 0
+             || !bldms_block_contains_valid_data(b_layer, block)){
+                break;
+            }
+        }
+        else {
+            in_place ++;
+        }
+        target ++;
+        cond_resched();
+    }
+    bldms_end_write(b_layer);
+
+    atomic64_inc(&compactor->nr_passes);
+    atomic_set(&compactor->nr_in_place, in_place);
+    pr_debug("%s: %d blocks relocated, %d blocks already in place\n", __func__,
+     moved, in_place);
+    bldms_block_free(block);
+}
+
+static void bldms_compact_work(struct work_struct *work){
+
+    struct bldms_compactor *compactor;
+    struct bldms_block_layer *b_layer;
+
+    compactor = container_of(to_delayed_work(work), struct bldms_compactor, work);
+    b_layer = container_of(compactor, struct bldms_block_layer, compactor);
+
+    bldms_compact_pass(b_layer);
+
+    queue_delayed_work(system_long_wq, &compactor->work, compactor->interval);
+}
+
+void bldms_compact_init(struct bldms_block_layer *b_layer){
+
+    INIT_DELAYED_WORK(&b_layer->compactor.work, bldms_compact_work);
+}
+
+/**
+ * Starts compacting the device periodically in background.
+ * @param interval_ms: time between two passes, 0 disables compaction
+ * @param batch: max number of blocks relocated in a pass, to bound the I/O
+ * of each pass
+*/
+void bldms_compact_start(struct bldms_block_layer *b_layer,
+ unsigned int interval_ms, int batch){
+
+    struct bldms_compactor *compactor = &b_layer->compactor;
+
+    if (!interval_ms || batch <= 0 || !b_layer->map.phys){
+        pr_debug("%s: compaction is disabled\n", __func__);
+        return;
+    }
+    compactor->interval = msecs_to_jiffies(interval_ms);
+    compactor->batch = batch;
+    queue_delayed_work(system_long_wq, &compactor->work, compactor->interval);
+}
+
+void bldms_compact_stop(struct bldms_block_layer *b_layer){
+
+    cancel_delayed_work_sync(&b_layer->compactor.work);
+}
@@ -0,0 +1,120 @@
+#include <linux/types.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+
+#include "block_layer.h"
+
+/**
+ * Dirty data budget.
+ *
+ * In write-back mode, blocks written by put_data() stay dirty in the page cache
+ * until the kernel flushes them, so a burst of puts can pile up a backlog which
+ * is then written all at once. Here dirty blocks are counted: writeback starts
+ * in background as soon as half of the budget is dirty, and once the budget is
+ * exceeded producers are paced with a pause which grows with the excess, as
+ * balance_dirty_pages() does for regular files.
+*/
+
+/**
+ * Writes back and waits for the dirty blocks of every device blocks are
+ * stored in.
+*/
+static void bldms_dirty_flush(struct work_struct *work){
+
+    struct bldms_block_layer *b_layer;
+    int nr_dirty;
+    int i;
+
+    b_layer = container_of(work, struct bldms_block_layer, dirty.flush_work);
+
+    // blocks dirtied from now on are left to the next flush
+    nr_dirty = atomic_read(&b_layer->dirty.nr_dirty);
+    sync_blockdev(b_layer->sb->s_bdev);
+    if (b_layer->tier.hot_bdev){
+        sync_blockdev(b_layer->tier.hot_bdev);
+    }
+    // failed writebacks of mirror buffers are found out when it is flushed
+    bldms_mirror_flush(b_layer);
+    for (i = 1; i < b_layer->stripes.nr_devs; i++){
+        sync_blockdev(b_layer->stripes.bdevs[i]);
+    }
+    atomic_sub(nr_dirty, &b_layer->dirty.nr_dirty);
+}
+
+void bldms_dirty_init(struct bldms_block_layer *b_layer){
+
+    INIT_WORK(&b_layer->dirty.flush_work, bldms_dirty_flush);
+    atomic_set(&b_layer->dirty.nr_dirty, 0);
+    atomic64_set(&b_layer->dirty.throttle_us, 0);
+}
+
+/**
+ * Sets the dirty budget of the mounted fs.
+ * @param budget: dirty blocks allowed before producers are paced, 0 to disable
+ * @param max_pause_ms: longest pause of a producer
+*/
+void bldms_dirty_start(struct bldms_block_layer *b_layer, int budget,
+ unsigned int max_pause_ms){
+
+    b_layer->dirty.budget = max(budget, 0);
+    b_layer->dirty.max_pause = max(msecs_to_jiffies(max_pause_ms), 1UL);
+    atomic_set(&b_layer->dirty.nr_dirty, 0);
+}
+
+/**
+ * Waits for background writeback to finish. Must be called once no more
+ * blocks can be written, and before the devices are released.
+*/
+void bldms_dirty_stop(struct bldms_block_layer *b_layer){
+
+    flush_work(&b_layer->dirty.flush_work);
+    b_layer->dirty.budget = 0;
+}
+
+/**
+ * Accounts nr_blocks blocks just marked dirty, starting background writeback
+ * if half of the budget is dirty.
+*/
+void bldms_dirty_account(struct bldms_block_layer *b_layer, int nr_blocks){
+
+#ifndef BLDMS_BLOCK_SYNC_IO
+    int budget = READ_ONCE(b_layer->dirty.budget);
+
+    if (!budget){
+        return;
+    }
+    if (atomic_add_return(nr_blocks, &b_layer->dirty.nr_dirty) >= budget / 2){
+        queue_work(system_long_wq, &b_layer->dirty.flush_work);
+    }
+#endif
+}
+
+/**
+ * Paces the caller if the dirty budget is exceeded. The pause is proportional
+ * to the excess, reaching the max pause at twice the budget, so that producers
+ * slow down smoothly as the backlog grows instead of stalling all at once.
+ * Must be called outside of write sections.
+*/
+void bldms_dirty_throttle(struct bldms_block_layer *b_layer){
+
+    struct bldms_dirty *dirty = &b_layer->dirty;
+    int budget = READ_ONCE(dirty->budget);
+    unsigned long pause, start;
+    int nr_dirty;
+
+    might_sleep();
+    nr_dirty = atomic_read(&dirty->nr_dirty);
+    if (!budget || nr_dirty <= budget){
+        return;
+    }
+    queue_work(system_long_wq, &dirty->flush_work);
+
+    pause = dirty->max_pause * min(nr_dirty - budget, budget) / budget;
+    pause = max(pause, 1UL);
+    start = jiffies;
+    __set_current_state(TASK_KILLABLE);
+    io_schedule_timeout(pause);
+    atomic64_add(jiffies_to_usecs(jiffies - start), &dirty->throttle_us);
+}
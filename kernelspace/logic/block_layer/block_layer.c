@@ -6,7 +6,13 @@
 #include <linux/vmalloc.h>
 #include <linux/srcu.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/bitmap.h>
+#include <linux/wait_bit.h>
+#include <linux/sort.h>
 #include <linux/fs.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
 
 #include "block_serialization.h"
 #include "block_layer.h"
@@ -14,8 +20,12 @@
 
 /************** Block layer management **************/
 
-void bldms_block_layer_put(struct bldms_block_layer *b_layer_){
-    atomic_sub(1, &b_layer_->users);
+static void bldms_block_layer_users_release(struct percpu_ref *ref){
+
+    struct bldms_block_layer *b_layer;
+
+    b_layer = container_of(ref, struct bldms_block_layer, users);
+    complete(&b_layer->users_done);
 }
 
 /**
@@ -30,17 +40,35 @@ int bldms_block_layer_init(struct bldms_block_layer *b_layer,
 
     spin_lock_init(&b_layer->mounted_lock);
 
+    // no users are allowed until a sb is registered
+    if (percpu_ref_init(&b_layer->users, bldms_block_layer_users_release,
+     PERCPU_REF_INIT_DEAD | PERCPU_REF_ALLOW_REINIT, GFP_KERNEL)){
+        pr_err("%s: failed to init users reference\n", __func__);
+        return -1;
+    }
+    init_completion(&b_layer->users_done);
+
     b_layer->block_size = block_size;
     b_layer->nr_blocks = nr_blocks;
 
     init_srcu_struct(&b_layer->srcu);
-    init_completion(&b_layer->in_progress_write);
-    complete(&b_layer->in_progress_write);
+    init_rwsem(&b_layer->write_sem);
+    mutex_init(&b_layer->lists_lock);
 
     INIT_LIST_HEAD(&b_layer->read_states.head);
     mutex_init(&b_layer->read_states.w_lock);
     init_srcu_struct(&b_layer->read_states.srcu);
 
+    bldms_compact_init(b_layer);
+    bldms_tier_init(b_layer);
+    b_layer->stripes.nr_devs = 1;
+    bldms_mirror_init(b_layer);
+    bldms_log_init(b_layer);
+    bldms_dirty_init(b_layer);
+    bldms_stream_init(b_layer);
+    init_waitqueue_head(&b_layer->data_wait);
+    atomic64_set(&b_layer->data_seq, 0);
+
     return 0;
 
 }
@@ -54,9 +82,42 @@ int bldms_block_layer_register_sb(struct bldms_block_layer *b_layer,
     b_layer->mounted = true;
     spin_unlock(&b_layer->mounted_lock);
 
+    reinit_completion(&b_layer->users_done);
+    percpu_ref_reinit(&b_layer->users);
+
     return 0;    
 }
 
+/**
+ * Stops new users from using the block layer, and waits for the current ones
+ * to leave.
+*/
+void bldms_block_layer_unregister_sb(struct bldms_block_layer *b_layer){
+
+    might_sleep();
+
+    spin_lock(&b_layer->mounted_lock);
+    if (!b_layer->mounted){
+        spin_unlock(&b_layer->mounted_lock);
+        return;
+    }
+    b_layer->mounted = false;
+    spin_unlock(&b_layer->mounted_lock);
+
+    percpu_ref_kill(&b_layer->users);
+    wait_for_completion(&b_layer->users_done);
+}
+
+/**
+ * Releases the resources taken by bldms_block_layer_init()
+*/
+void bldms_block_layer_exit(struct bldms_block_layer *b_layer){
+
+    percpu_ref_exit(&b_layer->users);
+    cleanup_srcu_struct(&b_layer->srcu);
+    cleanup_srcu_struct(&b_layer->read_states.srcu);
+}
+
 void bldms_block_layer_clean(struct bldms_block_layer *b_layer){
 
     struct bldms_read_state *pos;
@@ -70,6 +131,11 @@ void bldms_block_layer_clean(struct bldms_block_layer *b_layer){
     }
     mutex_unlock(&b_layer->read_states.w_lock);
 
+    bldms_block_map_clean(b_layer);
+    bldms_stream_clean(b_layer);
+    bitmap_free(b_layer->block_locks);
+    b_layer->block_locks = NULL;
+
 }
 
 /************** Block layer interactions ******************/
@@ -88,22 +154,59 @@ void bldms_end_read(struct bldms_block_layer *b_layer, int reader_id){
     srcu_read_unlock(&b_layer->srcu, reader_id);
 }
 
+/**
+ * Allocates the lock bits of the blocks, once the number of blocks of the
+ * mounted device is known.
+ * @return 0 if success, else -1
+*/
+int bldms_block_locks_alloc(struct bldms_block_layer *b_layer){
+
+    bitmap_free(b_layer->block_locks);
+    b_layer->block_locks = bitmap_zalloc(b_layer->nr_blocks, GFP_KERNEL);
+    if (!b_layer->block_locks){
+        pr_err("%s: failed to allocate block locks\n", __func__);
+        return -1;
+    }
+    return 0;
+}
+
 void bldms_start_write(struct bldms_block_layer *b_layer){
 
     might_sleep();
-    wait_for_completion(&b_layer->in_progress_write);
+    down_write(&b_layer->write_sem);
         
 }
 
 void bldms_end_write(struct bldms_block_layer *b_layer){
 
-    complete(&b_layer->in_progress_write);
-
     /**
      * Saving b_layer state to disk at every write guarantees to remember changes
      * in case of sudden disk unavailability.
     */
+    mutex_lock(&b_layer->lists_lock);
+    b_layer->save_state(b_layer);
+    mutex_unlock(&b_layer->lists_lock);
+
+    up_write(&b_layer->write_sem);
+}
+
+/**
+ * Enters a write section which can run together with other shared ones, but
+ * not with exclusive ones. Only bldms_invalidate_block() can be used in it.
+*/
+void bldms_start_write_shared(struct bldms_block_layer *b_layer){
+
+    might_sleep();
+    down_read(&b_layer->write_sem);
+}
+
+void bldms_end_write_shared(struct bldms_block_layer *b_layer){
+
+    mutex_lock(&b_layer->lists_lock);
     b_layer->save_state(b_layer);
+    mutex_unlock(&b_layer->lists_lock);
+
+    up_read(&b_layer->write_sem);
 }
 
 struct bldms_block *bldms_blocks_get_block(struct bldms_block_layer *b_layer,
@@ -148,14 +251,21 @@ void blmds_reserve_first_blocks(struct bldms_block_layer *b_layer, int nr_blocks
 }
 
 /**
- * Delivers a free block to the caller.
+ * Delivers to the caller a free block which can hold size bytes of data, taken
+ * from the zone with the smallest blocks if the device has zones.
 */
-int bldms_get_free_block_any_index(struct bldms_block_layer *b_layer, 
+int bldms_get_free_block_any_index(struct bldms_block_layer *b_layer, size_t size,
  struct bldms_block **block){
     int res = 0;
     struct bldms_block *b;
+    struct bldms_blocks_head *free_blocks;
 
-    b = bldms_blocks_get_block(b_layer, &b_layer->free_blocks, BLDMS_ANY_BLOCK_INDEX);
+    free_blocks = bldms_zones_fit(b_layer, size);
+    if (!free_blocks){
+        pr_err("%s: no free blocks can hold %lu bytes\n", __func__, size);
+        return -1;
+    }
+    b = bldms_blocks_get_block(b_layer, free_blocks, BLDMS_ANY_BLOCK_INDEX);
     if (b->header.index < 0){
         pr_err("%s: no free blocks available\n", __func__);
         bldms_block_free(b);
@@ -169,6 +279,8 @@ int bldms_get_free_block_any_index(struct bldms_block_layer *b_layer,
 /**
  * Moves one entry from a blocks list at the end of another one, performing needed
  * updates to blocks in device.
+ * Neighbours of the moving block and the last block of the receiving list do not
+ * depend on each other, so they are fetched from the device with a single batch.
  * @param b_layer: the block layer
  * @param to: the receiving list
  * @param from: the donating list
@@ -181,7 +293,9 @@ struct bldms_block *block){
 
     int res = 0;
     struct bldms_block *from_block_prev, *from_block_next, *to_last_old;
-    int block_old_prev_i, block_old_next_i;
+    struct bldms_block *batch[3];
+    int nr_batch;
+    int block_old_prev_i, block_old_next_i, to_last_old_i;
 
     might_sleep();
 
@@ -191,54 +305,75 @@ struct bldms_block *block){
      block->header.index, block->header.prev, block->header.next);
 
     /**
-     * If there is a previous block, we update their next pointer
+     * Which block will be the last of the receiving list once the moving block
+     * is unlinked from the donating one? If the lists are the same and the
+     * moving block is the last one, its previous block takes its place.
     */
-    if (block->header.prev != -1){
-        from_block_prev = bldms_block_alloc(b_layer ->block_size);
-        from_block_prev ->header.index = block ->header.prev;
-        res = bldms_move_block(b_layer, from_block_prev, READ);
-        if (res < 0){
-            pr_err("%s: failed to read block %d, previous of %d\n", __func__,
-             block->header.prev, block->header.index);
-            bldms_block_free(from_block_prev);
-            return -1;
+    to_last_old_i = to->last_bi;
+    if (to == from && to_last_old_i == block->header.index){
+        to_last_old_i = block_old_prev_i;
+    }
+
+    /**
+     * Fetches the neighbours of the moving block and the last block of the
+     * receiving list. The same block can play more than one role, so we share
+     * the buffer among roles instead of reading it twice.
+    */
+    from_block_prev = from_block_next = to_last_old = NULL;
+    nr_batch = 0;
+    if (block_old_prev_i != -1){
+        from_block_prev = bldms_block_alloc(b_layer->block_size);
+        from_block_prev->header.index = block_old_prev_i;
+        batch[nr_batch++] = from_block_prev;
+    }
+    if (block_old_next_i != -1){
+        from_block_next = bldms_block_alloc(b_layer->block_size);
+        from_block_next->header.index = block_old_next_i;
+        batch[nr_batch++] = from_block_next;
+    }
+    if (to_last_old_i != -1){
+        if (to_last_old_i == block_old_prev_i){
+            to_last_old = from_block_prev;
         }
-        from_block_prev ->header.next = block ->header.next;
-        pr_debug("%s: updating next of from block prev %d to %d\n", __func__,
-         from_block_prev->header.index, block->header.next);
-        res = bldms_move_block(b_layer, from_block_prev, WRITE);
-        if (res < 0){
-            pr_err("%s: failed to write block %d, previous of %d\n", __func__,
-             block->header.prev, block->header.index);
-            bldms_block_free(from_block_prev);
-            return -1;
+        else if (to_last_old_i == block_old_next_i){
+            to_last_old = from_block_next;
+        }
+        else {
+            to_last_old = bldms_block_alloc(b_layer->block_size);
+            to_last_old->header.index = to_last_old_i;
+            batch[nr_batch++] = to_last_old;
         }
-        bldms_block_free(from_block_prev);
     }
+    res = bldms_move_blocks(b_layer, batch, nr_batch, READ);
+    if (res < 0){
+        pr_err("%s: failed to read neighbours of block %d\n", __func__,
+         block->header.index);
+        goto bldms_blocks_move_block_exit;
+    }
+
     /**
-     * If there is a next block, we update their prev pointer
+     * If there is a previous block, we update their next pointer, and if there
+     * is a next block, we update their prev pointer. Both updates are published
+     * on device with a single batch.
     */
-    if (block->header.next != -1){
-        from_block_next = bldms_block_alloc(b_layer ->block_size);
-        from_block_next ->header.index = block ->header.next;
-        res = bldms_move_block(b_layer, from_block_next, READ);
-        if (res < 0){
-            pr_err("%s: failed to read block %d, next of %d\n", __func__,
-             block->header.next, block->header.index);
-            bldms_block_free(from_block_next);
-            return -1;
-        }
-        from_block_next ->header.prev = block ->header.prev;
+    nr_batch = 0;
+    if (from_block_prev){
+        from_block_prev ->header.next = block_old_next_i;
+        pr_debug("%s: updating next of from block prev %d to %d\n", __func__,
+         from_block_prev->header.index, block_old_next_i);
+        batch[nr_batch++] = from_block_prev;
+    }
+    if (from_block_next){
+        from_block_next ->header.prev = block_old_prev_i;
         pr_debug("%s: updating prev of from block next %d to %d\n", __func__,
-         from_block_next->header.index, block->header.prev);
-        bldms_move_block(b_layer, from_block_next, WRITE);
-        if (res < 0){
-            pr_err("%s: failed to write block %d, next of %d\n", __func__,
-             block->header.next, block->header.index);
-            bldms_block_free(from_block_next);
-            return -1;
-        }
-        bldms_block_free(from_block_next);
+         from_block_next->header.index, block_old_prev_i);
+        batch[nr_batch++] = from_block_next;
+    }
+    res = bldms_move_blocks(b_layer, batch, nr_batch, WRITE);
+    if (res < 0){
+        pr_err("%s: failed to write neighbours of block %d\n", __func__,
+         block->header.index);
+        goto bldms_blocks_move_block_exit;
     }
 
     // we update the donating list head if the moving block is the first of its list
@@ -258,7 +393,7 @@ struct bldms_block *block){
     /**
      * Append block to receiving list
     */
-    if (to ->last_bi == -1){
+    if (!to_last_old){
         // we put the block at the beginning of the receiving list
         block ->header.prev = -1;
         pr_debug("%s: block %d is the first of to list\n", __func__,
@@ -266,17 +401,8 @@ struct bldms_block *block){
     }
     else {
         // we put the block after the last block of receiving list
-        to_last_old = bldms_block_alloc(b_layer ->block_size);
-        to_last_old ->header.index = to ->last_bi;
         pr_debug("%s: to last old has index %d and next %d\n", __func__,
          to_last_old->header.index, to_last_old->header.next);
-        res = bldms_move_block(b_layer, to_last_old, READ);
-        if (res < 0){
-            pr_err("%s: failed to read block %d, last of to list\n", __func__,
-            to->last_bi);
-            bldms_block_free(to_last_old);
-            return -1;
-        }
         block ->header.prev = to_last_old ->header.index;
     }
     block ->header.next = -1;
@@ -287,11 +413,11 @@ struct bldms_block *block){
     if (res < 0){
         pr_err("%s: failed to write block to move %d\n", __func__,
         block->header.index);
-        return -1;
+        goto bldms_blocks_move_block_exit;
     }
 
     // we update the receiving list head and last block, if there is one
-    if(to->last_bi == -1){
+    if(!to_last_old){
         to ->first_bi = block ->header.index;
         to ->last_bi = block ->header.index;
     }
@@ -302,9 +428,8 @@ struct bldms_block *block){
         res = bldms_move_block(b_layer, to_last_old, WRITE);
         if (res < 0){
             pr_err("%s: failed to write block %d, last of to list\n", __func__,
-            to->last_bi);
-            bldms_block_free(to_last_old);
-            return -1;
+            to_last_old->header.index);
+            goto bldms_blocks_move_block_exit;
         }
         to ->last_bi = block ->header.index;
         pr_debug("%s: to_last_old block %d has prev %d and next %d\n", __func__,
@@ -316,7 +441,12 @@ struct bldms_block *block){
     pr_debug("%s: to list start and end: %d %d\n", __func__, to->first_bi,
         to->last_bi);
 
-    bldms_block_free(to_last_old);
+bldms_blocks_move_block_exit:
+    bldms_block_free(from_block_prev);
+    bldms_block_free(from_block_next);
+    if (to_last_old != from_block_prev && to_last_old != from_block_next){
+        bldms_block_free(to_last_old);
+    }
 
     return res;
 }
@@ -334,50 +464,395 @@ int bldms_blocks_move_block_index(struct bldms_block_layer *b_layer,
 }
 
 /**
- * Marks the desired block as free to use, updating block in device
+ * Moves a position of a read session which resumes from the given block, whose
+ * data is about to vanish from the stream, as described below.
 */
-int bldms_invalidate_block(struct bldms_block_layer *b_layer, struct bldms_block *block){
-    
-    int res = 0;
+static void bldms_read_pos_skip_block(struct bldms_block *block, int *b_i_start,
+ loff_t stream_cursor, loff_t *off_old, loff_t *off_stale){
+
+    if (*b_i_start != block->header.index){
+        return;
+    }
+    if (*off_old > stream_cursor){
+        if (*off_stale < 0){
+            *off_stale = *off_old;
+        }
+        *off_old = max(stream_cursor, *off_old - (loff_t)block->header.data_size);
+    }
+    *b_i_start = block->header.next;
+}
+
+/**
+ * Updates read states of the bldms_read() sessions before the data of the given
+ * block vanishes from the stream.
+*/
+static void bldms_read_states_skip_block(struct bldms_block_layer *b_layer,
+ struct bldms_block *block){
+
     struct bldms_read_state *cur_read_state;
     int reader_idx;
-    
+
     /**
-     * We need to update states of all sessions of bldms_read() which stream offset
-     * currently points to some data in the block to invalidate.
+     * We need to update states of all sessions of bldms_read() which resume from
+     * the block to invalidate.
      * 
      * block_data_stream: [-------][xxxxxxxxxxxxxxxxxx][--]
-     *                                  ^             ^
-     *                                  off  -------> stream_cursor
+     *                             ^        ^
+     *                 stream_cursor        off
      * 
-     * If the block containing off is invalidated, we simply progress *off to match
-     * stream_cursor, and we annotate that the block to start the next read is the
-     * next one. In other words, we behave as the last read consumed all data bytes
-     * in the invalidated block.
+     * They will resume from the next block, which data now starts at stream_cursor.
+     * If the position where the session stopped follows stream_cursor, it moves
+     * back by the data of the block, but not before stream_cursor: in other words,
+     * we behave as the last read consumed all data bytes in the invalidated block.
+     * The file position is not touched here, since the session may be reading:
+     * the old one is kept in off_stale, and the next read follows the change if
+     * the file position still matches it.
     */
     reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
     list_for_each_entry(cur_read_state, &b_layer->read_states.head, list_node){
         mutex_lock(&cur_read_state->lock);
-        if(cur_read_state->b_i_start == block->header.index){
-            mutex_lock(&cur_read_state->filp->f_pos_lock);
-            cur_read_state->filp->f_pos = cur_read_state->stream_cursor;
-            mutex_unlock(&cur_read_state->filp->f_pos_lock);
-            cur_read_state->b_i_start = block->header.next;
+        /**
+         * Framed sessions resume from the next block, which has not been
+         * returned yet, or from the previous one if the block is the last, so
+         * that blocks appended later are still found after it.
+        */
+        if (cur_read_state->framed
+         && cur_read_state->b_i_start == block->header.index){
+            cur_read_state->b_i_done = block->header.next == -1
+             && block->header.prev != -1;
+            cur_read_state->b_i_start = cur_read_state->b_i_done?
+             block->header.prev : block->header.next;
+        }
+        else {
+            bldms_read_pos_skip_block(block, &cur_read_state->b_i_start,
+             cur_read_state->stream_cursor, &cur_read_state->off_old,
+             &cur_read_state->off_stale);
+            // the position a read just left is moved too, in case it is committed
+            if (cur_read_state->pending){
+                bldms_read_pos_skip_block(block, &cur_read_state->b_i_next,
+                 cur_read_state->stream_cursor_next, &cur_read_state->off_next,
+                 &cur_read_state->off_next_stale);
+            }
         }
         mutex_unlock(&cur_read_state->lock);
     }
     srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+}
+
+static int bldms_block_index_cmp(const void *a, const void *b){
+
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * Locks the given blocks in index order, so that writers locking overlapping
+ * sets of blocks cannot deadlock. Indexes out of the device and duplicates are
+ * skipped.
+ * @return how many blocks have been locked, whose indexes are moved at the start
+ * of the array
+*/
+static int bldms_blocks_lock(struct bldms_block_layer *b_layer, int *indexes,
+ int nr_indexes){
+
+    int nr_locked;
+    int i;
+
+    sort(indexes, nr_indexes, sizeof(int), bldms_block_index_cmp, NULL);
+    nr_locked = 0;
+    for (i = 0; i < nr_indexes; i++){
+        if (indexes[i] < 0 || indexes[i] >= b_layer->nr_blocks
+         || (nr_locked && indexes[nr_locked - 1] == indexes[i])){
+            continue;
+        }
+        indexes[nr_locked++] = indexes[i];
+        wait_on_bit_lock(b_layer->block_locks, indexes[i], TASK_UNINTERRUPTIBLE);
+    }
+    return nr_locked;
+}
+
+/**
+ * Unlocks the given blocks, but the one with index keep
+*/
+static void bldms_blocks_unlock(struct bldms_block_layer *b_layer,
+ const int *indexes, int nr_locked, int keep){
+
+    int i;
+
+    for (i = 0; i < nr_locked; i++){
+        if (indexes[i] != keep){
+            clear_and_wake_up_bit(indexes[i], b_layer->block_locks);
+        }
+    }
+}
+
+/**
+ * Unlinks a block from a list. The block and its neighbours must be locked,
+ * so that only the list head is shared with other writers.
+ * @return -1 if error, else 0
+*/
+static int bldms_blocks_unlink_locked(struct bldms_block_layer *b_layer,
+ struct bldms_blocks_head *from, struct bldms_block *block){
+
+    struct bldms_block *prev, *next;
+    struct bldms_block *batch[2];
+    int nr_batch;
+    int res;
+
+    prev = next = NULL;
+    nr_batch = 0;
+    if (block->header.prev != -1){
+        prev = bldms_block_alloc(b_layer->block_size);
+        prev->header.index = block->header.prev;
+        batch[nr_batch++] = prev;
+    }
+    if (block->header.next != -1){
+        next = bldms_block_alloc(b_layer->block_size);
+        next->header.index = block->header.next;
+        batch[nr_batch++] = next;
+    }
+    res = bldms_move_blocks(b_layer, batch, nr_batch, READ);
+    if (res < 0){
+        pr_err("%s: failed to read neighbours of block %d\n", __func__,
+         block->header.index);
+        goto bldms_blocks_unlink_locked_exit;
+    }
+    if (prev){
+        prev->header.next = block->header.next;
+    }
+    if (next){
+        next->header.prev = block->header.prev;
+    }
+    res = bldms_move_blocks(b_layer, batch, nr_batch, WRITE);
+    if (res < 0){
+        pr_err("%s: failed to write neighbours of block %d\n", __func__,
+         block->header.index);
+        goto bldms_blocks_unlink_locked_exit;
+    }
+
+    mutex_lock(&b_layer->lists_lock);
+    if (from->first_bi == block->header.index){
+        from->first_bi = block->header.next;
+    }
+    if (from->last_bi == block->header.index){
+        from->last_bi = block->header.prev;
+    }
+    mutex_unlock(&b_layer->lists_lock);
+
+bldms_blocks_unlink_locked_exit:
+    bldms_block_free(prev);
+    bldms_block_free(next);
+    return res;
+}
+
+/**
+ * Appends a block, which must be locked, at the end of a list. The last block
+ * of the list is shared with other writers, so the append is serialized by
+ * the lists lock.
+ * @return -1 if error, else 0
+*/
+static int bldms_blocks_append_locked(struct bldms_block_layer *b_layer,
+ struct bldms_blocks_head *to, struct bldms_block *block){
+
+    struct bldms_block *last;
+    int res;
+
+    last = NULL;
+    mutex_lock(&b_layer->lists_lock);
+
+    block->header.prev = to->last_bi;
+    block->header.next = -1;
+    res = bldms_move_block(b_layer, block, WRITE);
+    if (res < 0){
+        pr_err("%s: failed to write block %d\n", __func__, block->header.index);
+        goto bldms_blocks_append_locked_exit;
+    }
+    if (to->last_bi == -1){
+        to->first_bi = block->header.index;
+        to->last_bi = block->header.index;
+        goto bldms_blocks_append_locked_exit;
+    }
+
+    last = bldms_block_alloc(b_layer->block_size);
+    last->header.index = to->last_bi;
+    res = bldms_move_block(b_layer, last, READ);
+    if (res == 0){
+        // after the following write, new readers can land on the appended block
+        last->header.next = block->header.index;
+        res = bldms_move_block(b_layer, last, WRITE);
+    }
+    if (res < 0){
+        pr_err("%s: failed to link block %d after block %d\n", __func__,
+         block->header.index, to->last_bi);
+        goto bldms_blocks_append_locked_exit;
+    }
+    to->last_bi = block->header.index;
+
+bldms_blocks_append_locked_exit:
+    mutex_unlock(&b_layer->lists_lock);
+    bldms_block_free(last);
+    return res;
+}
+
+/**
+ * Marks the desired block as free to use, updating block in device.
+ * Must be called in a shared write section: the block and its neighbours in the
+ * used list are locked, so that invalidations of non adjacent blocks can run in
+ * parallel.
+ * @return 0 if success, -ENODATA if the block does not contain valid data,
+ * else -1
+*/
+int bldms_invalidate_block(struct bldms_block_layer *b_layer, struct bldms_block *block){
+    
+    int locked[3];
+    int nr_locked;
+    int index, prev, next;
+    loff_t from;
+    int res = 0;
+
+    index = block->header.index;
+    if (index < b_layer->start_data_index || index >= b_layer->nr_blocks){
+        return -ENODATA;
+    }
+
+    /**
+     * Neighbours of the block are known only once it is read, and they can
+     * change until they are locked: if so, we try again with the new ones.
+    */
+    nr_locked = 0;
+    do {
+        bldms_blocks_unlock(b_layer, locked, nr_locked, -1);
+        if (bldms_move_block(b_layer, block, READ) < 0){
+            pr_err("%s: failed to read block %d\n", __func__, index);
+            return -1;
+        }
+        if (!bldms_block_contains_valid_data(b_layer, block)){
+            return -ENODATA;
+        }
+        prev = block->header.prev;
+        next = block->header.next;
+        locked[0] = prev;
+        locked[1] = index;
+        locked[2] = next;
+        nr_locked = bldms_blocks_lock(b_layer, locked, 3);
+
+        if (bldms_move_block(b_layer, block, READ) < 0){
+            pr_err("%s: failed to read block %d\n", __func__, index);
+            res = -1;
+            goto bldms_invalidate_block_exit;
+        }
+    } while (!bldms_block_contains_valid_data(b_layer, block)
+     || block->header.prev != prev || block->header.next != next);
+
+    from = bldms_stream_remove(b_layer, index);
+    bldms_read_states_skip_block(b_layer, block);
+
+    res = bldms_blocks_unlink_locked(b_layer, &b_layer->used_blocks, block);
+    if (res < 0){
+        goto bldms_invalidate_block_exit;
+    }
+    // neighbours are linked to each other now, the block is only ours
+    bldms_blocks_unlock(b_layer, locked, nr_locked, index);
+    locked[0] = index;
+    nr_locked = 1;
+    bldms_stream_changed(b_layer, from);
+
+    /**
+     * Give remaining readers time to exit from the block, before its links are
+     * changed. Concurrent invalidations wait for the same grace period.
+    */
+    synchronize_srcu(&b_layer->srcu);
 
     /**
      * We update block metadata in device to reflect the invalidation
     */
     block ->header.state = BLDMS_BLOCK_STATE_INVALID;
-    res = bldms_blocks_move_block(b_layer, &b_layer->free_blocks, &b_layer->used_blocks,
-        block);
+    res = bldms_blocks_append_locked(b_layer, bldms_block_free_list(b_layer, index),
+     block);
+    if (res == 0){
+        bldms_tier_mark_invalid(b_layer, index);
+    }
+
+bldms_invalidate_block_exit:
+    bldms_blocks_unlock(b_layer, locked, nr_locked, -1);
+    return res;
+}
+
+/**
+ * Delivers to the caller the block containing the oldest valid data, which is
+ * the one to evict first when the device is used as a ring buffer.
+*/
+int bldms_get_oldest_block(struct bldms_block_layer *b_layer,
+ struct bldms_block **block){
+
+    struct bldms_block *b;
+
+    if (b_layer->used_blocks.first_bi == -1){
+        pr_err("%s: no used blocks available\n", __func__);
+        return -1;
+    }
+
+    b = bldms_block_alloc(b_layer->block_size);
+    if (!b){
+        pr_err("%s: failed to allocate block\n", __func__);
+        return -1;
+    }
+    b->header.index = b_layer->used_blocks.first_bi;
+    if (bldms_move_block(b_layer, b, READ) < 0){
+        pr_err("%s: failed to read block %d\n", __func__, b->header.index);
+        bldms_block_free(b);
+        return -1;
+    }
+
+    *block = b;
+    return 0;
+}
+
+/**
+ * Publishes the new data of a block obtained with bldms_get_oldest_block().
+ * The old data is evicted from the stream and the block is moved from the head
+ * to the tail of the used list with a single relink, instead of invalidating
+ * and then validating it again.
+*/
+int bldms_recycle_block(struct bldms_block_layer *b_layer,
+ struct bldms_block *block){
+
+    loff_t from, appended;
+    int res;
+
+    from = bldms_stream_remove(b_layer, block->header.index);
+    bldms_read_states_skip_block(b_layer, block);
 
+    block->header.state = BLDMS_BLOCK_STATE_VALID;
+    res = bldms_blocks_move_block(b_layer, &b_layer->used_blocks, &b_layer->used_blocks,
+     block);
+    if (res < 0){
+        pr_err("%s: failed to move block %d at the end of used blocks\n", __func__,
+         block->header.index);
+        return res;
+    }
+    /**
+     * Readers may still be on the evicted data until the grace period of the
+     * relink, so a cold block is admitted to the hot tier only once its new
+     * data has been published in place. If it cannot be, it just stays cold.
+    */
+    bldms_tier_admit(b_layer, block);
+    appended = bldms_stream_append(b_layer, block->header.index,
+     block->header.data_size);
+    // the evicted data was the oldest, so the whole stream moved
+    bldms_stream_changed(b_layer, from >= 0? from : appended);
+    bldms_data_appended(b_layer);
     return res;
 }
 
+/**
+ * Wakes up the readers waiting for new data, once it can be read.
+*/
+void bldms_data_appended(struct bldms_block_layer *b_layer){
+
+    atomic64_inc(&b_layer->data_seq);
+    wake_up_interruptible_poll(&b_layer->data_wait, EPOLLIN | EPOLLRDNORM);
+}
+
 /**
  * Marks the desired block as containing valid data, updating block in device
 */
@@ -385,101 +860,381 @@ int bldms_validate_block(struct bldms_block_layer *b_layer,
  struct bldms_block *block){
 
     int res = 0;
+
+    // new data is written where it is going to be read from
+    if (bldms_tier_admit(b_layer, block) < 0){
+        return -1;
+    }
     block->header.state = BLDMS_BLOCK_STATE_VALID;
-    res = bldms_blocks_move_block(b_layer, &b_layer->used_blocks, &b_layer->free_blocks,
-     block);
+    res = bldms_blocks_move_block(b_layer, &b_layer->used_blocks,
+     bldms_block_free_list(b_layer, block->header.index), block);
     if (res < 0){
         pr_err("%s: failed to move block %d from free to used blocks\n", __func__,
          block->header.index);
+        return res;
     }
+    bldms_stream_changed(b_layer, bldms_stream_append(b_layer, block->header.index,
+     block->header.data_size));
+    bldms_data_appended(b_layer);
     return res;
 }
 
+#ifdef BLDMS_BLOCK_SYNC_IO
 /**
- * Syncs the block corresponding to the given buffer_head
- * to the device and waits for the operation to complete
+ * Syncs the blocks corresponding to the given buffer_heads to the device, and
+ * their copies in the mirror, if any.
+ * All the writes of both sides are submitted before waiting for any of them to
+ * complete. A failed write of the mirror only takes the mirror offline.
 */
-#ifdef BLDMS_BLOCK_SYNC_IO
-static int bldms_block_sync_io(struct buffer_head *bh){
-    int res;
+static int bldms_blocks_sync_io(struct bldms_block_layer *b_layer,
+ struct buffer_head **bhs, int nr_bhs, struct buffer_head **mbhs, int nr_mbhs){
+    int i;
+    int res = 0;
 
     might_sleep();
-    res = sync_dirty_buffer(bh);
-    if (res){
-        pr_err("%s: failed to sync buffer head %p\n", __func__, bh);
-        return -1;
+    for (i = 0; i < nr_bhs; i++){
+        write_dirty_buffer(bhs[i], REQ_SYNC);
     }
-    return 0;
+    for (i = 0; i < nr_mbhs; i++){
+        write_dirty_buffer(mbhs[i], REQ_SYNC);
+    }
+    for (i = 0; i < nr_bhs; i++){
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i])){
+            pr_err("%s: failed to sync buffer head %p\n", __func__, bhs[i]);
+            res = -1;
+        }
+    }
+    for (i = 0; i < nr_mbhs; i++){
+        wait_on_buffer(mbhs[i]);
+        if (!buffer_uptodate(mbhs[i])){
+            bldms_mirror_write_failed(b_layer, mbhs[i]->b_blocknr);
+        }
+    }
+    return res;
 }
 #else
-static inline int bldms_block_sync_io(struct buffer_head *bh){
+static inline int bldms_blocks_sync_io(struct bldms_block_layer *b_layer,
+ struct buffer_head **bhs, int nr_bhs, struct buffer_head **mbhs, int nr_mbhs){
     return 0;
 }
 #endif
 
 /**
- * Moves one block of data to/from the device.
- * Blocks are abstracted using the buffer_head api
+ * @return the device holding the block at the given location, and in nr_p
+ * the block number in such device
 */
-int bldms_move_block(struct bldms_block_layer *b_layer,
- struct bldms_block *block, int direction){
-    
-    struct buffer_head *bh;
+static struct block_device *bldms_block_bdev(struct bldms_block_layer *b_layer,
+ struct bldms_block_loc loc, sector_t *nr_p){
+
+    struct bldms_stripes *stripes = &b_layer->stripes;
+
+    if (loc.tier == BLDMS_TIER_HOT){
+        *nr_p = loc.nr;
+        return b_layer->tier.hot_bdev;
+    }
+    if (stripes->nr_devs > 1){
+        *nr_p = loc.nr % stripes->nr_blocks_per_dev;
+        return stripes->bdevs[loc.nr / stripes->nr_blocks_per_dev];
+    }
+    *nr_p = loc.nr;
+    return b_layer->sb->s_bdev;
+}
+
+/**
+ * @return the buffer head of the block at the given location, without reading it
+*/
+static struct buffer_head *bldms_block_getblk(struct bldms_block_layer *b_layer,
+ struct bldms_block_loc loc){
+
+    struct block_device *bdev;
+    sector_t nr;
+
+    bdev = bldms_block_bdev(b_layer, loc, &nr);
+    return __getblk(bdev, nr, b_layer->block_size);
+}
+
+/**
+ * A logical block found in a physical block which does not hold it is being
+ * relocated by bldms_block_map_swap(): only stale users can land there, and for
+ * them the block is free.
+*/
+static void bldms_block_check_relocated(struct bldms_block *block, int index){
+
+    if (block->header.index != index){
+        pr_debug("%s: block %d is being relocated\n", __func__, index);
+        block->header.index = index;
+        block->header.state = BLDMS_BLOCK_STATE_INVALID;
+        block->header.data_size = 0;
+        block->header.next = -1;
+        block->header.prev = -1;
+    }
+}
+
+/**
+ * Moves a batch of blocks to/from the memory of a bldms RAM disk.
+ * There is no I/O to wait for, since the memory is the device itself.
+ * @return -1 if error, else 0
+*/
+static int bldms_move_blocks_direct(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, const struct bldms_block_loc *locs, int nr_blocks,
+ int direction){
+
+    size_t pos;
+    int index;
+    int i;
+
+    for (i = 0; i < nr_blocks; i++){
+        index = blocks[i]->header.index;
+        pos = (size_t)(locs? locs[i].nr : bldms_block_phys(b_layer, index))
+         * b_layer->block_size;
+        if (index < 0 || pos + b_layer->block_size > b_layer->direct.size){
+            pr_err("%s: invalid block index %d\n", __func__, index);
+            return -1;
+        }
+        if (!locs){
+            pos += bldms_block_offset(b_layer, index);
+        }
+        if (direction == READ){
+            bldms_block_deserialize(blocks[i], b_layer->direct.data + pos);
+            if (!locs){
+                bldms_block_check_relocated(blocks[i], index);
+                bldms_zone_fix_capacity(b_layer, blocks[i]);
+            }
+        }
+        else {
+            // same race with new readers as the buffer head path, see below
+            bldms_block_serialize(blocks[i], b_layer->direct.data + pos);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Uses the given memory as the content of the device, instead of accessing it
+ * through buffer heads. Pass NULL to go back to buffer heads.
+ * Can only be called while there are no users of the block layer.
+*/
+void bldms_block_layer_set_direct(struct bldms_block_layer *b_layer, u8 *data,
+ size_t size){
+
+    b_layer->direct.data = data;
+    b_layer->direct.size = data? size : 0;
+}
+
+/**
+ * Moves a batch of blocks to/from the device. Blocks are abstracted using the
+ * buffer_head api.
+ * 
+ * Buffers of the whole batch are submitted to the device at once and then
+ * waited together, so that reading n independent blocks costs about one device
+ * round trip instead of n. Blocks in the batch must have distinct indexes.
+ * @param locs: where blocks are stored, or NULL to look them up in the block
+ * map and in the tiers
+ * @return -1 if error, else 0
+*/
+static int __bldms_move_blocks(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, const struct bldms_block_loc *locs, int nr_blocks,
+ int direction){
+
+    struct buffer_head **bhs;
+    struct buffer_head **mbhs; // copies of written buffers in the mirror
+    int *sides; // mirror side each read is accounted to, if any
+    int nr_bhs, nr_mbhs;
     int res;
+    int index;
+    u8 *data;
+    int i;
 
     might_sleep();
     res = 0;
+    nr_bhs = 0;
+    nr_mbhs = 0;
+
+    if (nr_blocks <= 0){
+        return 0;
+    }
+    if (direction != READ && direction != WRITE){
+        pr_err("%s: unsupported data direction %d\n", __func__, direction);
+        return -1;
+    }
+    if (b_layer->direct.data){
+        return bldms_move_blocks_direct(b_layer, blocks, locs, nr_blocks, direction);
+    }
 
-    if (block->header.index < 0){
-        pr_err("%s: invalid block index %d\n", __func__, block->header.index);
+    bhs = kcalloc(nr_blocks, 2 * sizeof(struct buffer_head *) + sizeof(int),
+     GFP_KERNEL);
+    if (!bhs){
+        pr_err("%s: failed to allocate buffer heads array\n", __func__);
         return -1;
     }
+    mbhs = bhs + nr_blocks;
+    sides = (int *)(mbhs + nr_blocks);
 
     /**
-     * Get buffer head correspoding to given block
+     * Get buffer heads corresponding to given blocks
     */
-    bh = sb_bread(b_layer->sb, block->header.index);
-    if (!bh){
-        pr_err("%s: failed to read block %d from disk %s\n", __func__,
-         block->header.index, b_layer->sb->s_bdev->bd_disk->disk_name);
-        return -1;
+    for (i = 0; i < nr_blocks; i++){
+        if (blocks[i]->header.index < 0){
+            pr_err("%s: invalid block index %d\n", __func__, blocks[i]->header.index);
+            res = -1;
+            goto bldms_move_blocks_exit;
+        }
+        bhs[i] = bldms_block_getblk(b_layer, locs? locs[i] :
+         bldms_block_locate(b_layer, blocks[i]->header.index));
+        if (!bhs[i]){
+            pr_err("%s: failed to get buffer head of block %d\n", __func__,
+             blocks[i]->header.index);
+            res = -1;
+            goto bldms_move_blocks_exit;
+        }
+        // reads can be served by the least busy side of the mirror
+        sides[i] = -1;
+        if (direction == READ){
+            bhs[i] = bldms_mirror_balance_read(b_layer, bhs[i], &sides[i]);
+        }
+        nr_bhs ++;
     }
 
-    // do the read/write
-    switch(direction){
-        case READ:
-            bldms_block_deserialize(block, bh->b_data);
-            break;
-        case WRITE:
-            /**
-             * FIXME: there is a race condition between the writer and new readers
-             * which have started after last grace period expired. Readers can access
-             * the buffer head content while it is being modified by the writer, thus
-             * leading to possibily inconsistent reads.
-             * This can be solved if we can copy the data in a buffer array and
-             * then switch the b_data pointer to such buffer array after a grace period
-             * expires, but I do not
-             * know the ownership of the original b_data pointer. (Who frees it?)
-            */
-            bldms_block_serialize(block, bh->b_data);        
-            mark_buffer_dirty(bh);
-            break;
-        default:
-            pr_err("%s: unsupported data direction %d\n", __func__, direction);
+    /**
+     * Submit reads of all the buffers not already in memory, then wait for
+     * all of them. Writes need the buffers too, since they only update
+     * the serialized part of the block.
+    */
+    ll_rw_block(REQ_OP_READ, 0, nr_bhs, bhs);
+    for (i = 0; i < nr_bhs; i++){
+        wait_on_buffer(bhs[i]);
+        // a failed read of the mirror is retried on the primary device
+        if (!buffer_uptodate(bhs[i]) && sides[i] == BLDMS_MIRROR_SIDE_MIRROR){
+            bhs[i] = bldms_mirror_read_failed(b_layer, bhs[i], &sides[i]);
+        }
+        if (!bhs[i] || !buffer_uptodate(bhs[i])){
+            pr_err("%s: failed to read block %d from disk %s\n", __func__,
+             blocks[i]->header.index, b_layer->sb->s_bdev->bd_disk->disk_name);
             res = -1;
-            goto bldms_move_block_exit;
+            goto bldms_move_blocks_exit;
+        }
+    }
+
+    // do the read/write
+    for (i = 0; i < nr_bhs; i++){
+        // blocks of zones with small blocks share the device block
+        data = bhs[i]->b_data;
+        if (!locs){
+            data += bldms_block_offset(b_layer, blocks[i]->header.index);
+        }
+        switch(direction){
+            case READ:
+                index = blocks[i]->header.index;
+                bldms_block_deserialize(blocks[i], data);
+                if (!locs){
+                    bldms_block_check_relocated(blocks[i], index);
+                    bldms_zone_fix_capacity(b_layer, blocks[i]);
+                }
+                break;
+            case WRITE:
+                /**
+                 * FIXME: there is a race condition between the writer and new readers
+                 * which have started after last grace period expired. Readers can access
+                 * the buffer head content while it is being modified by the writer, thus
+                 * leading to possibily inconsistent reads.
+                 * This can be solved if we can copy the data in a buffer array and
+                 * then switch the b_data pointer to such buffer array after a grace period
+                 * expires, but I do not
+                 * know the ownership of the original b_data pointer. (Who frees it?)
+                */
+                bldms_block_serialize(blocks[i], data);
+                mark_buffer_dirty(bhs[i]);
+                mbhs[nr_mbhs] = bldms_mirror_write(b_layer, bhs[i]);
+                if (mbhs[nr_mbhs]){
+                    nr_mbhs ++;
+                }
+                break;
+        }
+    }
+
+    if (direction == WRITE){
+        bldms_dirty_account(b_layer, nr_bhs);
     }
 
     /**
      * wait for changes to propagate to device if compiled with write-through policy
     */
-    if (bldms_block_sync_io(bh)){
-        pr_err("%s: failed to sync block %d\n", __func__, block->header.index);
+    if (direction == WRITE
+     && bldms_blocks_sync_io(b_layer, bhs, nr_bhs, mbhs, nr_mbhs)){
+        pr_err("%s: failed to sync blocks\n", __func__);
         res = -1;
-        goto bldms_move_block_exit;
+        goto bldms_move_blocks_exit;
     }
-    
-bldms_move_block_exit:
-    brelse(bh);
+
+bldms_move_blocks_exit:
+    for (i = 0; i < nr_bhs; i++){
+        bldms_mirror_read_done(b_layer, sides[i]);
+        brelse(bhs[i]);
+    }
+    for (i = 0; i < nr_mbhs; i++){
+        brelse(mbhs[i]);
+    }
+    kfree(bhs);
     return res;
 }
+
+int bldms_move_blocks(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, int nr_blocks, int direction){
+
+    return __bldms_move_blocks(b_layer, blocks, NULL, nr_blocks, direction);
+}
+
+/**
+ * Moves one block of data to/from the device.
+*/
+int bldms_move_block(struct bldms_block_layer *b_layer,
+ struct bldms_block *block, int direction){
+    
+    return __bldms_move_blocks(b_layer, &block, NULL, 1, direction);
+}
+
+/**
+ * Moves one block of data to/from the given physical block of the device,
+ * bypassing the block map.
+*/
+int bldms_move_block_phys(struct bldms_block_layer *b_layer,
+ struct bldms_block *block, int phys, int direction){
+
+    struct bldms_block_loc loc = {
+        .tier = BLDMS_TIER_COLD,
+        .nr = phys
+    };
+
+    return __bldms_move_blocks(b_layer, &block, &loc, 1, direction);
+}
+
+/**
+ * Moves a batch of blocks to/from the given locations, bypassing the block map
+ * and the tiers.
+*/
+int bldms_move_blocks_at(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, const struct bldms_block_loc *locs, int nr_blocks,
+ int direction){
+
+    return __bldms_move_blocks(b_layer, blocks, locs, nr_blocks, direction);
+}
+
+/**
+ * Asks the device to bring the block in memory without waiting for it.
+ * A later bldms_move_block() on the same block will find it ready, or at least
+ * already on its way.
+*/
+void bldms_prefetch_block(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_block_loc loc;
+    struct block_device *bdev;
+    sector_t nr;
+
+    if (index < 0 || b_layer->direct.data){
+        return;
+    }
+    loc = bldms_block_locate(b_layer, index);
+    bdev = bldms_block_bdev(b_layer, loc, &nr);
+    __breadahead(bdev, nr, b_layer->block_size);
+}
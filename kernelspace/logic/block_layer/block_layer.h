@@ -3,10 +3,18 @@
 
 #include <linux/types.h>
 #include <linux/completion.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/atomic.h>
+#include <linux/percpu-refcount.h>
+#include <linux/xarray.h>
 #include <linux/srcu.h>
 #include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
 #include "srcu_list.h"
 
 #include "block.h"
@@ -28,6 +36,267 @@ struct bldms_blocks_head{
     int last_bi;
 };
 
+/**
+ * Blocks are addressed by logical index: it is the offset users see and the
+ * value stored in list links. The block map tells which physical block of the
+ * device currently holds each logical block, allowing blocks to be relocated
+ * without changing their offsets.
+*/
+struct bldms_block_map{
+
+    int *phys; // physical block holding each logical block
+    int *logical; // logical block held by each physical block
+};
+
+/**
+ * Background worker which relocates blocks containing valid data in contiguous
+ * physical blocks at the head of the device, following used list order.
+*/
+struct bldms_compactor{
+
+    struct delayed_work work;
+    unsigned long interval; // jiffies between two passes
+    int batch; // max relocations in a pass
+    atomic64_t nr_passes;
+    atomic64_t nr_blocks_moved; // relocated blocks with valid data
+    atomic64_t nr_bytes_moved; // valid data bytes relocated
+    atomic_t nr_in_place; // blocks found in place by last pass
+};
+
+/**
+ * Devices where blocks can be stored. The cold tier is the device owning the
+ * superblock, and holds every block. The optional hot tier is a smaller, faster
+ * device (ex: the bldms RAM disk) which holds recent blocks on behalf of the cold
+ * tier, until they are migrated back in background.
+*/
+enum bldms_tier_id{
+    BLDMS_TIER_COLD,
+    BLDMS_TIER_HOT
+};
+
+/**
+ * Where a block is stored
+*/
+struct bldms_block_loc{
+
+    enum bldms_tier_id tier;
+    int nr; // block number in the tier device
+};
+
+#define BLDMS_TIER_PROMOTE_QUEUE_SIZE 64
+
+/**
+ * Entry of the admission order of the hot tier. It is stale once the slot has
+ * been released, that is once the generation of the slot has changed.
+*/
+struct bldms_tier_admission{
+
+    int slot;
+    unsigned int gen;
+};
+
+struct bldms_tier{
+
+    struct block_device *hot_bdev; // NULL if tiering is disabled
+    int nr_hot_slots; // how many blocks fit in the hot device
+    int nr_hot_used; // how many slots of the hot device hold a block
+    int *hot_slot; // slot of the hot device holding each logical block, or -1
+    int *hot_owner; // logical block held by each slot of the hot device, or -1
+    unsigned long *hot_invalid; // slots holding blocks with invalid data
+    unsigned int *hot_gen; // generation of each slot, bumped when it is released
+    /**
+     * Admission order of the blocks in the hot tier, as struct
+     * bldms_tier_admission, used to pick the oldest ones when migrating.
+     * Entries of blocks already migrated are stale, and are dropped when the
+     * queue fills up.
+    */
+    struct kfifo admissions;
+    bool promote; // if true, accessed cold blocks are brought back in hot tier
+    /**
+     * Blocks to promote are queued by readers and brought in the hot tier by
+     * the migration worker, which can enter a write section.
+    */
+    DECLARE_KFIFO(promote_queue, int, BLDMS_TIER_PROMOTE_QUEUE_SIZE);
+    spinlock_t promote_lock;
+    struct delayed_work work;
+    unsigned long interval; // jiffies between two migration passes
+    int batch; // max blocks migrated in a pass
+    int high_wm; // migration starts when more slots than this are used
+    int low_wm; // migration stops when less slots than this are used
+    atomic64_t nr_demoted;
+    atomic64_t nr_promoted;
+};
+
+#define BLDMS_MAX_STRIPES 8
+
+/**
+ * Devices the cold tier is striped on. Device 0 is the one owning the superblock;
+ * all devices have the same number of blocks. Logical block index L is stored in
+ * block L % nr_blocks_per_dev of device L / nr_blocks_per_dev, so offsets encode
+ * both the device and the block in it.
+*/
+struct bldms_stripes{
+
+    int nr_devs; // 1 if striping is disabled
+    int nr_blocks_per_dev;
+    struct block_device *bdevs[BLDMS_MAX_STRIPES]; // bdevs[0] is the sb one
+};
+
+/**
+ * Sides of a mirrored cold tier
+*/
+enum bldms_mirror_side{
+    BLDMS_MIRROR_SIDE_PRIMARY,
+    BLDMS_MIRROR_SIDE_MIRROR
+};
+
+/**
+ * States of the mirror device
+*/
+enum bldms_mirror_state{
+    BLDMS_MIRROR_OFFLINE, // misses writes, which are tracked in the dirty bitmap
+    BLDMS_MIRROR_RESYNC, // gets writes, while dirty regions are being copied
+    BLDMS_MIRROR_ONLINE // gets writes and serves reads
+};
+
+#define BLDMS_MIRROR_REGION_SHIFT 6 // blocks in a dirty region, as power of 2
+
+/**
+ * Two-way mirror of the cold tier. Every write goes to both sides, while reads
+ * are served by the side with fewer reads in flight.
+*/
+struct bldms_mirror{
+
+    struct block_device *bdev; // NULL if mirroring is disabled
+    int state; // enum bldms_mirror_state
+    unsigned long *dirty; // regions with writes the mirror missed
+    int nr_regions;
+    atomic_t inflight[2]; // reads submitted and not completed, per side
+    struct delayed_work resync_work;
+    atomic64_t nr_reads[2]; // reads submitted, per side
+    errseq_t wb_err; // writeback errors of the mirror device already handled
+};
+
+/**
+ * Value of the engine field of the superblock of devices formatted for the
+ * log-structured engine. Any other value means the block engine.
+*/
+#define BLDMS_ENGINE_LOG 0x4c4f47
+
+/**
+ * A segment of the log-structured engine: a run of contiguous blocks where
+ * records are appended.
+*/
+struct bldms_log_segment{
+
+    u32 seq; // order in which segments were opened, 0 if the segment is free
+    int used; // bytes appended to the segment, including headers
+    int live; // bytes of records holding valid data
+};
+
+/**
+ * Log-structured engine. Messages are appended as variable length records in
+ * the head segment, and an in memory index tells where the record of each
+ * message offset is. A cleaner reclaims segments with little valid data left,
+ * moving their valid records to the head segment.
+*/
+struct bldms_log{
+
+    bool enabled; // true if the device has been formatted for this engine
+    int segment_blocks;
+    int nr_segments;
+    int nr_free; // segments with seq 0
+    struct bldms_log_segment *segments;
+    int head; // segment receiving appends, or -1
+    int head_off; // append position in the head segment, in bytes
+    u32 next_seq;
+    int next_id; // offset of the next message
+    struct xarray index; // message offset -> position and length of its record
+    /**
+     * Where the last read stopped: valid messages from offset cursor_id on
+     * start at cursor_pos of the stream. Reads going on from there walk the
+     * index from cursor_id instead of from the first message.
+    */
+    spinlock_t cursor_lock;
+    unsigned long cursor_id;
+    loff_t cursor_pos;
+    unsigned long cursor_gen; // bumped whenever messages move back in the stream
+    struct delayed_work cleaner;
+    unsigned long interval; // jiffies between two cleaner passes
+    int clean_pct; // segments with less valid data than this percent get cleaned
+    atomic64_t nr_cleaned; // reclaimed segments
+    atomic64_t nr_moved; // records moved by the cleaner
+};
+
+/**
+ * Direct view of the data of the device. It is available when the device is
+ * a bldms RAM disk, so that blocks are moved from/to its memory without going
+ * through the buffer cache and the request queue.
+*/
+struct bldms_direct{
+
+    u8 *data; // NULL if the device must be accessed through buffer heads
+    size_t size; // bytes of data
+};
+
+/**
+ * Index of the stream of valid data, mapping byte offsets of the stream to the
+ * blocks holding them. Blocks entering the used list take the next slot, and
+ * a Fenwick tree over slots keeps the data size of each block, so that the
+ * block holding any offset is found in O(log n) instead of walking the list.
+*/
+struct bldms_stream{
+
+    struct mutex lock;
+    bool ready; // false until built at mount, offsets are then found walking the list
+    int capacity;   // slots available before they are compacted
+    int nr_slots;   // slots taken so far
+    int *slot_of;   // slot of each block with valid data, else -1
+    int *block_at;  // block in each slot, -1 if it left the stream
+    int *size_at;   // data size of the block in each slot
+    s64 *tree;  // Fenwick tree of sizes over slots, 1-based
+};
+
+/**
+ * Budget of blocks left dirty in the page cache by write-back writes. Once it
+ * is exceeded, producers are paced while dirty blocks are written back in
+ * background.
+*/
+struct bldms_dirty{
+
+    int budget; // dirty blocks allowed before producers are paced, 0 if unlimited
+    unsigned long max_pause; // longest pause of a producer, in jiffies
+    atomic_t nr_dirty; // blocks dirtied and not yet written back
+    struct work_struct flush_work;
+    atomic64_t throttle_us; // time producers spent paced
+};
+
+#define BLDMS_MAX_ZONES 4
+
+/**
+ * A run of data blocks of the same size class. Blocks smaller than the device
+ * block are packed in it, slots_per_block at a time.
+*/
+struct bldms_zone{
+
+    size_t slot_size; // size of each block of the zone in bytes, header included
+    int slots_per_block; // blocks of the zone held by a device block
+    int first_index; // logical index of the first block of the zone
+    int nr_slots; // blocks of the zone
+    int first_dev_block; // device block holding the first block of the zone
+    struct bldms_blocks_head free_blocks; // blocks of the zone with invalid data
+};
+
+/**
+ * Size-class zones of the data blocks. Devices without zones have data blocks
+ * of the device block size, all linked in the free list of the block layer.
+*/
+struct bldms_zones{
+
+    int nr_zones; // 0 if the device has no zones
+    struct bldms_zone zone[BLDMS_MAX_ZONES];
+};
+
 #define bldms_blocks_foreach_index(block_)\
     for (; block_->header.index != -1;\
      block_->header.index = block_->header.next)
@@ -37,19 +306,44 @@ struct bldms_block_layer {
     struct super_block *sb; // superblock of the fs owning the block layer
     bool mounted; // true if the fs owning the block layer is mounted
     spinlock_t mounted_lock;
-    atomic_t users; // number of users of the block layer
+    /**
+     * Held by each user of the block layer. It is alive while the fs owning the
+     * block layer is mounted, and it is killed to unmount it, so that no new user
+     * can come in. users_done is completed when the last user leaves.
+    */
+    struct percpu_ref users;
+    struct completion users_done;
     size_t block_size; // size of a block in bytes
     int nr_blocks; // number of blocks in the device
     struct bldms_blocks_head free_blocks; // list of blocks containing invalid data
     struct bldms_blocks_head used_blocks; // list of blocks containing valid data
     struct srcu_struct srcu;
-    struct completion in_progress_write;
+    /**
+     * Write sections. Writers which can relink any block take it exclusively.
+     * Invalidations only relink a block and its neighbours, so they take it
+     * shared and lock those blocks with their bit in block_locks, in index order,
+     * allowing invalidations of non adjacent blocks to proceed in parallel.
+    */
+    struct rw_semaphore write_sem;
+    unsigned long *block_locks;
+    struct mutex lists_lock; // list heads and free lists, taken by shared writers
     int start_data_index; // index of the first block containing data
+    /**
+     * If true, the device behaves as a ring buffer: data put into a full device
+     * takes the place of the oldest valid data.
+    */
+    bool ring;
     /**
      * Saves b_layer state to disk.
      * Implementation is chosen by the fs owning the block layer.
     */
     int(*save_state)(struct bldms_block_layer *b_layer);
+    /**
+     * Tells the fs owning the block layer that the stream of valid data changed
+     * from the given offset onward. It is called by writers, with the used list
+     * already relinked. May be NULL.
+    */
+    void(*stream_changed)(struct bldms_block_layer *b_layer, loff_t from);
     /**
      * Keeps states of bldms_read() opened sessions. Only changes to
      * list frame are RCU protected, not the read states themselves.
@@ -58,16 +352,45 @@ struct bldms_block_layer {
      * perform it's job, vanishing the RCU advantages.
     */
     struct srcu_list read_states;
+    struct bldms_block_map map;
+    struct bldms_compactor compactor;
+    struct bldms_tier tier;
+    struct bldms_stripes stripes;
+    struct bldms_mirror mirror;
+    struct bldms_log log;
+    struct bldms_direct direct;
+    struct bldms_zones zones;
+    struct bldms_dirty dirty;
+    struct bldms_stream stream;
+    /**
+     * Readers following the stream wait here for new data. data_seq grows
+     * each time data is appended, so that they can tell whether they missed it.
+    */
+    wait_queue_head_t data_wait;
+    atomic64_t data_seq;
 };
 
 int bldms_block_layer_init(struct bldms_block_layer *b_layer,
  size_t block_size, int nr_blocks);
 void bldms_block_layer_clean(struct bldms_block_layer *b_layer);
+void bldms_block_layer_exit(struct bldms_block_layer *b_layer);
 int bldms_block_layer_register_sb(struct bldms_block_layer *b_layer,
  struct super_block *sb);
+void bldms_block_layer_unregister_sb(struct bldms_block_layer *b_layer);
 
 int bldms_move_block(struct bldms_block_layer *b_layer,
  struct bldms_block *block, int direction);
+int bldms_move_blocks(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, int nr_blocks, int direction);
+int bldms_move_block_phys(struct bldms_block_layer *b_layer,
+ struct bldms_block *block, int phys, int direction);
+int bldms_move_blocks_at(struct bldms_block_layer *b_layer,
+ struct bldms_block **blocks, const struct bldms_block_loc *locs, int nr_blocks,
+ int direction);
+void bldms_prefetch_block(struct bldms_block_layer *b_layer, int index);
+void bldms_data_appended(struct bldms_block_layer *b_layer);
+void bldms_block_layer_set_direct(struct bldms_block_layer *b_layer, u8 *data,
+ size_t size);
 bool bldms_block_contains_valid_data(struct bldms_block_layer *b_layer, 
  struct bldms_block *block);
 void bldms_reserve_first_blocks(struct bldms_block_layer *b_layer, int nr_blocks);
@@ -75,26 +398,216 @@ void bldms_start_read(struct bldms_block_layer *b_layer, int *reader_id);
 void bldms_end_read(struct bldms_block_layer *b_layer, int reader_id);
 void bldms_start_write(struct bldms_block_layer *b_layer);
 void bldms_end_write(struct bldms_block_layer *b_layer);
+void bldms_start_write_shared(struct bldms_block_layer *b_layer);
+void bldms_end_write_shared(struct bldms_block_layer *b_layer);
+int bldms_block_locks_alloc(struct bldms_block_layer *b_layer);
 int bldms_invalidate_block(struct bldms_block_layer *b_layer,
  struct bldms_block *block);
 int bldms_validate_block(struct bldms_block_layer *b_layer,
  struct bldms_block *block);
-int bldms_get_free_block_any_index(struct bldms_block_layer *b_layer, 
+int bldms_get_free_block_any_index(struct bldms_block_layer *b_layer, size_t size,
  struct bldms_block **block);
+int bldms_get_oldest_block(struct bldms_block_layer *b_layer,
+ struct bldms_block **block);
+int bldms_recycle_block(struct bldms_block_layer *b_layer,
+ struct bldms_block *block);
+
+// block_map.c
+int bldms_block_map_load(struct bldms_block_layer *b_layer, const int *logical);
+const int *bldms_block_map_snapshot(struct bldms_block_layer *b_layer);
+void bldms_block_map_clean(struct bldms_block_layer *b_layer);
+int bldms_block_map_swap(struct bldms_block_layer *b_layer,
+ struct bldms_block *valid, struct bldms_block *free);
+
+// block_scan.c
+int bldms_block_scan(struct bldms_block_layer *b_layer, struct super_block *sb,
+ int nr_workers, int batch);
+
+// block_stream.c
+void bldms_stream_init(struct bldms_block_layer *b_layer);
+int bldms_stream_reset(struct bldms_block_layer *b_layer);
+void bldms_stream_clean(struct bldms_block_layer *b_layer);
+loff_t bldms_stream_append(struct bldms_block_layer *b_layer, int index, int size);
+loff_t bldms_stream_remove(struct bldms_block_layer *b_layer, int index);
+void bldms_stream_changed(struct bldms_block_layer *b_layer, loff_t from);
+int bldms_stream_seek(struct bldms_block_layer *b_layer, loff_t off, int *index,
+ loff_t *cursor);
+int bldms_stream_seek_nowait(struct bldms_block_layer *b_layer, loff_t off,
+ int *index, loff_t *cursor);
+loff_t bldms_stream_size(struct bldms_block_layer *b_layer);
+loff_t bldms_stream_size_nowait(struct bldms_block_layer *b_layer);
+loff_t bldms_stream_offset(struct bldms_block_layer *b_layer, int index);
+loff_t bldms_stream_offset_nowait(struct bldms_block_layer *b_layer, int index);
+int bldms_stream_next(struct bldms_block_layer *b_layer, int index, int *blocks,
+ int nr);
+int bldms_stream_export(struct bldms_block_layer *b_layer, int **entries);
+int bldms_stream_import(struct bldms_block_layer *b_layer, const int *entries,
+ int nr_entries);
+
+// block_zone.c
+int bldms_zones_add(struct bldms_block_layer *b_layer, size_t slot_size,
+ int nr_dev_blocks, int first_free_bi, int last_free_bi);
+void bldms_zones_clear(struct bldms_block_layer *b_layer);
+struct bldms_blocks_head *bldms_block_free_list(struct bldms_block_layer *b_layer,
+ int index);
+struct bldms_blocks_head *bldms_zones_fit(struct bldms_block_layer *b_layer,
+ size_t size);
+void bldms_zone_fix_capacity(struct bldms_block_layer *b_layer,
+ struct bldms_block *block);
+
+/**
+ * @return the zone of the given logical block, or NULL if it belongs to none
+*/
+static inline struct bldms_zone *bldms_zone_of(struct bldms_block_layer *b_layer,
+ int index){
+
+    struct bldms_zone *zone;
+    int z;
+
+    for (z = 0; z < b_layer->zones.nr_zones; z++){
+        zone = &b_layer->zones.zone[z];
+        if (index >= zone->first_index && index < zone->first_index + zone->nr_slots){
+            return zone;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return where the given logical block starts in the device block holding it,
+ * in bytes
+*/
+static inline size_t bldms_block_offset(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_zone *zone;
+
+    zone = bldms_zone_of(b_layer, index);
+    if (!zone){
+        return 0;
+    }
+    return ((index - zone->first_index) % zone->slots_per_block) * zone->slot_size;
+}
+
+/**
+ * @return the physical block currently holding the given logical block
+*/
+static inline int bldms_block_phys(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_zone *zone;
+
+    // blocks of zones are never relocated
+    zone = bldms_zone_of(b_layer, index);
+    if (zone){
+        return zone->first_dev_block
+         + (index - zone->first_index) / zone->slots_per_block;
+    }
+    if (!b_layer->map.phys || index < 0 || index >= b_layer->nr_blocks){
+        return index;
+    }
+    return READ_ONCE(b_layer->map.phys[index]);
+}
+
+// block_tier.c
+void bldms_tier_init(struct bldms_block_layer *b_layer);
+int bldms_tier_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ const char *hot_path,
+ bool promote, unsigned int interval_ms, int batch, int high_pct, int low_pct);
+void bldms_tier_detach(struct bldms_block_layer *b_layer);
+int bldms_tier_admit(struct bldms_block_layer *b_layer, struct bldms_block *block);
+void bldms_tier_mark_invalid(struct bldms_block_layer *b_layer, int index);
+void bldms_tier_touch(struct bldms_block_layer *b_layer, int index);
+
+/**
+ * @return where the given logical block is currently stored
+*/
+static inline struct bldms_block_loc bldms_block_locate(
+ struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_block_loc loc = {
+        .tier = BLDMS_TIER_COLD,
+        .nr = bldms_block_phys(b_layer, index)
+    };
+    int slot;
+
+    if (b_layer->tier.hot_slot && index >= 0 && index < b_layer->nr_blocks){
+        slot = READ_ONCE(b_layer->tier.hot_slot[index]);
+        if (slot >= 0){
+            loc.tier = BLDMS_TIER_HOT;
+            loc.nr = slot;
+        }
+    }
+    return loc;
+}
+
+// block_stripe.c
+int bldms_stripes_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ char **paths, int nr_paths, int nr_blocks_per_dev);
+void bldms_stripes_detach(struct bldms_block_layer *b_layer);
 
-#define bldms_if_mounted(b_layer__, do_){\
-    spin_lock(&b_layer__->mounted_lock);\
-    if (!b_layer__->mounted){\
-        spin_unlock(&b_layer__->mounted_lock);\
+// block_mirror.c
+void bldms_mirror_init(struct bldms_block_layer *b_layer);
+int bldms_mirror_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ const char *path);
+void bldms_mirror_detach(struct bldms_block_layer *b_layer);
+void bldms_mirror_set_online(struct bldms_block_layer *b_layer, bool online);
+struct buffer_head *bldms_mirror_balance_read(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh, int *side);
+struct buffer_head *bldms_mirror_read_failed(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh, int *side);
+void bldms_mirror_read_done(struct bldms_block_layer *b_layer, int side);
+struct buffer_head *bldms_mirror_write(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh);
+void bldms_mirror_write_failed(struct bldms_block_layer *b_layer, sector_t nr);
+int bldms_mirror_flush(struct bldms_block_layer *b_layer);
+
+// block_log.c
+void bldms_log_init(struct bldms_block_layer *b_layer);
+int bldms_log_load(struct bldms_block_layer *b_layer, struct super_block *sb,
+ int segment_blocks);
+void bldms_log_unload(struct bldms_block_layer *b_layer);
+void bldms_log_start_cleaner(struct bldms_block_layer *b_layer,
+ unsigned int interval_ms, int clean_pct);
+int bldms_log_put(struct bldms_block_layer *b_layer, const void *data, size_t size);
+int bldms_log_get(struct bldms_block_layer *b_layer, int offset, void *buf,
+ size_t size);
+int bldms_log_invalidate(struct bldms_block_layer *b_layer, int offset);
+ssize_t bldms_log_read(struct bldms_block_layer *b_layer, struct iov_iter *to,
+ loff_t *off);
+
+// block_dirty.c
+void bldms_dirty_init(struct bldms_block_layer *b_layer);
+void bldms_dirty_start(struct bldms_block_layer *b_layer, int budget,
+ unsigned int max_pause_ms);
+void bldms_dirty_stop(struct bldms_block_layer *b_layer);
+void bldms_dirty_account(struct bldms_block_layer *b_layer, int nr_blocks);
+void bldms_dirty_throttle(struct bldms_block_layer *b_layer);
+
+// block_compact.c
+void bldms_compact_init(struct bldms_block_layer *b_layer);
+void bldms_compact_start(struct bldms_block_layer *b_layer,
+ unsigned int interval_ms, int batch);
+void bldms_compact_stop(struct bldms_block_layer *b_layer);
+
+// block_stats.c
+int bldms_block_layer_stats_init(struct bldms_block_layer *b_layer_ref,
+ const char *stats_dirname);
+void bldms_block_layer_stats_cleanup(void);
+
+/**
+ * Takes a reference to the block layer on behalf of the caller, which returns
+ * -ENODEV if the fs owning the block layer is not mounted.
+ * Only per cpu counters are touched while mounted, so users running on
+ * different cpus do not contend for the same cache line.
+*/
+#define bldms_block_layer_use(b_layer_){\
+    if (!percpu_ref_tryget_live(&b_layer_->users)){\
         pr_err("%s: device is not mounted\n", __func__);\
         return -ENODEV;\
     }\
-    do_;\
-    spin_unlock(&b_layer__->mounted_lock);\
 }
 
-#define bldms_block_layer_use(b_layer_) bldms_if_mounted(b_layer_, atomic_add(1, &b_layer_->users));
-
-void bldms_block_layer_put(struct bldms_block_layer *b_layer_);
+static inline void bldms_block_layer_put(struct bldms_block_layer *b_layer_){
+    percpu_ref_put(&b_layer_->users);
+}
 
 #endif // BLOCK_LAYER_H
\ No newline at end of file
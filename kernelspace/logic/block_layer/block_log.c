@@ -0,0 +1,743 @@
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/buffer_head.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/srcu.h>
+
+#include "block_layer.h"
+
+/**
+ * Log-structured engine.
+ *
+ * The data blocks of the device are split in segments of segment_blocks blocks.
+ * put_data() appends a record holding the message at the head segment, so
+ * messages take only the space they need and writes are sequential. Records
+ * never span two blocks, thus messages are at most as big as a block minus
+ * the headers.
+ *
+ * The offset of a message is an increasing id, and the index maps it to the
+ * position of its record. Ids increase in put order, so the stream is read
+ * by walking the index in id order, from a cursor left where the last read
+ * stopped unless invalidations moved the stream back before it.
+ *
+ * invalidate_data() clears the valid flag of the record in place. The cleaner
+ * picks the segment with the least valid data, moves its valid records to the
+ * head and frees it after a grace period, so readers which found the old
+ * position in the index can still read it. One free segment is always kept for
+ * the cleaner, so it can make room even when the device is full.
+ *
+ * The index is rebuilt at mount time by scanning the segments. If a crash left
+ * a record in two segments, the copy in the most recent segment wins.
+*/
+
+#define BLDMS_LOG_SEGMENT_MAGIC 0x424c4f47
+#define BLDMS_LOG_RECORD_MAGIC 0x5245
+#define BLDMS_LOG_RECORD_VALID 0x1
+
+struct bldms_log_segment_header{
+
+    u32 magic;
+    u32 seq;
+    s32 first_id; // offset of the first message put in the segment
+    u32 reserved;
+};
+
+struct bldms_log_record_header{
+
+    u16 magic;
+    u16 len; // size of the message
+    u32 flags;
+    s32 id; // offset of the message
+};
+
+#define bldms_log_record_size(len_)\
+    (sizeof(struct bldms_log_record_header) + round_up((len_), 4))
+
+/**
+ * Index entries pack the position of the record in the log with the length
+ * of its message
+*/
+#define bldms_log_entry(pos_, len_) xa_mk_value(((unsigned long)(pos_) << 16) | (len_))
+#define bldms_log_entry_pos(entry_) (xa_to_value(entry_) >> 16)
+#define bldms_log_entry_len(entry_) ((int)(xa_to_value(entry_) & 0xffff))
+
+static inline int bldms_log_segment_size(struct bldms_block_layer *b_layer){
+    return b_layer->log.segment_blocks * b_layer->block_size;
+}
+
+/**
+ * @return the device block holding the given position of the log
+*/
+static inline sector_t bldms_log_block(struct bldms_block_layer *b_layer,
+ unsigned long pos){
+    return b_layer->start_data_index + pos / b_layer->block_size;
+}
+
+/**
+ * Marks a block of the log dirty. Records share blocks, so only blocks which
+ * were clean count against the dirty budget.
+*/
+static void bldms_log_write_bh(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh){
+
+    bool was_dirty;
+
+    was_dirty = buffer_dirty(bh);
+    mark_buffer_dirty(bh);
+    if (!was_dirty){
+        bldms_dirty_account(b_layer, 1);
+    }
+#ifdef BLDMS_BLOCK_SYNC_IO
+    if (sync_dirty_buffer(bh)){
+        pr_err("%s: failed to sync block %llu\n", __func__,
+         (unsigned long long)bh->b_blocknr);
+    }
+#endif
+}
+
+/**
+ * Zeroes a free segment and makes it the head of the log.
+ * @param cleaning: true if the caller is the cleaner, which can take the last
+ * free segment
+ * @return 0 if success, -ENOMEM if no segment can be opened, else -1
+*/
+static int bldms_log_open_segment(struct bldms_block_layer *b_layer, bool cleaning){
+
+    struct bldms_log *log;
+    struct bldms_log_segment_header header;
+    struct buffer_head *bh;
+    int seg;
+    int b;
+
+    log = &b_layer->log;
+    if (log->nr_free == 0 || (!cleaning && log->nr_free == 1)){
+        return -ENOMEM;
+    }
+    for (seg = 0; seg < log->nr_segments && log->segments[seg].seq; seg++);
+
+    header.magic = BLDMS_LOG_SEGMENT_MAGIC;
+    header.seq = log->next_seq;
+    header.first_id = log->next_id;
+    header.reserved = 0;
+
+    for (b = 0; b < log->segment_blocks; b++){
+        bh = sb_getblk(b_layer->sb, b_layer->start_data_index
+         + seg * log->segment_blocks + b);
+        if (!bh){
+            pr_err("%s: failed to get block %d of segment %d\n", __func__, b, seg);
+            return -1;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, bh->b_size);
+        if (b == 0){
+            memcpy(bh->b_data, &header, sizeof(header));
+        }
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        bldms_log_write_bh(b_layer, bh);
+        brelse(bh);
+    }
+
+    log->segments[seg].seq = log->next_seq++;
+    log->segments[seg].used = sizeof(header);
+    log->segments[seg].live = 0;
+    log->nr_free --;
+    log->head = seg;
+    log->head_off = sizeof(header);
+    pr_debug("%s: segment %d opened with seq %u\n", __func__, seg, header.seq);
+    return 0;
+}
+
+/**
+ * Appends a record at the head of the log, and points the index entry of the
+ * message to it. Caller must be in a write section.
+ * @return 0 if success, -ENOMEM if the log is full, else -1
+*/
+static int bldms_log_append(struct bldms_block_layer *b_layer, int id,
+ const void *data, int len, bool cleaning){
+
+    struct bldms_log *log;
+    struct bldms_log_record_header header;
+    struct buffer_head *bh;
+    unsigned long pos;
+    int rec_size;
+    int block_off;
+    int res;
+
+    log = &b_layer->log;
+    rec_size = bldms_log_record_size(len);
+
+    // records do not span blocks
+    block_off = log->head_off % b_layer->block_size;
+    if (log->head >= 0 && block_off + rec_size > b_layer->block_size){
+        log->head_off += b_layer->block_size - block_off;
+    }
+    if (log->head < 0 || log->head_off >= bldms_log_segment_size(b_layer)){
+        res = bldms_log_open_segment(b_layer, cleaning);
+        if (res < 0){
+            return res;
+        }
+    }
+
+    pos = (unsigned long)log->head * bldms_log_segment_size(b_layer) + log->head_off;
+    bh = sb_bread(b_layer->sb, bldms_log_block(b_layer, pos));
+    if (!bh){
+        pr_err("%s: failed to read block of position %lu\n", __func__, pos);
+        return -1;
+    }
+    header.magic = BLDMS_LOG_RECORD_MAGIC;
+    header.len = len;
+    header.flags = BLDMS_LOG_RECORD_VALID;
+    header.id = id;
+    memcpy(bh->b_data + pos % b_layer->block_size, &header, sizeof(header));
+    memcpy(bh->b_data + pos % b_layer->block_size + sizeof(header), data, len);
+    bldms_log_write_bh(b_layer, bh);
+    brelse(bh);
+
+    log->head_off += rec_size;
+    log->segments[log->head].used = log->head_off;
+    log->segments[log->head].live += rec_size;
+
+    return xa_err(xa_store(&log->index, id, bldms_log_entry(pos, len), GFP_KERNEL));
+}
+
+/**
+ * Moves the valid records of the given segment to the head of the log, then
+ * frees the segment. Caller must be in a write section.
+ * @return 0 if success, else -1
+*/
+static int bldms_log_clean_segment(struct bldms_block_layer *b_layer, int seg){
+
+    struct bldms_log *log;
+    struct bldms_log_record_header header;
+    struct buffer_head *bh;
+    unsigned long pos;
+    void *entry;
+    u8 *data;
+    int off;
+    int b;
+    int res;
+
+    log = &b_layer->log;
+    res = 0;
+    data = kmalloc(b_layer->block_size, GFP_KERNEL);
+    if (!data){
+        return -1;
+    }
+
+    for (b = 0; b < log->segment_blocks && !res; b++){
+        pos = (unsigned long)seg * bldms_log_segment_size(b_layer) + b * b_layer->block_size;
+        bh = sb_bread(b_layer->sb, bldms_log_block(b_layer, pos));
+        if (!bh){
+            res = -1;
+            break;
+        }
+        off = (b == 0)? sizeof(struct bldms_log_segment_header) : 0;
+        while (off + sizeof(header) <= b_layer->block_size){
+            memcpy(&header, bh->b_data + off, sizeof(header));
+            if (header.magic != BLDMS_LOG_RECORD_MAGIC){
+                break;
+            }
+            entry = xa_load(&log->index, header.id);
+            // only the record the index points to is valid
+            if ((header.flags & BLDMS_LOG_RECORD_VALID) && entry
+             && bldms_log_entry_pos(entry) == pos + off){
+                memcpy(data, bh->b_data + off + sizeof(header), header.len);
+                res = bldms_log_append(b_layer, header.id, data, header.len, true);
+                if (res < 0){
+                    pr_err("%s: failed to move record of message %d\n", __func__,
+                     header.id);
+                    break;
+                }
+                atomic64_inc(&log->nr_moved);
+            }
+            off += bldms_log_record_size(header.len);
+        }
+        brelse(bh);
+    }
+    kfree(data);
+    if (res < 0){
+        return -1;
+    }
+
+    // readers can still be reading old positions of the moved records
+    synchronize_srcu(&b_layer->srcu);
+
+    bh = sb_bread(b_layer->sb, bldms_log_block(b_layer,
+     (unsigned long)seg * bldms_log_segment_size(b_layer)));
+    if (!bh){
+        return -1;
+    }
+    memset(bh->b_data, 0, sizeof(struct bldms_log_segment_header));
+    bldms_log_write_bh(b_layer, bh);
+    brelse(bh);
+
+    log->segments[seg].seq = 0;
+    log->segments[seg].used = 0;
+    log->segments[seg].live = 0;
+    log->nr_free ++;
+    atomic64_inc(&log->nr_cleaned);
+    pr_debug("%s: segment %d cleaned\n", __func__, seg);
+    return 0;
+}
+
+/**
+ * Cleans the segment with the smallest fraction of valid data, if it is below
+ * clean_pct percent, or in any case if force is true.
+ * Caller must be in a write section.
+ * @return 0 if a segment has been cleaned, else -1
+*/
+static int bldms_log_clean(struct bldms_block_layer *b_layer, bool force){
+
+    struct bldms_log *log;
+    struct bldms_log_segment *segment;
+    int victim;
+    int seg;
+
+    log = &b_layer->log;
+    victim = -1;
+    for (seg = 0; seg < log->nr_segments; seg++){
+        segment = &log->segments[seg];
+        if (!segment->seq || seg == log->head){
+            continue;
+        }
+        if (victim < 0 || (long)segment->live * log->segments[victim].used
+         < (long)log->segments[victim].live * segment->used){
+            victim = seg;
+        }
+    }
+    if (victim < 0){
+        return -1;
+    }
+    segment = &log->segments[victim];
+    if (!force && segment->live * 100 >= log->clean_pct * segment->used){
+        return -1;
+    }
+    return bldms_log_clean_segment(b_layer, victim);
+}
+
+static void bldms_log_cleaner_work(struct work_struct *work){
+
+    struct bldms_log *log;
+    struct bldms_block_layer *b_layer;
+
+    log = container_of(to_delayed_work(work), struct bldms_log, cleaner);
+    b_layer = container_of(log, struct bldms_block_layer, log);
+
+    bldms_start_write(b_layer);
+    bldms_log_clean(b_layer, false);
+    bldms_end_write(b_layer);
+
+    queue_delayed_work(system_long_wq, &log->cleaner, log->interval);
+}
+
+void bldms_log_init(struct bldms_block_layer *b_layer){
+
+    xa_init(&b_layer->log.index);
+    spin_lock_init(&b_layer->log.cursor_lock);
+    INIT_DELAYED_WORK(&b_layer->log.cleaner, bldms_log_cleaner_work);
+}
+
+/**
+ * Moves the read cursor back to the first message, since the messages after
+ * the one at offset have moved back in the stream.
+*/
+static void bldms_log_cursor_reset(struct bldms_log *log, unsigned long offset){
+
+    spin_lock(&log->cursor_lock);
+    if (offset < log->cursor_id){
+        log->cursor_id = 0;
+        log->cursor_pos = 0;
+    }
+    // reads walking the index meanwhile must not store what they found
+    log->cursor_gen ++;
+    spin_unlock(&log->cursor_lock);
+}
+
+/**
+ * Scans a segment, adding its valid records to the index.
+ * @return 0 if success, else -1
+*/
+static int bldms_log_load_segment(struct bldms_block_layer *b_layer,
+ struct super_block *sb, int seg){
+
+    struct bldms_log *log;
+    struct bldms_log_record_header header;
+    struct bldms_log_segment *other;
+    struct buffer_head *bh;
+    unsigned long pos;
+    void *entry;
+    int off;
+    int b;
+
+    log = &b_layer->log;
+    for (b = 0; b < log->segment_blocks; b++){
+        pos = (unsigned long)seg * bldms_log_segment_size(b_layer) + b * b_layer->block_size;
+        bh = sb_bread(sb, bldms_log_block(b_layer, pos));
+        if (!bh){
+            pr_err("%s: failed to read block %d of segment %d\n", __func__, b, seg);
+            return -1;
+        }
+        off = (b == 0)? sizeof(struct bldms_log_segment_header) : 0;
+        while (off + sizeof(header) <= b_layer->block_size){
+            memcpy(&header, bh->b_data + off, sizeof(header));
+            if (header.magic != BLDMS_LOG_RECORD_MAGIC){
+                break;
+            }
+            log->segments[seg].used = pos - (unsigned long)seg * bldms_log_segment_size(b_layer)
+             + off + bldms_log_record_size(header.len);
+            log->next_id = max(log->next_id, header.id + 1);
+
+            if (header.flags & BLDMS_LOG_RECORD_VALID){
+                entry = xa_load(&log->index, header.id);
+                if (entry){
+                    // the record was being moved: the most recent copy wins
+                    other = &log->segments[bldms_log_entry_pos(entry)
+                     / bldms_log_segment_size(b_layer)];
+                    if (other->seq > log->segments[seg].seq){
+                        off += bldms_log_record_size(header.len);
+                        continue;
+                    }
+                    other->live -= bldms_log_record_size(bldms_log_entry_len(entry));
+                }
+                if (xa_is_err(xa_store(&log->index, header.id,
+                 bldms_log_entry(pos + off, header.len), GFP_KERNEL))){
+                    brelse(bh);
+                    return -1;
+                }
+                log->segments[seg].live += bldms_log_record_size(header.len);
+            }
+            off += bldms_log_record_size(header.len);
+        }
+        brelse(bh);
+    }
+    return 0;
+}
+
+/**
+ * Rebuilds the state of the log from the device mounted from sb.
+ * @param segment_blocks: blocks in a segment
+ * @return 0 if success, else -1
+*/
+int bldms_log_load(struct bldms_block_layer *b_layer, struct super_block *sb,
+ int segment_blocks){
+
+    struct bldms_log *log;
+    struct bldms_log_segment_header header;
+    struct buffer_head *bh;
+    int seg;
+
+    might_sleep();
+    log = &b_layer->log;
+
+    if (b_layer->block_size > (1 << 16) || segment_blocks <= 0){
+        pr_err("%s: unsupported block size %lu or segment size %d\n", __func__,
+         b_layer->block_size, segment_blocks);
+        return -1;
+    }
+    log->segment_blocks = segment_blocks;
+    log->nr_segments = (b_layer->nr_blocks - b_layer->start_data_index) / segment_blocks;
+    if (log->nr_segments < 2){
+        pr_err("%s: device too small for segments of %d blocks\n", __func__,
+         segment_blocks);
+        return -1;
+    }
+    log->segments = kvcalloc(log->nr_segments, sizeof(struct bldms_log_segment),
+     GFP_KERNEL);
+    if (!log->segments){
+        pr_err("%s: failed to allocate segments\n", __func__);
+        return -1;
+    }
+    log->nr_free = 0;
+    log->head = -1;
+    log->head_off = 0;
+    log->next_seq = 1;
+    log->next_id = b_layer->start_data_index;
+    bldms_log_cursor_reset(log, ULONG_MAX);
+
+    // segment headers first, so that duplicates can be resolved by seq
+    for (seg = 0; seg < log->nr_segments; seg++){
+        bh = sb_bread(sb, b_layer->start_data_index + seg * segment_blocks);
+        if (!bh){
+            pr_err("%s: failed to read segment %d\n", __func__, seg);
+            goto bldms_log_load_error;
+        }
+        memcpy(&header, bh->b_data, sizeof(header));
+        brelse(bh);
+
+        if (header.magic != BLDMS_LOG_SEGMENT_MAGIC || !header.seq){
+            log->nr_free ++;
+            continue;
+        }
+        log->segments[seg].seq = header.seq;
+        log->segments[seg].used = sizeof(header);
+        log->next_seq = max(log->next_seq, header.seq + 1);
+        log->next_id = max(log->next_id, header.first_id);
+        if (log->head < 0 || header.seq > log->segments[log->head].seq){
+            log->head = seg;
+        }
+    }
+    for (seg = 0; seg < log->nr_segments; seg++){
+        if (log->segments[seg].seq && bldms_log_load_segment(b_layer, sb, seg) < 0){
+            goto bldms_log_load_error;
+        }
+    }
+    if (log->head >= 0){
+        log->head_off = log->segments[log->head].used;
+    }
+
+    log->enabled = true;
+    pr_info("%s: log of %d segments loaded, %d free\n", __func__, log->nr_segments,
+     log->nr_free);
+    return 0;
+
+bldms_log_load_error:
+    xa_destroy(&log->index);
+    kvfree(log->segments);
+    log->segments = NULL;
+    return -1;
+}
+
+void bldms_log_start_cleaner(struct bldms_block_layer *b_layer,
+ unsigned int interval_ms, int clean_pct){
+
+    struct bldms_log *log = &b_layer->log;
+
+    log->clean_pct = clean_pct;
+    if (!interval_ms){
+        return;
+    }
+    log->interval = msecs_to_jiffies(interval_ms);
+    queue_delayed_work(system_long_wq, &log->cleaner, log->interval);
+}
+
+/**
+ * Stops the cleaner and drops the in memory state of the log.
+*/
+void bldms_log_unload(struct bldms_block_layer *b_layer){
+
+    struct bldms_log *log = &b_layer->log;
+
+    if (!log->enabled){
+        return;
+    }
+    cancel_delayed_work_sync(&log->cleaner);
+    xa_destroy(&log->index);
+    kvfree(log->segments);
+    log->segments = NULL;
+    log->enabled = false;
+}
+
+/**
+ * Appends a message to the log.
+ * @return the offset of the message, -ENOMEM if there is no room for it, else -1
+*/
+int bldms_log_put(struct bldms_block_layer *b_layer, const void *data, size_t size){
+
+    struct bldms_log *log;
+    int id;
+    int res;
+
+    log = &b_layer->log;
+    if (size > b_layer->block_size - sizeof(struct bldms_log_segment_header)
+     - sizeof(struct bldms_log_record_header)){
+        pr_err("%s: message of size %lu does not fit in a record\n", __func__, size);
+        return -1;
+    }
+
+    bldms_start_write(b_layer);
+
+    id = log->next_id;
+    res = bldms_log_append(b_layer, id, data, size, false);
+    // a full log is given a chance to reclaim space right away
+    if (res == -ENOMEM && bldms_log_clean(b_layer, true) == 0){
+        res = bldms_log_append(b_layer, id, data, size, false);
+    }
+    if (res == 0){
+        log->next_id ++;
+        res = id;
+        bldms_data_appended(b_layer);
+    }
+
+    bldms_end_write(b_layer);
+    return res;
+}
+
+/**
+ * Copies up to size bytes of the message at the given offset in buf.
+ * @return the bytes copied, -ENODATA if there is no valid message at offset,
+ * else -1
+*/
+int bldms_log_get(struct bldms_block_layer *b_layer, int offset, void *buf,
+ size_t size){
+
+    struct buffer_head *bh;
+    unsigned long pos;
+    void *entry;
+    int reader_id;
+    int res;
+
+    bldms_start_read(b_layer, &reader_id);
+
+    entry = xa_load(&b_layer->log.index, offset);
+    if (!entry){
+        res = -ENODATA;
+        goto bldms_log_get_exit;
+    }
+    pos = bldms_log_entry_pos(entry);
+    bh = sb_bread(b_layer->sb, bldms_log_block(b_layer, pos));
+    if (!bh){
+        pr_err("%s: failed to read message %d\n", __func__, offset);
+        res = -1;
+        goto bldms_log_get_exit;
+    }
+    res = min_t(size_t, size, bldms_log_entry_len(entry));
+    memcpy(buf, bh->b_data + pos % b_layer->block_size
+     + sizeof(struct bldms_log_record_header), res);
+    brelse(bh);
+
+bldms_log_get_exit:
+    bldms_end_read(b_layer, reader_id);
+    return res;
+}
+
+/**
+ * Invalidates the message at the given offset.
+ * @return 0 if success, -ENODATA if there is no valid message at offset, else -1
+*/
+int bldms_log_invalidate(struct bldms_block_layer *b_layer, int offset){
+
+    struct bldms_log *log;
+    struct bldms_log_record_header *header;
+    struct buffer_head *bh;
+    unsigned long pos;
+    void *entry;
+    int res;
+
+    log = &b_layer->log;
+    res = 0;
+    bldms_start_write(b_layer);
+
+    entry = xa_load(&log->index, offset);
+    if (!entry){
+        res = -ENODATA;
+        goto bldms_log_invalidate_exit;
+    }
+    pos = bldms_log_entry_pos(entry);
+    bh = sb_bread(b_layer->sb, bldms_log_block(b_layer, pos));
+    if (!bh){
+        pr_err("%s: failed to read message %d\n", __func__, offset);
+        res = -1;
+        goto bldms_log_invalidate_exit;
+    }
+    header = (struct bldms_log_record_header *)(bh->b_data + pos % b_layer->block_size);
+    header->flags &= ~BLDMS_LOG_RECORD_VALID;
+    bldms_log_write_bh(b_layer, bh);
+    brelse(bh);
+
+    xa_erase(&log->index, offset);
+    bldms_log_cursor_reset(log, offset);
+    log->segments[pos / bldms_log_segment_size(b_layer)].live -=
+     bldms_log_record_size(bldms_log_entry_len(entry));
+
+bldms_log_invalidate_exit:
+    bldms_end_write(b_layer);
+    return res;
+}
+
+/**
+ * Reads the stream of valid messages, in put order, starting from *off, until
+ * the given iterator is full. Messages are copied straight from the buffer heads
+ * of their blocks. The walk of the index starts from the read cursor, if *off
+ * is not before it, and the cursor is moved where the read stops.
+ * @return the bytes read, else -1 or -EFAULT if nothing could be copied
+*/
+ssize_t bldms_log_read(struct bldms_block_layer *b_layer, struct iov_iter *to,
+ loff_t *off){
+
+    struct bldms_log *log;
+    struct buffer_head *bh;
+    unsigned long id, start_id, next_id;
+    unsigned long pos;
+    unsigned long gen;
+    void *entry;
+    loff_t stream_cursor; // where the current message starts in the stream
+    loff_t next_cursor; // where the messages from next_id on start in the stream
+    loff_t b_start;
+    size_t b_len;
+    ssize_t read;
+    size_t len, copied;
+    int reader_id;
+
+    log = &b_layer->log;
+    read = 0;
+    len = iov_iter_count(to);
+    bldms_start_read(b_layer, &reader_id);
+
+    spin_lock(&log->cursor_lock);
+    gen = log->cursor_gen;
+    start_id = 0;
+    stream_cursor = 0;
+    if (log->cursor_pos <= *off){
+        start_id = log->cursor_id;
+        stream_cursor = log->cursor_pos;
+    }
+    spin_unlock(&log->cursor_lock);
+    next_id = start_id;
+    next_cursor = stream_cursor;
+
+    xa_for_each_start(&log->index, id, entry, start_id){
+        if (read == len) break;
+
+        if (stream_cursor + bldms_log_entry_len(entry) <= *off + read){
+            stream_cursor += bldms_log_entry_len(entry);
+            next_id = id + 1;
+            next_cursor = stream_cursor;
+            continue;
+        }
+        b_start = *off + read - stream_cursor;
+        b_len = min_t(size_t, bldms_log_entry_len(entry) - b_start, len - read);
+
+        pos = bldms_log_entry_pos(entry);
+        bh = sb_bread(b_layer->sb, bldms_log_block(b_layer, pos));
+        if (!bh){
+            pr_err("%s: failed to read message %lu\n", __func__, id);
+            read = -1;
+            goto bldms_log_read_exit;
+        }
+        copied = copy_to_iter(bh->b_data + pos % b_layer->block_size
+         + sizeof(struct bldms_log_record_header) + b_start, b_len, to);
+        brelse(bh);
+
+        read += copied;
+        if (copied < b_len){
+            // the caller's buffer faulted
+            if (!read) read = -EFAULT;
+            break;
+        }
+        stream_cursor += bldms_log_entry_len(entry);
+        // a message read in part is where the next read goes on from
+        if (b_start + b_len == bldms_log_entry_len(entry)){
+            next_id = id + 1;
+            next_cursor = stream_cursor;
+        }
+    }
+    if (read > 0){
+        *off += read;
+    }
+
+    // the cursor is stale if messages were invalidated during the walk
+    spin_lock(&log->cursor_lock);
+    if (gen == log->cursor_gen){
+        log->cursor_id = next_id;
+        log->cursor_pos = next_cursor;
+    }
+    spin_unlock(&log->cursor_lock);
+
+bldms_log_read_exit:
+    bldms_end_read(b_layer, reader_id);
+    return read;
+}
@@ -0,0 +1,170 @@
+#include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/buffer_head.h>
+#include <linux/srcu.h>
+
+#include "block_serialization.h"
+#include "block_layer.h"
+
+/**
+ * Builds the block map of the device from the logical block found in each
+ * physical block, by bldms_block_scan() or in the snapshot of the last clean
+ * unmount.
+ * A device which has never been compacted ends up with the identity map.
+ * 
+ * A relocation interrupted between the two copies of bldms_block_map_swap()
+ * leaves two physical blocks holding the same logical block, and none holding
+ * the other one. Both copies hold the same data, so the second one found is
+ * given the missing logical block instead, and every other block keeps its
+ * place. The same goes for physical blocks holding an index out of the device.
+ * @param logical: logical block held by each physical block, or NULL if each
+ * block is stored where its index says
+ * @return 0 if success, else -1
+*/
+int bldms_block_map_load(struct bldms_block_layer *b_layer, const int *logical){
+
+    struct bldms_block_map *map;
+    unsigned long *seen;
+    int *orphans;
+    int nr_orphans;
+    int index;
+    int p, o;
+
+    might_sleep();
+    map = &b_layer->map;
+
+    map->phys = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    map->logical = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    seen = bitmap_zalloc(b_layer->nr_blocks, GFP_KERNEL);
+    orphans = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    if (!map->phys || !map->logical || !seen || !orphans){
+        pr_err("%s: failed to allocate block map\n", __func__);
+        goto bldms_block_map_load_error;
+    }
+
+    // reserved blocks are never relocated
+    for (p = 0; p < b_layer->nr_blocks; p++){
+        map->phys[p] = p;
+        map->logical[p] = p;
+    }
+
+    // physical blocks whose logical block is taken or out of the device
+    nr_orphans = 0;
+    for (p = b_layer->start_data_index; logical && p < b_layer->nr_blocks; p++){
+        index = logical[p];
+        if (index < b_layer->start_data_index || index >= b_layer->nr_blocks
+         || test_and_set_bit(index, seen)){
+            orphans[nr_orphans++] = p;
+            continue;
+        }
+        map->phys[index] = p;
+        map->logical[p] = index;
+    }
+
+    // there are as many logical blocks held by no physical block as orphans
+    o = 0;
+    index = b_layer->start_data_index;
+    for_each_clear_bit_from(index, seen, b_layer->nr_blocks){
+        if (o == nr_orphans){
+            break;
+        }
+        p = orphans[o++];
+        pr_warn("%s: physical block %d holds block %d, held elsewhere or out of the device, giving it block %d\n",
+         __func__, p, logical[p], index);
+        map->phys[index] = p;
+        map->logical[p] = index;
+    }
+
+    bitmap_free(seen);
+    kvfree(orphans);
+    return 0;
+
+bldms_block_map_load_error:
+    bitmap_free(seen);
+    kvfree(orphans);
+    bldms_block_map_clean(b_layer);
+    return -1;
+}
+
+/**
+ * @return the logical block held by each physical block, or NULL if there is no
+ * map or no block has been relocated, so that the identity map can be rebuilt
+ * by bldms_block_map_load() with no entries
+*/
+const int *bldms_block_map_snapshot(struct bldms_block_layer *b_layer){
+
+    struct bldms_block_map *map;
+    int p;
+
+    map = &b_layer->map;
+    if (!map->logical){
+        return NULL;
+    }
+    for (p = 0; p < b_layer->nr_blocks; p++){
+        if (map->logical[p] != p){
+            return map->logical;
+        }
+    }
+    return NULL;
+}
+
+void bldms_block_map_clean(struct bldms_block_layer *b_layer){
+
+    kvfree(b_layer->map.phys);
+    kvfree(b_layer->map.logical);
+    b_layer->map.phys = NULL;
+    b_layer->map.logical = NULL;
+}
+
+/**
+ * Exchanges the physical blocks of a block containing valid data and of a free
+ * one. Both blocks must have been read by the caller, which must be in a
+ * write section.
+ * 
+ * Readers are never exposed to a half relocated block: the valid block is first
+ * copied in the physical block of the free one and published in the map, then
+ * its old physical block is overwritten only after a grace period, when nobody
+ * can be reading it anymore. Offsets and list links are logical, so they are
+ * not affected.
+ * @return 0 if success, else -1
+*/
+int bldms_block_map_swap(struct bldms_block_layer *b_layer,
+ struct bldms_block *valid, struct bldms_block *free){
+
+    struct bldms_block_map *map;
+    int valid_phys, free_phys;
+
+    might_sleep();
+    map = &b_layer->map;
+
+    if (!map->phys){
+        pr_err("%s: block map is not loaded\n", __func__);
+        return -1;
+    }
+    valid_phys = map->phys[valid->header.index];
+    free_phys = map->phys[free->header.index];
+
+    if (bldms_move_block_phys(b_layer, valid, free_phys, WRITE) < 0){
+        pr_err("%s: failed to copy block %d in physical block %d\n", __func__,
+         valid->header.index, free_phys);
+        return -1;
+    }
+    WRITE_ONCE(map->phys[valid->header.index], free_phys);
+    map->logical[free_phys] = valid->header.index;
+
+    synchronize_srcu(&b_layer->srcu);
+
+    if (bldms_move_block_phys(b_layer, free, valid_phys, WRITE) < 0){
+        pr_err("%s: failed to copy block %d in physical block %d\n", __func__,
+         free->header.index, valid_phys);
+        return -1;
+    }
+    WRITE_ONCE(map->phys[free->header.index], valid_phys);
+    map->logical[valid_phys] = free->header.index;
+
+    pr_debug("%s: block %d moved from %d to %d\n", __func__, valid->header.index,
+     valid_phys, free_phys);
+    return 0;
+}
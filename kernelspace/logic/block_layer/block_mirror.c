@@ -0,0 +1,398 @@
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/errseq.h>
+#include <linux/workqueue.h>
+
+#include "block_layer.h"
+
+/**
+ * Two-way mirroring of the cold tier.
+ * 
+ * The mirror device holds a copy of every block of the mounted one, at the same
+ * block number. Each block written by the block layer is copied in the buffer of
+ * the mirror too, and both buffers are written back to their device. Reads of
+ * blocks which are not in memory are submitted to the side with fewer reads in
+ * flight.
+ * 
+ * In write-back mode, mirror buffers are written back asynchronously, so their
+ * failures are found out through the writeback error of the mirror device: the
+ * mirror serves no reads from then on, and the next flush takes it offline.
+ * 
+ * When the mirror goes offline, the regions of the device which get written are
+ * marked in a dirty bitmap. Once it is back online, a worker copies the dirty
+ * regions before the mirror serves reads again. The mirror is fully
+ * resynchronized when attached.
+*/
+
+#define BLDMS_MIRROR_FMODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+static inline bool bldms_mirror_is_primary(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh){
+    return b_layer->mirror.bdev && bh->b_bdev == b_layer->sb->s_bdev;
+}
+
+/**
+ * Copies the content of a primary buffer in the corresponding mirror buffer,
+ * which is then written back as any dirty buffer.
+ * @return the mirror buffer, which the caller must release, or NULL if error
+*/
+static struct buffer_head *bldms_mirror_copy(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh){
+
+    struct buffer_head *mbh;
+
+    mbh = __getblk(b_layer->mirror.bdev, bh->b_blocknr, bh->b_size);
+    if (!mbh){
+        return NULL;
+    }
+    lock_buffer(mbh);
+    memcpy(mbh->b_data, bh->b_data, bh->b_size);
+    set_buffer_uptodate(mbh);
+    unlock_buffer(mbh);
+    mark_buffer_dirty(mbh);
+    return mbh;
+}
+
+/**
+ * Takes the mirror offline after it failed on block nr. Only the region of the
+ * failed block is marked dirty, the other ones get marked as they are written.
+*/
+static void bldms_mirror_set_offline(struct bldms_block_layer *b_layer, sector_t nr){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+
+    WRITE_ONCE(mirror->state, BLDMS_MIRROR_OFFLINE);
+    set_bit(nr >> BLDMS_MIRROR_REGION_SHIFT, mirror->dirty);
+}
+
+/**
+ * @return true if writeback of the mirror device failed since it was last checked
+*/
+static inline bool bldms_mirror_wb_failed(struct bldms_mirror *mirror){
+    return errseq_check(&mirror->bdev->bd_inode->i_mapping->wb_err, mirror->wb_err) != 0;
+}
+
+/**
+ * Takes the mirror offline after its writeback failed, marking the regions of
+ * the buffers which could not be written. If they have been reclaimed already,
+ * the whole mirror is resynchronized.
+*/
+static void bldms_mirror_writeback_failed(struct bldms_block_layer *b_layer){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+    struct buffer_head *mbh;
+    bool found;
+    sector_t nr;
+
+    errseq_check_and_advance(&mirror->bdev->bd_inode->i_mapping->wb_err, &mirror->wb_err);
+    found = false;
+    for (nr = 0; nr < b_layer->nr_blocks; nr++){
+        mbh = __find_get_block(mirror->bdev, nr, b_layer->block_size);
+        if (!mbh){
+            continue;
+        }
+        if (buffer_write_io_error(mbh)){
+            clear_buffer_write_io_error(mbh);
+            bldms_mirror_write_failed(b_layer, nr);
+            found = true;
+        }
+        brelse(mbh);
+        cond_resched();
+    }
+    if (!found){
+        pr_err("%s: writeback of mirror failed, mirror is offline\n", __func__);
+        WRITE_ONCE(mirror->state, BLDMS_MIRROR_OFFLINE);
+        bitmap_fill(mirror->dirty, mirror->nr_regions);
+    }
+}
+
+/**
+ * Writes back the dirty buffers of the mirror, and takes it offline if they, or
+ * any buffer written back before, could not be written.
+ * @return 0 if success, else -1
+*/
+int bldms_mirror_flush(struct bldms_block_layer *b_layer){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+
+    if (!mirror->bdev){
+        return 0;
+    }
+    if (!sync_blockdev(mirror->bdev) && !bldms_mirror_wb_failed(mirror)){
+        return 0;
+    }
+    bldms_mirror_writeback_failed(b_layer);
+    return -1;
+}
+
+/**
+ * Copies the blocks of the first dirty region to the mirror, and brings the
+ * mirror online when no dirty regions are left.
+*/
+static void bldms_mirror_resync_work(struct work_struct *work){
+
+    struct bldms_mirror *mirror;
+    struct bldms_block_layer *b_layer;
+    struct buffer_head *bh, *mbh;
+    sector_t nr, last;
+    int region;
+    bool done;
+
+    mirror = container_of(to_delayed_work(work), struct bldms_mirror, resync_work);
+    b_layer = container_of(mirror, struct bldms_block_layer, mirror);
+    done = false;
+
+    // writers are kept out of the region while it is copied
+    bldms_start_write(b_layer);
+
+    region = find_first_bit(mirror->dirty, mirror->nr_regions);
+    if (region < mirror->nr_regions){
+        clear_bit(region, mirror->dirty);
+        nr = (sector_t)region << BLDMS_MIRROR_REGION_SHIFT;
+        last = min_t(sector_t, nr + (1 << BLDMS_MIRROR_REGION_SHIFT), b_layer->nr_blocks);
+        for (; nr < last; nr++){
+            bh = __bread(b_layer->sb->s_bdev, nr, b_layer->block_size);
+            mbh = bh? bldms_mirror_copy(b_layer, bh) : NULL;
+            brelse(bh);
+            if (!mbh){
+                pr_err("%s: failed to copy block %llu, mirror is offline\n", __func__,
+                 (unsigned long long)nr);
+                bldms_mirror_set_offline(b_layer, nr);
+                bldms_end_write(b_layer);
+                return;
+            }
+            brelse(mbh);
+        }
+    }
+    if (find_first_bit(mirror->dirty, mirror->nr_regions) == mirror->nr_regions){
+        if (!bldms_mirror_flush(b_layer)){
+            cmpxchg(&mirror->state, BLDMS_MIRROR_RESYNC, BLDMS_MIRROR_ONLINE);
+        }
+        done = true;
+    }
+
+    bldms_end_write(b_layer);
+
+    if (!done){
+        queue_delayed_work(system_long_wq, &mirror->resync_work, 0);
+    }
+    else if (READ_ONCE(mirror->state) == BLDMS_MIRROR_ONLINE){
+        pr_info("%s: mirror is online\n", __func__);
+    }
+}
+
+void bldms_mirror_init(struct bldms_block_layer *b_layer){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+
+    mirror->bdev = NULL;
+    mirror->state = BLDMS_MIRROR_OFFLINE;
+    atomic_set(&mirror->inflight[BLDMS_MIRROR_SIDE_PRIMARY], 0);
+    atomic_set(&mirror->inflight[BLDMS_MIRROR_SIDE_MIRROR], 0);
+    INIT_DELAYED_WORK(&mirror->resync_work, bldms_mirror_resync_work);
+}
+
+/**
+ * Mirrors the device the block layer is mounted from sb on the device at path.
+ * The mirror serves reads once its first resync is done.
+ * @return 0 if success, else -1
+*/
+int bldms_mirror_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ const char *path){
+
+    struct bldms_mirror *mirror;
+    struct block_device *bdev;
+
+    mirror = &b_layer->mirror;
+
+    bdev = blkdev_get_by_path(path, BLDMS_MIRROR_FMODE, mirror);
+    if (IS_ERR(bdev)){
+        pr_err("%s: failed to open mirror device %s\n", __func__, path);
+        return -1;
+    }
+    if (set_blocksize(bdev, b_layer->block_size)
+     || i_size_read(bdev->bd_inode) / b_layer->block_size < b_layer->nr_blocks){
+        pr_err("%s: cannot use %s as mirror device\n", __func__, path);
+        blkdev_put(bdev, BLDMS_MIRROR_FMODE);
+        return -1;
+    }
+
+    mirror->nr_regions = DIV_ROUND_UP(b_layer->nr_blocks, 1 << BLDMS_MIRROR_REGION_SHIFT);
+    mirror->dirty = bitmap_zalloc(mirror->nr_regions, GFP_KERNEL);
+    if (!mirror->dirty){
+        pr_err("%s: failed to allocate dirty bitmap\n", __func__);
+        blkdev_put(bdev, BLDMS_MIRROR_FMODE);
+        return -1;
+    }
+    mirror->bdev = bdev;
+    mirror->wb_err = filemap_sample_wb_err(bdev->bd_inode->i_mapping);
+
+    // contents of the mirror are unknown, so it is fully resynchronized
+    WRITE_ONCE(mirror->state, BLDMS_MIRROR_OFFLINE);
+    bitmap_fill(mirror->dirty, mirror->nr_regions);
+    bldms_mirror_set_online(b_layer, true);
+
+    pr_info("%s: mirroring on %s\n", __func__, path);
+    return 0;
+}
+
+/**
+ * Stops the resync, copies the reserved blocks holding the fs state, which are
+ * not written through the block layer, and releases the mirror device.
+*/
+void bldms_mirror_detach(struct bldms_block_layer *b_layer){
+
+    struct bldms_mirror *mirror;
+    struct buffer_head *bh, *mbh;
+    int nr;
+
+    mirror = &b_layer->mirror;
+    if (!mirror->bdev){
+        return;
+    }
+
+    cancel_delayed_work_sync(&mirror->resync_work);
+    if (mirror->state != BLDMS_MIRROR_OFFLINE){
+        for (nr = 0; nr < b_layer->start_data_index; nr++){
+            bh = __bread(b_layer->sb->s_bdev, nr, b_layer->block_size);
+            mbh = bh? bldms_mirror_copy(b_layer, bh) : NULL;
+            if (!mbh){
+                pr_err("%s: failed to copy reserved block %d\n", __func__, nr);
+            }
+            brelse(mbh);
+            brelse(bh);
+        }
+    }
+    if (bldms_mirror_flush(b_layer) < 0){
+        pr_err("%s: mirror is stale, it must be resynchronized\n", __func__);
+    }
+
+    blkdev_put(mirror->bdev, BLDMS_MIRROR_FMODE);
+    bitmap_free(mirror->dirty);
+    mirror->bdev = NULL;
+    mirror->dirty = NULL;
+    mirror->state = BLDMS_MIRROR_OFFLINE;
+}
+
+/**
+ * Takes the mirror offline, or starts its resync to bring it back online.
+*/
+void bldms_mirror_set_online(struct bldms_block_layer *b_layer, bool online){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+
+    if (!mirror->bdev){
+        return;
+    }
+    if (!online){
+        cancel_delayed_work_sync(&mirror->resync_work);
+        WRITE_ONCE(mirror->state, BLDMS_MIRROR_OFFLINE);
+        pr_info("%s: mirror is offline\n", __func__);
+    }
+    else if (cmpxchg(&mirror->state, BLDMS_MIRROR_OFFLINE, BLDMS_MIRROR_RESYNC)
+     == BLDMS_MIRROR_OFFLINE){
+        queue_delayed_work(system_long_wq, &mirror->resync_work, 0);
+    }
+}
+
+/**
+ * Chooses which side of the mirror reads the block of the given primary buffer.
+ * @param side: set to the side the read is accounted to, or -1 if the block is
+ * already in memory or not mirrored
+ * @return the buffer to read
+*/
+struct buffer_head *bldms_mirror_balance_read(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh, int *side){
+
+    struct bldms_mirror *mirror;
+    struct buffer_head *mbh;
+
+    mirror = &b_layer->mirror;
+    *side = -1;
+
+    if (!bldms_mirror_is_primary(b_layer, bh) || buffer_uptodate(bh)){
+        return bh;
+    }
+
+    *side = BLDMS_MIRROR_SIDE_PRIMARY;
+    if (READ_ONCE(mirror->state) == BLDMS_MIRROR_ONLINE && !bldms_mirror_wb_failed(mirror)
+     && atomic_read(&mirror->inflight[BLDMS_MIRROR_SIDE_MIRROR])
+      < atomic_read(&mirror->inflight[BLDMS_MIRROR_SIDE_PRIMARY])){
+        mbh = __getblk(mirror->bdev, bh->b_blocknr, bh->b_size);
+        if (mbh){
+            brelse(bh);
+            bh = mbh;
+            *side = BLDMS_MIRROR_SIDE_MIRROR;
+        }
+    }
+    atomic_inc(&mirror->inflight[*side]);
+    atomic64_inc(&mirror->nr_reads[*side]);
+    return bh;
+}
+
+/**
+ * Takes the mirror offline after a failed read, and reads the block of the given
+ * mirror buffer from the primary side.
+ * @return the primary buffer, or NULL if it cannot be read
+*/
+struct buffer_head *bldms_mirror_read_failed(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh, int *side){
+
+    sector_t nr;
+
+    pr_err("%s: failed to read block %llu from mirror, mirror is offline\n",
+     __func__, (unsigned long long)bh->b_blocknr);
+    nr = bh->b_blocknr;
+    bldms_mirror_set_offline(b_layer, nr);
+
+    brelse(bh);
+    bldms_mirror_read_done(b_layer, *side);
+    *side = -1;
+    return __bread(b_layer->sb->s_bdev, nr, b_layer->block_size);
+}
+
+void bldms_mirror_read_done(struct bldms_block_layer *b_layer, int side){
+
+    if (side >= 0){
+        atomic_dec(&b_layer->mirror.inflight[side]);
+    }
+}
+
+/**
+ * Propagates a write of the given buffer to the mirror, or annotates its region
+ * as dirty if the mirror is offline.
+ * @return the dirty mirror buffer, to be written back together with the primary
+ * one and then released by the caller, or NULL if there is none
+*/
+struct buffer_head *bldms_mirror_write(struct bldms_block_layer *b_layer,
+ struct buffer_head *bh){
+
+    struct bldms_mirror *mirror = &b_layer->mirror;
+    struct buffer_head *mbh;
+
+    if (!bldms_mirror_is_primary(b_layer, bh)){
+        return NULL;
+    }
+    if (READ_ONCE(mirror->state) == BLDMS_MIRROR_OFFLINE){
+        set_bit(bh->b_blocknr >> BLDMS_MIRROR_REGION_SHIFT, mirror->dirty);
+        return NULL;
+    }
+    mbh = bldms_mirror_copy(b_layer, bh);
+    if (!mbh){
+        bldms_mirror_write_failed(b_layer, bh->b_blocknr);
+    }
+    return mbh;
+}
+
+/**
+ * Takes the mirror offline after a failed write of block nr.
+*/
+void bldms_mirror_write_failed(struct bldms_block_layer *b_layer, sector_t nr){
+
+    pr_err("%s: failed to write block %llu to mirror, mirror is offline\n",
+     __func__, (unsigned long long)nr);
+    bldms_mirror_set_offline(b_layer, nr);
+}
@@ -0,0 +1,512 @@
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/workqueue.h>
+#include <linux/cpumask.h>
+#include <linux/jiffies.h>
+
+#include "block_layer.h"
+
+/**
+ * Mount time scan.
+ *
+ * The header of every data block is read at mount, to build the block map and
+ * to check that the lists of blocks saved in the superblock are consistent. If
+ * they are not, as after a crash, the lists are rebuilt from the headers.
+ * Reading headers one at a time makes mount time grow with the latency of the
+ * device, so the data blocks are split in ranges scanned in parallel by
+ * several workers, each one reading a batch of blocks at once while the
+ * readahead of its next batch is already in flight.
+*/
+
+// header of a block, as found by the scan
+struct bldms_scan_header{
+
+    int index;
+    int state;
+    int next;
+    int prev;
+    int data_size;
+};
+
+struct bldms_scan{
+
+    struct bldms_block_layer *b_layer;
+    /**
+     * Header found at each slot. If physical, slots are the physical blocks
+     * of the device, else they are logical blocks.
+    */
+    struct bldms_scan_header *headers;
+    bool physical;
+    int batch;
+};
+
+struct bldms_scan_worker{
+
+    struct work_struct work;
+    struct bldms_scan *scan;
+    int first;  // first slot of the range
+    int end;    // slot after the last one of the range
+    int res;
+};
+
+/**
+ * @return the header found for the given logical block
+*/
+static inline struct bldms_scan_header *bldms_scan_header_of(struct bldms_scan *scan,
+ int index){
+    return &scan->headers[scan->physical? scan->b_layer->map.phys[index] : index];
+}
+
+/**
+ * Starts reading the given slots without waiting for them, plugging the
+ * requests so that adjacent ones are merged.
+*/
+static void bldms_scan_readahead(struct bldms_scan *scan, int first, int end){
+
+    struct blk_plug plug;
+    int i;
+
+    blk_start_plug(&plug);
+    for (i = first; i < end; i++){
+        // with no map loaded yet, physical slots are located as logical ones
+        bldms_prefetch_block(scan->b_layer, i);
+    }
+    blk_finish_plug(&plug);
+}
+
+static void bldms_scan_range(struct work_struct *work){
+
+    struct bldms_scan_worker *worker;
+    struct bldms_scan *scan;
+    struct bldms_block_layer *b_layer;
+    struct bldms_block **blocks;
+    struct bldms_block_loc *locs;
+    int start, nr;
+    int i;
+
+    worker = container_of(work, struct bldms_scan_worker, work);
+    scan = worker->scan;
+    b_layer = scan->b_layer;
+    worker->res = -1;
+
+    blocks = kcalloc(scan->batch, sizeof(struct bldms_block *), GFP_KERNEL);
+    locs = kcalloc(scan->batch, sizeof(struct bldms_block_loc), GFP_KERNEL);
+    if (!blocks || !locs){
+        pr_err("%s: failed to allocate scan batch\n", __func__);
+        goto bldms_scan_range_exit;
+    }
+    for (i = 0; i < scan->batch; i++){
+        blocks[i] = bldms_block_alloc(b_layer->block_size);
+        if (!blocks[i]){
+            pr_err("%s: failed to allocate scan batch\n", __func__);
+            goto bldms_scan_range_exit;
+        }
+    }
+
+    bldms_scan_readahead(scan, worker->first,
+     min(worker->first + scan->batch, worker->end));
+    for (start = worker->first; start < worker->end; start += nr){
+        nr = min(scan->batch, worker->end - start);
+
+        // the next batch is on its way while we wait for this one
+        bldms_scan_readahead(scan, start + nr,
+         min(start + nr + scan->batch, worker->end));
+
+        for (i = 0; i < nr; i++){
+            blocks[i]->header.index = start + i;
+            locs[i].tier = BLDMS_TIER_COLD;
+            locs[i].nr = start + i;
+        }
+        if ((scan->physical? bldms_move_blocks_at(b_layer, blocks, locs, nr, READ)
+         : bldms_move_blocks(b_layer, blocks, nr, READ)) < 0){
+            pr_err("%s: failed to read blocks %d to %d\n", __func__, start,
+             start + nr - 1);
+            goto bldms_scan_range_exit;
+        }
+        for (i = 0; i < nr; i++){
+            scan->headers[start + i].index = blocks[i]->header.index;
+            scan->headers[start + i].state = blocks[i]->header.state;
+            scan->headers[start + i].next = blocks[i]->header.next;
+            scan->headers[start + i].prev = blocks[i]->header.prev;
+            scan->headers[start + i].data_size = blocks[i]->header.data_size;
+        }
+        cond_resched();
+    }
+    worker->res = 0;
+
+bldms_scan_range_exit:
+    for (i = 0; blocks && i < scan->batch; i++){
+        bldms_block_free(blocks[i]);
+    }
+    kfree(blocks);
+    kfree(locs);
+}
+
+/**
+ * Walks a list of blocks, checking that each block is in the given state, links
+ * back to the previous one and is not in another list, and that the list ends
+ * where its head says.
+ * @param listed: blocks found in lists so far, updated with the ones of this list
+ * @return how many blocks are in the list, or -1 if it is broken
+*/
+static int bldms_scan_check_list(struct bldms_scan *scan,
+ const struct bldms_blocks_head *head, int state, unsigned long *listed,
+ const char *name){
+
+    struct bldms_block_layer *b_layer;
+    struct bldms_scan_header *header;
+    int prev, cur;
+    int nr;
+
+    b_layer = scan->b_layer;
+    nr = 0;
+    prev = -1;
+    cur = head->first_bi;
+    while (cur != -1){
+        if (cur < b_layer->start_data_index || cur >= b_layer->nr_blocks
+         || test_and_set_bit(cur, listed)){
+            pr_err("%s: %s list reaches block %d twice or out of the device\n",
+             __func__, name, cur);
+            return -1;
+        }
+        header = bldms_scan_header_of(scan, cur);
+        if (header->state != state || header->prev != prev){
+            pr_err("%s: block %d of %s list is in state %d with prev %d, expected %d and %d\n",
+             __func__, cur, name, header->state, header->prev, state, prev);
+            return -1;
+        }
+        prev = cur;
+        cur = header->next;
+        nr ++;
+    }
+    if (prev != head->last_bi){
+        pr_err("%s: %s list ends at block %d, but its last block is %d\n",
+         __func__, name, prev, head->last_bi);
+        return -1;
+    }
+    return nr;
+}
+
+/**
+ * @return true if the given logical block holds valid data. A physical block
+ * given to another logical block by the map holds none.
+*/
+static bool bldms_scan_is_valid(struct bldms_scan *scan, int index){
+
+    struct bldms_scan_header *header = bldms_scan_header_of(scan, index);
+
+    return header->state == BLDMS_BLOCK_STATE_VALID
+     && (!scan->physical || header->index == index);
+}
+
+/**
+ * @return true if prev and next are valid blocks linking to each other, and next
+ * is in no list yet
+*/
+static bool bldms_scan_linked(struct bldms_scan *scan, unsigned long *listed,
+ int prev, int next){
+
+    struct bldms_block_layer *b_layer = scan->b_layer;
+
+    return prev >= b_layer->start_data_index && prev < b_layer->nr_blocks
+     && next >= b_layer->start_data_index && next < b_layer->nr_blocks
+     && !test_bit(next, listed)
+     && bldms_scan_is_valid(scan, prev) && bldms_scan_is_valid(scan, next)
+     && bldms_scan_header_of(scan, prev)->next == next
+     && bldms_scan_header_of(scan, next)->prev == prev;
+}
+
+/**
+ * Writes the state and the links of a block, if they are not what the scan
+ * found in its header.
+ * @param block: buffer for the block
+ * @return 0 if success, else -1
+*/
+static int bldms_scan_relink(struct bldms_scan *scan, struct bldms_block *block,
+ int index, int state, int prev, int next){
+
+    struct bldms_scan_header *header = bldms_scan_header_of(scan, index);
+
+    if (header->state == state && header->prev == prev && header->next == next
+     && (!scan->physical || header->index == index)){
+        return 0;
+    }
+    block->header.index = index;
+    if (bldms_move_block(scan->b_layer, block, READ) < 0){
+        pr_err("%s: failed to read block %d\n", __func__, index);
+        return -1;
+    }
+    block->header.state = state;
+    block->header.prev = prev;
+    block->header.next = next;
+    if (state != BLDMS_BLOCK_STATE_VALID){
+        block->header.data_size = 0;
+    }
+    if (bldms_move_block(scan->b_layer, block, WRITE) < 0){
+        pr_err("%s: failed to write block %d\n", __func__, index);
+        return -1;
+    }
+    header->index = index;
+    header->state = state;
+    header->prev = prev;
+    header->next = next;
+    header->data_size = block->header.data_size;
+    return 0;
+}
+
+/**
+ * Rebuilds the lists of blocks from their headers, when they do not agree with
+ * the heads saved in the superblock, as after a crash.
+ * Chains of valid blocks linking to each other are kept in the used list: first
+ * the one with no previous block, then the others by index of their first
+ * block, since their order was lost. Every other data block goes to its free
+ * list, by index. Only the headers which change are written.
+ * @param listed: set for the blocks in the used list and the reserved ones
+ * @param nr_used: set to how many blocks are in the used list
+ * @return how many blocks are in the free lists, or -1 if error
+*/
+static int bldms_scan_repair(struct bldms_scan *scan, unsigned long *listed,
+ int *nr_used){
+
+    struct bldms_block_layer *b_layer;
+    struct bldms_blocks_head *head;
+    struct bldms_block *block;
+    int *order;
+    int nr_dev_blocks;
+    int pass, index, cur, next;
+    int nr, nr_free;
+    int z, i;
+
+    b_layer = scan->b_layer;
+    nr_free = -1;
+    order = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    block = bldms_block_alloc(b_layer->block_size);
+    if (!order || !block){
+        pr_err("%s: failed to allocate repair state\n", __func__);
+        goto bldms_scan_repair_exit;
+    }
+    // the first blocks of each device of a stripe are reserved, and in no list
+    bitmap_zero(listed, b_layer->nr_blocks);
+    nr_dev_blocks = b_layer->nr_blocks / max(b_layer->stripes.nr_devs, 1);
+    for (index = nr_dev_blocks; index < b_layer->nr_blocks; index += nr_dev_blocks){
+        bitmap_set(listed, index, b_layer->start_data_index);
+    }
+
+    /**
+     * A chain starts at a block with no previous one, then at a block whose
+     * previous one does not link to it, then anywhere, to break cycles.
+    */
+    nr = 0;
+    for (pass = 0; pass < 3; pass++){
+        for (index = b_layer->start_data_index; index < b_layer->nr_blocks; index++){
+            if (test_bit(index, listed) || !bldms_scan_is_valid(scan, index)){
+                continue;
+            }
+            cur = bldms_scan_header_of(scan, index)->prev;
+            if ((pass == 0 && cur != -1)
+             || (pass == 1 && bldms_scan_linked(scan, listed, cur, index))){
+                continue;
+            }
+            for (cur = index; cur != -1; cur = next){
+                set_bit(cur, listed);
+                order[nr++] = cur;
+                next = bldms_scan_header_of(scan, cur)->next;
+                if (!bldms_scan_linked(scan, listed, cur, next)){
+                    next = -1;
+                }
+            }
+        }
+    }
+    for (i = 0; i < nr; i++){
+        if (bldms_scan_relink(scan, block, order[i], BLDMS_BLOCK_STATE_VALID,
+         i > 0? order[i - 1] : -1, i < nr - 1? order[i + 1] : -1) < 0){
+            goto bldms_scan_repair_exit;
+        }
+    }
+    b_layer->used_blocks.first_bi = nr? order[0] : -1;
+    b_layer->used_blocks.last_bi = nr? order[nr - 1] : -1;
+    *nr_used = nr;
+
+    // zones are ranges of blocks, so each free list is made of adjacent ones
+    b_layer->free_blocks.first_bi = -1;
+    b_layer->free_blocks.last_bi = -1;
+    for (z = 0; z < b_layer->zones.nr_zones; z++){
+        b_layer->zones.zone[z].free_blocks.first_bi = -1;
+        b_layer->zones.zone[z].free_blocks.last_bi = -1;
+    }
+    nr = 0;
+    index = find_next_zero_bit(listed, b_layer->nr_blocks, b_layer->start_data_index);
+    while (index < b_layer->nr_blocks){
+        head = bldms_block_free_list(b_layer, index);
+        next = find_next_zero_bit(listed, b_layer->nr_blocks, index + 1);
+        if (bldms_scan_relink(scan, block, index, BLDMS_BLOCK_STATE_INVALID,
+         head->last_bi, next < b_layer->nr_blocks
+         && bldms_block_free_list(b_layer, next) == head? next : -1) < 0){
+            goto bldms_scan_repair_exit;
+        }
+        if (head->first_bi == -1){
+            head->first_bi = index;
+        }
+        head->last_bi = index;
+        index = next;
+        nr ++;
+        cond_resched();
+    }
+    nr_free = nr;
+
+bldms_scan_repair_exit:
+    bldms_block_free(block);
+    kvfree(order);
+    return nr_free;
+}
+
+/**
+ * Builds the stream index from the used list, which must have been checked
+ * @return 0 if success, else -1
+*/
+static int bldms_scan_build_stream(struct bldms_scan *scan){
+
+    struct bldms_block_layer *b_layer;
+    struct bldms_scan_header *header;
+    int cur;
+
+    b_layer = scan->b_layer;
+    if (bldms_stream_reset(b_layer) < 0){
+        return -1;
+    }
+    for (cur = b_layer->used_blocks.first_bi; cur != -1; cur = header->next){
+        header = bldms_scan_header_of(scan, cur);
+        bldms_stream_append(b_layer, cur, header->data_size);
+    }
+    return 0;
+}
+
+/**
+ * Scans the headers of all data blocks of the device owned by the given
+ * superblock. Blocks of a device which can be compacted are read by physical
+ * block, and the block map is built from what they hold. Then the used and the
+ * free lists are walked, to check they agree with the headers and with the heads
+ * saved in the superblock, else they are rebuilt from the headers, and the
+ * stream index is built from the used list.
+ * Must be called once stripes and zones are set up, and before any other device
+ * is attached.
+ * @param nr_workers: how many workers read headers in parallel
+ * @param batch: how many blocks each worker reads at once
+ * @return 0 if success, else -1
+*/
+int bldms_block_scan(struct bldms_block_layer *b_layer, struct super_block *sb,
+ int nr_workers, int batch){
+
+    struct bldms_scan scan;
+    struct bldms_scan_worker *workers;
+    unsigned long *listed;
+    int *logical;
+    unsigned long start_time;
+    int nr_slots, nr_data, per_worker;
+    int nr_used, nr_free, nr;
+    int res;
+    int w, z, p;
+
+    might_sleep();
+    res = -1;
+    workers = NULL;
+    listed = NULL;
+    logical = NULL;
+
+    // blocks are located through the device of the superblock
+    b_layer->sb = sb;
+    scan.b_layer = b_layer;
+    scan.batch = max(batch, 1);
+    // striped and zoned devices are never compacted
+    scan.physical = b_layer->stripes.nr_devs <= 1 && b_layer->zones.nr_zones == 0;
+    scan.headers = kvcalloc(b_layer->nr_blocks, sizeof(struct bldms_scan_header),
+     GFP_KERNEL);
+    listed = bitmap_zalloc(b_layer->nr_blocks, GFP_KERNEL);
+    if (!scan.headers || !listed){
+        pr_err("%s: failed to allocate scan state\n", __func__);
+        goto bldms_block_scan_exit;
+    }
+
+    nr_slots = b_layer->nr_blocks - b_layer->start_data_index;
+    nr_workers = clamp(nr_workers, 1, (int)num_online_cpus());
+    nr_workers = max(min(nr_workers, nr_slots), 1);
+    per_worker = DIV_ROUND_UP(nr_slots, nr_workers);
+    workers = kcalloc(nr_workers, sizeof(struct bldms_scan_worker), GFP_KERNEL);
+    if (!workers){
+        pr_err("%s: failed to allocate scan workers\n", __func__);
+        goto bldms_block_scan_exit;
+    }
+
+    start_time = jiffies;
+    for (w = 0; w < nr_workers; w++){
+        workers[w].scan = &scan;
+        workers[w].first = b_layer->start_data_index + w * per_worker;
+        workers[w].end = min(workers[w].first + per_worker, b_layer->nr_blocks);
+        INIT_WORK(&workers[w].work, bldms_scan_range);
+        queue_work(system_unbound_wq, &workers[w].work);
+    }
+    for (w = 0; w < nr_workers; w++){
+        flush_work(&workers[w].work);
+        if (workers[w].res < 0){
+            goto bldms_block_scan_exit;
+        }
+    }
+
+    if (scan.physical){
+        logical = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+        if (!logical){
+            pr_err("%s: failed to allocate block map entries\n", __func__);
+            goto bldms_block_scan_exit;
+        }
+        for (p = 0; p < b_layer->nr_blocks; p++){
+            logical[p] = scan.headers[p].index;
+        }
+        if (bldms_block_map_load(b_layer, logical) < 0){
+            goto bldms_block_scan_exit;
+        }
+    }
+
+    nr_used = bldms_scan_check_list(&scan, &b_layer->used_blocks,
+     BLDMS_BLOCK_STATE_VALID, listed, "used");
+    nr_free = 0;
+    if (nr_used >= 0 && b_layer->zones.nr_zones == 0){
+        nr_free = bldms_scan_check_list(&scan, &b_layer->free_blocks,
+         BLDMS_BLOCK_STATE_INVALID, listed, "free");
+    }
+    for (z = 0; z < b_layer->zones.nr_zones && nr_used >= 0 && nr_free >= 0; z++){
+        nr = bldms_scan_check_list(&scan, &b_layer->zones.zone[z].free_blocks,
+         BLDMS_BLOCK_STATE_INVALID, listed, "zone free");
+        nr_free = nr < 0? nr : nr_free + nr;
+    }
+    // the first blocks of each device of a stripe hold no data
+    nr_data = nr_slots - (max(b_layer->stripes.nr_devs, 1) - 1) * b_layer->start_data_index;
+    if (nr_used < 0 || nr_free < 0 || nr_used + nr_free != nr_data){
+        pr_warn("%s: lists of blocks are broken, rebuilding them from the headers\n",
+         __func__);
+        nr_free = bldms_scan_repair(&scan, listed, &nr_used);
+        if (nr_free < 0){
+            goto bldms_block_scan_exit;
+        }
+    }
+
+    if (bldms_scan_build_stream(&scan) < 0){
+        goto bldms_block_scan_exit;
+    }
+
+    pr_info("%s: %d used and %d free blocks scanned by %d workers in %u ms\n",
+     __func__, nr_used, nr_free, nr_workers, jiffies_to_msecs(jiffies - start_time));
+    res = 0;
+
+bldms_block_scan_exit:
+    if (res < 0){
+        bldms_block_map_clean(b_layer);
+    }
+    kfree(workers);
+    bitmap_free(listed);
+    kvfree(logical);
+    kvfree(scan.headers);
+    return res;
+}
@@ -14,5 +14,11 @@ size_t bldms_get_serialized_block_size(struct bldms_block *block);
  * Buffer must be big enough to hold data and header sizes.
 */
 void bldms_block_serialize(struct bldms_block *block, u8 *buffer);
+/**
+ * Reads only the block header from a byte array, starting at *offset_p.
+*/
+void bldms_block_deserialize_header(struct bldms_block *block, u8 *buffer,
+ int *offset_p);
+size_t bldms_calc_block_header_size(struct bldms_block_header header);
 
 #endif // BLOCK_SERIALIZATION_H_INCLUDED
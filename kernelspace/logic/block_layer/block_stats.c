@@ -0,0 +1,115 @@
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/atomic.h>
+#include <linux/kernel.h>
+
+#include "block_layer.h"
+
+/**
+ * Exposes counters of the block layer as read only pseudo files, one per
+ * counter, in a sysfs dir under /sys/kernel. A few writable files allow to
+ * control the block layer at runtime.
+*/
+
+static struct bldms_block_layer *b_layer;
+static struct kobject *stats_kobj = NULL;
+
+#define bldms_stat_attr(name_, fmt_, value_)\
+static ssize_t name_##_show(struct kobject *kobj, struct kobj_attribute *attr,\
+ char *buf){\
+    return sysfs_emit(buf, fmt_ "\n", value_);\
+}\
+static struct kobj_attribute name_##_attr = __ATTR_RO(name_)
+
+bldms_stat_attr(compact_passes, "%lld",
+ atomic64_read(&b_layer->compactor.nr_passes));
+bldms_stat_attr(compact_blocks_moved, "%lld",
+ atomic64_read(&b_layer->compactor.nr_blocks_moved));
+bldms_stat_attr(compact_bytes_moved, "%lld",
+ atomic64_read(&b_layer->compactor.nr_bytes_moved));
+bldms_stat_attr(compact_in_place, "%d",
+ atomic_read(&b_layer->compactor.nr_in_place));
+bldms_stat_attr(tier_hot_used, "%d", READ_ONCE(b_layer->tier.nr_hot_used));
+bldms_stat_attr(tier_demoted, "%lld", atomic64_read(&b_layer->tier.nr_demoted));
+bldms_stat_attr(tier_promoted, "%lld", atomic64_read(&b_layer->tier.nr_promoted));
+bldms_stat_attr(log_segments_cleaned, "%lld", atomic64_read(&b_layer->log.nr_cleaned));
+bldms_stat_attr(log_records_moved, "%lld", atomic64_read(&b_layer->log.nr_moved));
+bldms_stat_attr(dirty_blocks, "%d", atomic_read(&b_layer->dirty.nr_dirty));
+bldms_stat_attr(dirty_throttle_ms, "%lld",
+ atomic64_read(&b_layer->dirty.throttle_us) / USEC_PER_MSEC);
+bldms_stat_attr(mirror_reads_primary, "%lld",
+ atomic64_read(&b_layer->mirror.nr_reads[BLDMS_MIRROR_SIDE_PRIMARY]));
+bldms_stat_attr(mirror_reads_mirror, "%lld",
+ atomic64_read(&b_layer->mirror.nr_reads[BLDMS_MIRROR_SIDE_MIRROR]));
+
+/**
+ * Mirror state, as in enum bldms_mirror_state. Writing 0 takes the mirror offline,
+ * writing 1 resyncs it and brings it back online.
+*/
+static ssize_t mirror_state_show(struct kobject *kobj, struct kobj_attribute *attr,
+ char *buf){
+    return sysfs_emit(buf, "%d\n", READ_ONCE(b_layer->mirror.state));
+}
+
+static ssize_t mirror_state_store(struct kobject *kobj, struct kobj_attribute *attr,
+ const char *buf, size_t count){
+
+    bool online;
+
+    if (kstrtobool(buf, &online)){
+        return -EINVAL;
+    }
+    bldms_mirror_set_online(b_layer, online);
+    return count;
+}
+static struct kobj_attribute mirror_state_attr = __ATTR_RW(mirror_state);
+
+static struct attribute *stats_attrs[] = {
+    &compact_passes_attr.attr,
+    &compact_blocks_moved_attr.attr,
+    &compact_bytes_moved_attr.attr,
+    &compact_in_place_attr.attr,
+    &tier_hot_used_attr.attr,
+    &tier_demoted_attr.attr,
+    &tier_promoted_attr.attr,
+    &log_segments_cleaned_attr.attr,
+    &log_records_moved_attr.attr,
+    &dirty_blocks_attr.attr,
+    &dirty_throttle_ms_attr.attr,
+    &mirror_reads_primary_attr.attr,
+    &mirror_reads_mirror_attr.attr,
+    &mirror_state_attr.attr,
+    NULL,
+};
+
+static const struct attribute_group stats_group = {
+    .attrs = stats_attrs,
+};
+
+int bldms_block_layer_stats_init(struct bldms_block_layer *b_layer_ref,
+ const char *stats_dirname){
+
+    b_layer = b_layer_ref;
+
+    stats_kobj = kobject_create_and_add(stats_dirname, kernel_kobj);
+    if (!stats_kobj){
+        pr_err("%s: failed to create stats kobject\n", __func__);
+        return -1;
+    }
+    if (sysfs_create_group(stats_kobj, &stats_group)){
+        pr_err("%s: failed to create stats files\n", __func__);
+        kobject_put(stats_kobj);
+        stats_kobj = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void bldms_block_layer_stats_cleanup(void){
+
+    if (stats_kobj){
+        sysfs_remove_group(stats_kobj, &stats_group);
+        kobject_put(stats_kobj);
+        stats_kobj = NULL;
+    }
+}
@@ -0,0 +1,457 @@
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+
+#include "block_layer.h"
+
+/**
+ * Stream index.
+ *
+ * Valid data is read as one stream, made of the data of the used blocks in
+ * list order. Blocks only enter the used list at its tail, so giving each one
+ * the next slot when it enters keeps slots in list order, and a block leaving
+ * the list just leaves a hole in its slot. Slots run out after as many entries
+ * as twice the blocks of the device: holes are then squeezed out, which costs
+ * O(n) once every n entries at least.
+ *
+ * The index is kept by writers next to the list, and read by bldms_read() to
+ * find where an offset is without walking the list. It is built at mount by
+ * the scan, or from the snapshot of the last clean unmount. Once the fs is
+ * mounted, writers report each change to it with the offset it starts at, as
+ * soon as the list agrees with the index, so that views of the stream the fs
+ * keeps can be dropped from there.
+*/
+
+static void bldms_stream_tree_add(struct bldms_stream *stream, int slot, s64 delta){
+
+    int i;
+
+    for (i = slot + 1; i <= stream->capacity; i += i & -i){
+        stream->tree[i] += delta;
+    }
+}
+
+/**
+ * @return the data size of the first nr slots
+*/
+static s64 bldms_stream_prefix(struct bldms_stream *stream, int nr){
+
+    s64 sum = 0;
+
+    for (; nr > 0; nr -= nr & -nr){
+        sum += stream->tree[nr];
+    }
+    return sum;
+}
+
+/**
+ * Reports a change of the stream from the given offset on, as returned by
+ * bldms_stream_append() or bldms_stream_remove(). Must be called once the used
+ * list has been relinked, so that the fs reads the new stream afterwards.
+*/
+void bldms_stream_changed(struct bldms_block_layer *b_layer, loff_t from){
+
+    if (from >= 0 && b_layer->stream_changed && READ_ONCE(b_layer->mounted)){
+        b_layer->stream_changed(b_layer, from);
+    }
+}
+
+/**
+ * Rebuilds the tree from the sizes of the slots in O(n)
+*/
+static void bldms_stream_tree_build(struct bldms_stream *stream){
+
+    int i, j;
+
+    stream->tree[0] = 0;
+    for (i = 1; i <= stream->capacity; i++){
+        stream->tree[i] = stream->size_at[i - 1];
+    }
+    for (i = 1; i <= stream->capacity; i++){
+        j = i + (i & -i);
+        if (j <= stream->capacity){
+            stream->tree[j] += stream->tree[i];
+        }
+    }
+}
+
+/**
+ * Squeezes holes out of the slots, keeping the order of blocks
+*/
+static void bldms_stream_compact(struct bldms_stream *stream){
+
+    int i, j;
+
+    j = 0;
+    for (i = 0; i < stream->nr_slots; i++){
+        if (stream->block_at[i] == -1){
+            continue;
+        }
+        stream->block_at[j] = stream->block_at[i];
+        stream->size_at[j] = stream->size_at[i];
+        stream->slot_of[stream->block_at[j]] = j;
+        j++;
+    }
+    for (i = j; i < stream->capacity; i++){
+        stream->block_at[i] = -1;
+        stream->size_at[i] = 0;
+    }
+    stream->nr_slots = j;
+    bldms_stream_tree_build(stream);
+}
+
+void bldms_stream_init(struct bldms_block_layer *b_layer){
+
+    mutex_init(&b_layer->stream.lock);
+    b_layer->stream.ready = false;
+}
+
+/**
+ * Empties the index, sized on the blocks of the mounted device, and starts
+ * keeping it: blocks with valid data must be appended in list order right
+ * after, before any writer runs.
+ * @return 0 if success, else -1
+*/
+int bldms_stream_reset(struct bldms_block_layer *b_layer){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    int i;
+
+    bldms_stream_clean(b_layer);
+
+    mutex_lock(&stream->lock);
+    stream->capacity = max(2 * b_layer->nr_blocks, 2);
+    stream->slot_of = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    stream->block_at = kvmalloc_array(stream->capacity, sizeof(int), GFP_KERNEL);
+    stream->size_at = kvcalloc(stream->capacity, sizeof(int), GFP_KERNEL);
+    stream->tree = kvcalloc(stream->capacity + 1, sizeof(s64), GFP_KERNEL);
+    if (!stream->slot_of || !stream->block_at || !stream->size_at || !stream->tree){
+        pr_err("%s: failed to allocate stream index\n", __func__);
+        mutex_unlock(&stream->lock);
+        bldms_stream_clean(b_layer);
+        return -1;
+    }
+    for (i = 0; i < b_layer->nr_blocks; i++){
+        stream->slot_of[i] = -1;
+    }
+    for (i = 0; i < stream->capacity; i++){
+        stream->block_at[i] = -1;
+    }
+    stream->nr_slots = 0;
+    stream->ready = true;
+    mutex_unlock(&stream->lock);
+    return 0;
+}
+
+/**
+ * Stops keeping the index, releasing its memory
+*/
+void bldms_stream_clean(struct bldms_block_layer *b_layer){
+
+    struct bldms_stream *stream = &b_layer->stream;
+
+    mutex_lock(&stream->lock);
+    stream->ready = false;
+    kvfree(stream->slot_of);
+    kvfree(stream->block_at);
+    kvfree(stream->size_at);
+    kvfree(stream->tree);
+    stream->slot_of = NULL;
+    stream->block_at = NULL;
+    stream->size_at = NULL;
+    stream->tree = NULL;
+    mutex_unlock(&stream->lock);
+}
+
+/**
+ * Accounts a block just linked at the tail of the used list, holding size
+ * bytes of data
+ * @return the offset its data starts at, or -1 if it has not been accounted
+*/
+loff_t bldms_stream_append(struct bldms_block_layer *b_layer, int index, int size){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    loff_t from = -1;
+    int slot;
+
+    mutex_lock(&stream->lock);
+    if (!stream->ready || index < 0 || index >= b_layer->nr_blocks){
+        goto bldms_stream_append_exit;
+    }
+    if (stream->slot_of[index] != -1){
+        pr_warn("%s: block %d is already in the stream\n", __func__, index);
+        goto bldms_stream_append_exit;
+    }
+    if (stream->nr_slots == stream->capacity){
+        bldms_stream_compact(stream);
+    }
+    slot = stream->nr_slots++;
+    from = bldms_stream_prefix(stream, slot);
+    stream->slot_of[index] = slot;
+    stream->block_at[slot] = index;
+    stream->size_at[slot] = size;
+    bldms_stream_tree_add(stream, slot, size);
+
+bldms_stream_append_exit:
+    mutex_unlock(&stream->lock);
+    return from;
+}
+
+/**
+ * Accounts a block leaving the used list. Must be called before read states
+ * are moved off the block, so that readers can not find it afterwards.
+ * @return the offset its data started at, or -1 if it was not in the stream
+*/
+loff_t bldms_stream_remove(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    loff_t from = -1;
+    int slot;
+
+    mutex_lock(&stream->lock);
+    if (!stream->ready || index < 0 || index >= b_layer->nr_blocks){
+        goto bldms_stream_remove_exit;
+    }
+    slot = stream->slot_of[index];
+    if (slot == -1){
+        goto bldms_stream_remove_exit;
+    }
+    from = bldms_stream_prefix(stream, slot);
+    bldms_stream_tree_add(stream, slot, -(s64)stream->size_at[slot]);
+    stream->slot_of[index] = -1;
+    stream->block_at[slot] = -1;
+    stream->size_at[slot] = 0;
+
+bldms_stream_remove_exit:
+    mutex_unlock(&stream->lock);
+    return from;
+}
+
+/**
+ * Takes the lock of the index, unless it is held and the caller cannot wait.
+ * @return 0 if the lock has been taken, else -EAGAIN
+*/
+static int bldms_stream_lock(struct bldms_stream *stream, bool nowait){
+
+    if (!nowait){
+        mutex_lock(&stream->lock);
+        return 0;
+    }
+    return mutex_trylock(&stream->lock)? 0 : -EAGAIN;
+}
+
+static int __bldms_stream_seek(struct bldms_block_layer *b_layer, loff_t off,
+ int *index, loff_t *cursor, bool nowait){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    s64 sum, total;
+    int pos, step;
+    int res = -1;
+
+    if (bldms_stream_lock(stream, nowait) < 0){
+        return -EAGAIN;
+    }
+    if (!stream->ready || stream->nr_slots == 0){
+        goto bldms_stream_seek_exit;
+    }
+
+    // past the end of the stream, we look for its last byte instead
+    total = bldms_stream_prefix(stream, stream->nr_slots);
+    if (total == 0){
+        goto bldms_stream_seek_exit;
+    }
+    off = min_t(s64, off, total - 1);
+
+    // the largest pos such that the first pos slots hold up to off bytes
+    pos = 0;
+    sum = 0;
+    for (step = rounddown_pow_of_two(stream->capacity); step; step >>= 1){
+        if (pos + step <= stream->capacity && sum + stream->tree[pos + step] <= off){
+            pos += step;
+            sum += stream->tree[pos];
+        }
+    }
+    // slots with no data do not move the sum, so slot pos is a live one
+    *index = stream->block_at[pos];
+    *cursor = sum;
+    res = 0;
+
+bldms_stream_seek_exit:
+    mutex_unlock(&stream->lock);
+    return res;
+}
+
+/**
+ * Finds the block holding the given offset of the stream, or the last block if
+ * the offset is past the end of the stream.
+ * @param index: where to store the block
+ * @param cursor: where to store the offset its data starts at
+ * @return 0 if found, else -1 if the index is not ready or the stream is empty
+*/
+int bldms_stream_seek(struct bldms_block_layer *b_layer, loff_t off, int *index,
+ loff_t *cursor){
+
+    return __bldms_stream_seek(b_layer, off, index, cursor, false);
+}
+
+/**
+ * Same as bldms_stream_seek(), but gives up if the index is locked.
+ * @return -EAGAIN if the index is locked
+*/
+int bldms_stream_seek_nowait(struct bldms_block_layer *b_layer, loff_t off,
+ int *index, loff_t *cursor){
+
+    return __bldms_stream_seek(b_layer, off, index, cursor, true);
+}
+
+static loff_t __bldms_stream_size(struct bldms_block_layer *b_layer, bool nowait){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    loff_t size = -1;
+
+    if (bldms_stream_lock(stream, nowait) < 0){
+        return -EAGAIN;
+    }
+    if (stream->ready){
+        size = bldms_stream_prefix(stream, stream->nr_slots);
+    }
+    mutex_unlock(&stream->lock);
+    return size;
+}
+
+/**
+ * @return how many bytes of data the stream holds, or -1 if the index is not
+ * ready
+*/
+loff_t bldms_stream_size(struct bldms_block_layer *b_layer){
+
+    return __bldms_stream_size(b_layer, false);
+}
+
+/**
+ * Same as bldms_stream_size(), but gives up if the index is locked.
+ * @return -EAGAIN if the index is locked
+*/
+loff_t bldms_stream_size_nowait(struct bldms_block_layer *b_layer){
+
+    return __bldms_stream_size(b_layer, true);
+}
+
+static loff_t __bldms_stream_offset(struct bldms_block_layer *b_layer, int index,
+ bool nowait){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    loff_t off = -1;
+
+    if (bldms_stream_lock(stream, nowait) < 0){
+        return -EAGAIN;
+    }
+    if (stream->ready && index >= 0 && index < b_layer->nr_blocks
+     && stream->slot_of[index] != -1){
+        off = bldms_stream_prefix(stream, stream->slot_of[index]);
+    }
+    mutex_unlock(&stream->lock);
+    return off;
+}
+
+/**
+ * @return the offset where the data of the given block starts in the stream,
+ * or -1 if the index is not ready or the block is not in the stream
+*/
+loff_t bldms_stream_offset(struct bldms_block_layer *b_layer, int index){
+
+    return __bldms_stream_offset(b_layer, index, false);
+}
+
+/**
+ * Same as bldms_stream_offset(), but gives up if the index is locked.
+ * @return -EAGAIN if the index is locked
+*/
+loff_t bldms_stream_offset_nowait(struct bldms_block_layer *b_layer, int index){
+
+    return __bldms_stream_offset(b_layer, index, true);
+}
+
+/**
+ * Lists the blocks following the given one in the stream, for readahead.
+ * @param blocks: where to store up to nr blocks, in stream order
+ * @return how many blocks have been stored, or -1 if the index is not ready or
+ * the given block is not in the stream
+*/
+int bldms_stream_next(struct bldms_block_layer *b_layer, int index, int *blocks,
+ int nr){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    int slot;
+    int res = -1;
+
+    mutex_lock(&stream->lock);
+    if (!stream->ready || index < 0 || index >= b_layer->nr_blocks
+     || stream->slot_of[index] == -1){
+        goto bldms_stream_next_exit;
+    }
+    res = 0;
+    for (slot = stream->slot_of[index] + 1; slot < stream->nr_slots && res < nr;
+     slot++){
+        if (stream->block_at[slot] != -1){
+            blocks[res++] = stream->block_at[slot];
+        }
+    }
+
+bldms_stream_next_exit:
+    mutex_unlock(&stream->lock);
+    return res;
+}
+
+/**
+ * Copies the index in a new array, for the snapshot of a clean unmount.
+ * @param entries: where to store the array, made of the index and the data
+ * size of each block in stream order; to be released with kvfree()
+ * @return how many blocks are in the stream, or -1 if the index is not ready
+*/
+int bldms_stream_export(struct bldms_block_layer *b_layer, int **entries){
+
+    struct bldms_stream *stream = &b_layer->stream;
+    int nr_entries;
+    int i;
+
+    *entries = NULL;
+    mutex_lock(&stream->lock);
+    if (!stream->ready){
+        mutex_unlock(&stream->lock);
+        return -1;
+    }
+    bldms_stream_compact(stream);
+    nr_entries = stream->nr_slots;
+    *entries = kvmalloc_array(max(2 * nr_entries, 1), sizeof(int), GFP_KERNEL);
+    if (!*entries){
+        mutex_unlock(&stream->lock);
+        return -1;
+    }
+    for (i = 0; i < nr_entries; i++){
+        (*entries)[2 * i] = stream->block_at[i];
+        (*entries)[2 * i + 1] = stream->size_at[i];
+    }
+    mutex_unlock(&stream->lock);
+    return nr_entries;
+}
+
+/**
+ * Builds the index from an array filled by bldms_stream_export()
+ * @return 0 if success, else -1
+*/
+int bldms_stream_import(struct bldms_block_layer *b_layer, const int *entries,
+ int nr_entries){
+
+    int i;
+
+    if (bldms_stream_reset(b_layer) < 0){
+        return -1;
+    }
+    for (i = 0; i < nr_entries; i++){
+        bldms_stream_append(b_layer, entries[2 * i], entries[2 * i + 1]);
+    }
+    return 0;
+}
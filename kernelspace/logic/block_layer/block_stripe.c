@@ -0,0 +1,82 @@
+#include <linux/types.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+
+#include "block_layer.h"
+
+/**
+ * Striping of the cold tier over several devices.
+ * 
+ * Blocks of all the devices are linked in the same free and used lists, so
+ * the used list keeps put order across devices and bldms_read() needs no
+ * merging. Devices are formatted with an interleaved free list (see devkeeper),
+ * thus consecutive put_data() calls land on different devices in round-robin.
+*/
+
+#define BLDMS_STRIPE_FMODE (FMODE_READ | FMODE_WRITE | FMODE_EXCL)
+
+/**
+ * Stripes the cold tier of the block layer mounted from sb over the devices at
+ * the given paths, in addition to the mounted one.
+ * @param nr_blocks_per_dev: blocks of each device, as found in the superblock
+ * @return 0 if success, else -1
+*/
+int bldms_stripes_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ char **paths, int nr_paths, int nr_blocks_per_dev){
+
+    struct bldms_stripes *stripes;
+    struct block_device *bdev;
+    int i;
+
+    stripes = &b_layer->stripes;
+    stripes->nr_devs = 1;
+    stripes->nr_blocks_per_dev = nr_blocks_per_dev;
+    stripes->bdevs[0] = sb->s_bdev;
+
+    if (nr_paths + 1 > BLDMS_MAX_STRIPES){
+        pr_err("%s: too many stripes: %d > %d\n", __func__, nr_paths + 1,
+         BLDMS_MAX_STRIPES);
+        return -1;
+    }
+
+    for (i = 0; i < nr_paths; i++){
+        bdev = blkdev_get_by_path(paths[i], BLDMS_STRIPE_FMODE, stripes);
+        if (IS_ERR(bdev)){
+            pr_err("%s: failed to open stripe device %s\n", __func__, paths[i]);
+            goto bldms_stripes_attach_error;
+        }
+        if (set_blocksize(bdev, b_layer->block_size)
+         || i_size_read(bdev->bd_inode) / b_layer->block_size < nr_blocks_per_dev){
+            pr_err("%s: cannot use %s as stripe device\n", __func__, paths[i]);
+            blkdev_put(bdev, BLDMS_STRIPE_FMODE);
+            goto bldms_stripes_attach_error;
+        }
+        stripes->bdevs[stripes->nr_devs++] = bdev;
+    }
+
+    if (stripes->nr_devs > 1){
+        pr_info("%s: cold tier striped over %d devices\n", __func__, stripes->nr_devs);
+    }
+    return 0;
+
+bldms_stripes_attach_error:
+    bldms_stripes_detach(b_layer);
+    return -1;
+}
+
+/**
+ * Flushes and releases the stripe devices other than the mounted one.
+*/
+void bldms_stripes_detach(struct bldms_block_layer *b_layer){
+
+    struct bldms_stripes *stripes;
+    int i;
+
+    stripes = &b_layer->stripes;
+    for (i = 1; i < stripes->nr_devs; i++){
+        sync_blockdev(stripes->bdevs[i]);
+        blkdev_put(stripes->bdevs[i], BLDMS_STRIPE_FMODE);
+        stripes->bdevs[i] = NULL;
+    }
+    stripes->nr_devs = 1;
+}
@@ -0,0 +1,480 @@
+#include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/srcu.h>
+
+#include "block_layer.h"
+
+/**
+ * Hot/cold tiering of blocks.
+ * 
+ * When a hot device is attached, blocks which receive new data are stored in
+ * the hot device, while the cold device (the one owning the superblock) keeps
+ * their logical place. A migration worker brings blocks back to the cold device
+ * in batches, starting from the ones with invalid data and then from the
+ * oldest ones, whenever too many slots of the hot device are in use.
+ * Optionally, cold blocks read with get_data() are promoted to the hot tier.
+ * 
+ * Location of blocks is looked up with bldms_block_locate(), so every user of
+ * the block layer keeps working transparently across tiers. Migrations are
+ * published the same way relocations of the block map are: the block is first
+ * copied in its new location, then the old one is released after a grace period.
+*/
+
+static int bldms_tier_get_free_slot(struct bldms_tier *tier){
+
+    int slot;
+
+    for (slot = 0; slot < tier->nr_hot_slots; slot++){
+        if (tier->hot_owner[slot] == -1){
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @return true if the slot of the admission still holds the block admitted then
+*/
+static bool bldms_tier_admission_live(struct bldms_tier *tier,
+ const struct bldms_tier_admission *adm){
+
+    return tier->hot_owner[adm->slot] >= 0 && tier->hot_gen[adm->slot] == adm->gen;
+}
+
+/**
+ * Drops stale entries from the admission order, keeping the order of the live
+ * ones. Each slot has at most one live entry, and the queue has room for twice
+ * the slots, so at least half of it is free afterwards.
+*/
+static void bldms_tier_admissions_prune(struct bldms_tier *tier){
+
+    struct bldms_tier_admission adm;
+    unsigned int nr_entries;
+    unsigned int i;
+
+    nr_entries = kfifo_len(&tier->admissions) / sizeof(adm);
+    for (i = 0; i < nr_entries; i++){
+        if (kfifo_out(&tier->admissions, &adm, sizeof(adm)) != sizeof(adm)){
+            break;
+        }
+        if (bldms_tier_admission_live(tier, &adm)){
+            kfifo_in(&tier->admissions, &adm, sizeof(adm));
+        }
+    }
+}
+
+/**
+ * Moves a batch of blocks from the hot tier back to their physical block in the
+ * cold tier. Indexes must be distinct. Caller must be in a write section.
+ * @return 0 if success, else -1
+*/
+static int bldms_tier_demote(struct bldms_block_layer *b_layer, int *indexes,
+ int nr_indexes){
+
+    struct bldms_tier *tier;
+    struct bldms_block **blocks;
+    struct bldms_block_loc *locs;
+    int *slots;
+    int res;
+    int i;
+
+    might_sleep();
+    tier = &b_layer->tier;
+    res = 0;
+
+    if (!nr_indexes){
+        return 0;
+    }
+
+    blocks = kcalloc(nr_indexes, sizeof(struct bldms_block *), GFP_KERNEL);
+    locs = kcalloc(nr_indexes, sizeof(struct bldms_block_loc), GFP_KERNEL);
+    slots = kcalloc(nr_indexes, sizeof(int), GFP_KERNEL);
+    if (!blocks || !locs || !slots){
+        pr_err("%s: failed to allocate migration batch\n", __func__);
+        res = -1;
+        goto bldms_tier_demote_exit;
+    }
+
+    for (i = 0; i < nr_indexes; i++){
+        blocks[i] = bldms_block_alloc(b_layer->block_size);
+        if (!blocks[i]){
+            res = -1;
+            goto bldms_tier_demote_exit;
+        }
+        blocks[i]->header.index = indexes[i];
+        slots[i] = tier->hot_slot[indexes[i]];
+        locs[i].tier = BLDMS_TIER_COLD;
+        locs[i].nr = bldms_block_phys(b_layer, indexes[i]);
+    }
+
+    // copy blocks from the hot tier to the cold one
+    if (bldms_move_blocks(b_layer, blocks, nr_indexes, READ) < 0
+     || bldms_move_blocks_at(b_layer, blocks, locs, nr_indexes, WRITE) < 0){
+        pr_err("%s: failed to copy blocks to cold tier\n", __func__);
+        res = -1;
+        goto bldms_tier_demote_exit;
+    }
+
+    // publish new locations, then release slots when nobody can read them anymore
+    for (i = 0; i < nr_indexes; i++){
+        WRITE_ONCE(tier->hot_slot[indexes[i]], -1);
+    }
+    synchronize_srcu(&b_layer->srcu);
+    for (i = 0; i < nr_indexes; i++){
+        tier->hot_owner[slots[i]] = -1;
+        tier->hot_gen[slots[i]] ++;
+        clear_bit(slots[i], tier->hot_invalid);
+        tier->nr_hot_used --;
+    }
+    atomic64_add(nr_indexes, &tier->nr_demoted);
+    pr_debug("%s: %d blocks migrated to cold tier\n", __func__, nr_indexes);
+
+bldms_tier_demote_exit:
+    for (i = 0; blocks && i < nr_indexes; i++){
+        bldms_block_free(blocks[i]);
+    }
+    kfree(blocks);
+    kfree(locs);
+    kfree(slots);
+    return res;
+}
+
+/**
+ * Stores the given block in the hot tier, if there is room for it.
+ * The block must have been read by the caller, which must be in a write section.
+ * @return 0 if success (even if the block stays cold), else -1
+*/
+int bldms_tier_admit(struct bldms_block_layer *b_layer, struct bldms_block *block){
+
+    struct bldms_tier *tier;
+    struct bldms_block_loc loc;
+    struct bldms_tier_admission adm;
+    int index;
+    int slot;
+
+    tier = &b_layer->tier;
+    if (!tier->hot_bdev){
+        return 0;
+    }
+
+    index = block->header.index;
+    slot = tier->hot_slot[index];
+    if (slot >= 0){
+        clear_bit(slot, tier->hot_invalid);
+        return 0;
+    }
+
+    slot = bldms_tier_get_free_slot(tier);
+    if (slot >= 0 && kfifo_avail(&tier->admissions) < sizeof(adm)){
+        bldms_tier_admissions_prune(tier);
+    }
+    if (slot < 0 || kfifo_avail(&tier->admissions) < sizeof(adm)){
+        pr_debug("%s: hot tier is full, block %d stays cold\n", __func__, index);
+        return 0;
+    }
+
+    // a block is published in the hot tier only after it has been copied there
+    loc.tier = BLDMS_TIER_HOT;
+    loc.nr = slot;
+    if (bldms_move_blocks_at(b_layer, &block, &loc, 1, WRITE) < 0){
+        pr_err("%s: failed to copy block %d in hot slot %d\n", __func__, index, slot);
+        return -1;
+    }
+    tier->hot_owner[slot] = index;
+    clear_bit(slot, tier->hot_invalid);
+    WRITE_ONCE(tier->hot_slot[index], slot);
+    tier->nr_hot_used ++;
+    adm.slot = slot;
+    adm.gen = tier->hot_gen[slot];
+    kfifo_in(&tier->admissions, &adm, sizeof(adm));
+
+    return 0;
+}
+
+/**
+ * Annotates that the given block does not contain valid data anymore, so it
+ * is the first to be migrated to the cold tier.
+*/
+void bldms_tier_mark_invalid(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_tier *tier = &b_layer->tier;
+    int slot;
+
+    if (!tier->hot_bdev){
+        return;
+    }
+    slot = tier->hot_slot[index];
+    if (slot >= 0){
+        set_bit(slot, tier->hot_invalid);
+    }
+}
+
+/**
+ * Annotates an access to the given block, which will be promoted to the hot tier
+ * by the migration worker if promotion is enabled.
+ * Can be called outside of write sections.
+*/
+void bldms_tier_touch(struct bldms_block_layer *b_layer, int index){
+
+    struct bldms_tier *tier = &b_layer->tier;
+
+    if (!tier->hot_bdev || !tier->promote || index < 0 || index >= b_layer->nr_blocks){
+        return;
+    }
+    if (READ_ONCE(tier->hot_slot[index]) >= 0){
+        return;
+    }
+    // if the queue is full, the access is simply forgotten
+    kfifo_in_spinlocked(&tier->promote_queue, &index, 1, &tier->promote_lock);
+}
+
+/**
+ * Promotes queued blocks to the hot tier. Caller must be in a write section.
+*/
+static void bldms_tier_promote_queued(struct bldms_block_layer *b_layer){
+
+    struct bldms_tier *tier;
+    struct bldms_block *block;
+    int promoted;
+    int index;
+
+    tier = &b_layer->tier;
+    block = bldms_block_alloc(b_layer->block_size);
+    if (!block){
+        pr_err("%s: failed to allocate block\n", __func__);
+        return;
+    }
+    promoted = 0;
+
+    while (promoted < tier->batch && tier->nr_hot_used < tier->high_wm
+     && kfifo_out_spinlocked(&tier->promote_queue, &index, 1, &tier->promote_lock)){
+
+        if (tier->hot_slot[index] >= 0){
+            continue;
+        }
+        block->header.index = index;
+        if (bldms_move_block(b_layer, block, READ) < 0
+         || !bldms_block_contains_valid_data(b_layer, block)){
+            continue;
+        }
+        if (bldms_tier_admit(b_layer, block) < 0){
+            break;
+        }
+        if (tier->hot_slot[index] >= 0){
+            promoted ++;
+        }
+    }
+
+    atomic64_add(promoted, &tier->nr_promoted);
+    bldms_block_free(block);
+}
+
+static bool bldms_tier_is_victim(const int *victims, int nr_victims, int index){
+
+    int i;
+
+    for (i = 0; i < nr_victims; i++){
+        if (victims[i] == index){
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Migrates to the cold tier up to max_blocks blocks, picking blocks with invalid
+ * data first and then the oldest ones. Caller must be in a write section.
+*/
+static int bldms_tier_migrate(struct bldms_block_layer *b_layer, int max_blocks){
+
+    struct bldms_tier *tier;
+    struct bldms_tier_admission adm;
+    int *victims;
+    int nr_victims;
+    int index;
+    int slot;
+    int res;
+
+    tier = &b_layer->tier;
+    victims = kcalloc(max_blocks, sizeof(int), GFP_KERNEL);
+    if (!victims){
+        pr_err("%s: failed to allocate victims array\n", __func__);
+        return -1;
+    }
+    nr_victims = 0;
+
+    for_each_set_bit(slot, tier->hot_invalid, tier->nr_hot_slots){
+        if (nr_victims == max_blocks) break;
+        victims[nr_victims++] = tier->hot_owner[slot];
+    }
+
+    while (nr_victims < max_blocks
+     && kfifo_out(&tier->admissions, &adm, sizeof(adm)) == sizeof(adm)){
+        // stale entry, or block already picked
+        if (!bldms_tier_admission_live(tier, &adm) || test_bit(adm.slot, tier->hot_invalid)){
+            continue;
+        }
+        index = tier->hot_owner[adm.slot];
+        if (bldms_tier_is_victim(victims, nr_victims, index)){
+            continue;
+        }
+        victims[nr_victims++] = index;
+    }
+
+    res = bldms_tier_demote(b_layer, victims, nr_victims);
+    kfree(victims);
+    return res;
+}
+
+static void bldms_tier_work(struct work_struct *work){
+
+    struct bldms_tier *tier;
+    struct bldms_block_layer *b_layer;
+
+    tier = container_of(to_delayed_work(work), struct bldms_tier, work);
+    b_layer = container_of(tier, struct bldms_block_layer, tier);
+
+    bldms_start_write(b_layer);
+    if (tier->promote){
+        bldms_tier_promote_queued(b_layer);
+    }
+    if (tier->nr_hot_used > tier->high_wm){
+        bldms_tier_migrate(b_layer, min(tier->batch, tier->nr_hot_used - tier->low_wm));
+    }
+    bldms_end_write(b_layer);
+
+    queue_delayed_work(system_long_wq, &tier->work, tier->interval);
+}
+
+void bldms_tier_init(struct bldms_block_layer *b_layer){
+
+    INIT_KFIFO(b_layer->tier.promote_queue);
+    spin_lock_init(&b_layer->tier.promote_lock);
+    INIT_DELAYED_WORK(&b_layer->tier.work, bldms_tier_work);
+}
+
+/**
+ * Uses the device at hot_path as hot tier of the block layer mounted from sb,
+ * and starts the migration worker.
+ * @param promote: true to promote accessed cold blocks to the hot tier
+ * @param interval_ms: time between two migration passes
+ * @param batch: max blocks migrated in a pass
+ * @param high_pct, low_pct: migration starts when more than high_pct percent
+ * of the hot tier is used, and stops when less than low_pct percent is used
+ * @return 0 if success, else -1
+*/
+int bldms_tier_attach(struct bldms_block_layer *b_layer, struct super_block *sb,
+ const char *hot_path,
+ bool promote, unsigned int interval_ms, int batch, int high_pct, int low_pct){
+
+    struct bldms_tier *tier;
+    struct block_device *bdev;
+    int i;
+
+    tier = &b_layer->tier;
+
+    bdev = blkdev_get_by_path(hot_path, FMODE_READ | FMODE_WRITE | FMODE_EXCL, b_layer);
+    if (IS_ERR(bdev)){
+        pr_err("%s: failed to open hot device %s\n", __func__, hot_path);
+        return -1;
+    }
+    if (bdev == sb->s_bdev || set_blocksize(bdev, b_layer->block_size)){
+        pr_err("%s: cannot use %s as hot device\n", __func__, hot_path);
+        goto bldms_tier_attach_error;
+    }
+
+    tier->nr_hot_slots = i_size_read(bdev->bd_inode) / b_layer->block_size;
+    tier->nr_hot_used = 0;
+    tier->hot_slot = kvmalloc_array(b_layer->nr_blocks, sizeof(int), GFP_KERNEL);
+    tier->hot_owner = kvmalloc_array(tier->nr_hot_slots, sizeof(int), GFP_KERNEL);
+    tier->hot_invalid = bitmap_zalloc(tier->nr_hot_slots, GFP_KERNEL);
+    tier->hot_gen = kvcalloc(tier->nr_hot_slots, sizeof(unsigned int), GFP_KERNEL);
+    if (!tier->nr_hot_slots || !tier->hot_slot || !tier->hot_owner || !tier->hot_invalid
+     || !tier->hot_gen || kfifo_alloc(&tier->admissions,
+     2 * tier->nr_hot_slots * sizeof(struct bldms_tier_admission), GFP_KERNEL)){
+        pr_err("%s: failed to allocate hot tier of %d blocks\n", __func__,
+         tier->nr_hot_slots);
+        goto bldms_tier_attach_error;
+    }
+    for (i = 0; i < b_layer->nr_blocks; i++){
+        tier->hot_slot[i] = -1;
+    }
+    for (i = 0; i < tier->nr_hot_slots; i++){
+        tier->hot_owner[i] = -1;
+    }
+    kfifo_reset(&tier->promote_queue);
+
+    tier->promote = promote;
+    tier->interval = msecs_to_jiffies(interval_ms);
+    tier->batch = max(batch, 1);
+    tier->high_wm = tier->nr_hot_slots * high_pct / 100;
+    tier->low_wm = min(tier->nr_hot_slots * low_pct / 100, tier->high_wm);
+    tier->hot_bdev = bdev;
+
+    queue_delayed_work(system_long_wq, &tier->work, tier->interval);
+    pr_info("%s: hot tier of %d blocks attached from %s\n", __func__,
+     tier->nr_hot_slots, hot_path);
+    return 0;
+
+bldms_tier_attach_error:
+    kvfree(tier->hot_slot);
+    kvfree(tier->hot_owner);
+    bitmap_free(tier->hot_invalid);
+    kvfree(tier->hot_gen);
+    tier->hot_slot = NULL;
+    tier->hot_owner = NULL;
+    tier->hot_invalid = NULL;
+    tier->hot_gen = NULL;
+    blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+    return -1;
+}
+
+/**
+ * Migrates all the blocks in the hot tier back to the cold one, then releases
+ * the hot device. There must be no users of the block layer left.
+*/
+void bldms_tier_detach(struct bldms_block_layer *b_layer){
+
+    struct bldms_tier *tier;
+    int slot;
+
+    tier = &b_layer->tier;
+    if (!tier->hot_bdev){
+        return;
+    }
+
+    cancel_delayed_work_sync(&tier->work);
+
+    // every block must be back in the cold tier before it is unmounted
+    for (slot = 0; slot < tier->nr_hot_slots; slot++){
+        if (tier->hot_owner[slot] >= 0){
+            set_bit(slot, tier->hot_invalid);
+        }
+    }
+    while (tier->nr_hot_used > 0){
+        if (bldms_tier_migrate(b_layer, tier->batch) < 0){
+            pr_err("%s: failed to migrate blocks back to cold tier\n", __func__);
+            break;
+        }
+    }
+    sync_blockdev(b_layer->sb->s_bdev);
+
+    blkdev_put(tier->hot_bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+    tier->hot_bdev = NULL;
+    kvfree(tier->hot_slot);
+    kvfree(tier->hot_owner);
+    bitmap_free(tier->hot_invalid);
+    kvfree(tier->hot_gen);
+    kfifo_free(&tier->admissions);
+    tier->hot_slot = NULL;
+    tier->hot_owner = NULL;
+    tier->hot_invalid = NULL;
+    tier->hot_gen = NULL;
+}
@@ -0,0 +1,149 @@
+#include <linux/types.h>
+#include <linux/log2.h>
+#include <linux/minmax.h>
+
+#include "block_serialization.h"
+#include "block_layer.h"
+
+/**
+ * Size-class zones.
+ *
+ * The data blocks of a zoned device are carved into zones, each one made of
+ * blocks of the same size class. Classes smaller than the device block are
+ * packed into device blocks, so a device block of a 256 B zone holds 16
+ * blocks if the device block is 4 KiB. Blocks keep being addressed by logical
+ * index, which is contiguous across zones, and all valid blocks are linked in
+ * the same used list, so bldms_read() is not aware of zones. Each zone has its
+ * own free list instead, so that put_data() can pick a block of the smallest
+ * class which fits the data.
+*/
+
+/**
+ * @return how many bytes of data a block of the given zone can hold
+*/
+static size_t bldms_zone_capacity(const struct bldms_zone *zone){
+
+    struct bldms_block_header header = {};
+
+    return zone->slot_size - bldms_calc_block_header_size(header);
+}
+
+/**
+ * Appends a zone of blocks of slot_size bytes to the zones of the block layer.
+ * Zones start right after the reserved blocks and are contiguous, both in
+ * logical indexes and in device blocks.
+ * @param nr_dev_blocks: device blocks the zone is made of
+ * @param first_free_bi, last_free_bi: free list of the zone
+ * @return the logical index after the last block of the zone, or -1 if error
+*/
+int bldms_zones_add(struct bldms_block_layer *b_layer, size_t slot_size,
+ int nr_dev_blocks, int first_free_bi, int last_free_bi){
+
+    struct bldms_zones *zones;
+    struct bldms_zone *zone, *prev;
+
+    zones = &b_layer->zones;
+    if (zones->nr_zones == BLDMS_MAX_ZONES){
+        pr_err("%s: too many zones\n", __func__);
+        return -1;
+    }
+    zone = &zones->zone[zones->nr_zones];
+    zone->slot_size = slot_size;
+
+    // slots must not straddle device blocks, and must hold at least one byte
+    if (!is_power_of_2(slot_size) || slot_size > b_layer->block_size
+     || (ssize_t)bldms_zone_capacity(zone) <= 0 || nr_dev_blocks <= 0){
+        pr_err("%s: invalid zone of %d blocks of %lu bytes\n", __func__,
+         nr_dev_blocks, slot_size);
+        return -1;
+    }
+
+    zone->slots_per_block = b_layer->block_size / slot_size;
+    zone->nr_slots = nr_dev_blocks * zone->slots_per_block;
+    if (zones->nr_zones == 0){
+        zone->first_index = b_layer->start_data_index;
+        zone->first_dev_block = b_layer->start_data_index;
+    }
+    else {
+        prev = &zones->zone[zones->nr_zones - 1];
+        zone->first_index = prev->first_index + prev->nr_slots;
+        zone->first_dev_block = prev->first_dev_block
+         + prev->nr_slots / prev->slots_per_block;
+    }
+    zone->free_blocks.first_bi = first_free_bi;
+    zone->free_blocks.last_bi = last_free_bi;
+    zones->nr_zones++;
+
+    pr_info("%s: zone %d has %d blocks of %lu bytes\n", __func__,
+     zones->nr_zones - 1, zone->nr_slots, slot_size);
+    return zone->first_index + zone->nr_slots;
+}
+
+/**
+ * Forgets the zones of the block layer, going back to blocks with the size of
+ * device blocks.
+*/
+void bldms_zones_clear(struct bldms_block_layer *b_layer){
+
+    b_layer->zones.nr_zones = 0;
+}
+
+/**
+ * @return the free list the given block goes back to once invalidated
+*/
+struct bldms_blocks_head *bldms_block_free_list(struct bldms_block_layer *b_layer,
+ int index){
+
+    struct bldms_zone *zone;
+
+    zone = bldms_zone_of(b_layer, index);
+    return zone? &zone->free_blocks : &b_layer->free_blocks;
+}
+
+/**
+ * @return the free list of the zone with the smallest blocks which can hold
+ * size bytes of data and still have a free block, or NULL if there is none.
+ * Devices without zones always get their only free list.
+*/
+struct bldms_blocks_head *bldms_zones_fit(struct bldms_block_layer *b_layer,
+ size_t size){
+
+    struct bldms_zones *zones;
+    struct bldms_zone *best;
+    int z;
+
+    zones = &b_layer->zones;
+    if (zones->nr_zones == 0){
+        return &b_layer->free_blocks;
+    }
+
+    best = NULL;
+    for (z = 0; z < zones->nr_zones; z++){
+        if (zones->zone[z].free_blocks.first_bi == -1
+         || bldms_zone_capacity(&zones->zone[z]) < size){
+            continue;
+        }
+        if (!best || zones->zone[z].slot_size < best->slot_size){
+            best = &zones->zone[z];
+        }
+    }
+    return best? &best->free_blocks : NULL;
+}
+
+/**
+ * Sets the capacity of a block just read from the device according to its
+ * zone, so that data put in it never overflows in the next block of the same
+ * device block.
+*/
+void bldms_zone_fix_capacity(struct bldms_block_layer *b_layer,
+ struct bldms_block *block){
+
+    struct bldms_zone *zone;
+
+    zone = bldms_zone_of(b_layer, block->header.index);
+    if (zone){
+        block->header.data_capacity = bldms_zone_capacity(zone);
+        block->header.data_size = min(block->header.data_size,
+         block->header.data_capacity);
+    }
+}
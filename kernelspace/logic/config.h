@@ -11,6 +11,30 @@
 
 #define BLDMS_DEV_NAME_DEFAULT "bldmsdisk"
 
+#define BLDMS_STATS_DIRNAME_DEFAULT "bldms_stats"
+
+#define BLDMS_COMPACT_INTERVAL_MS_DEFAULT 0 // compaction is disabled by default
+#define BLDMS_COMPACT_BATCH_DEFAULT 8
+
+#define BLDMS_TIER_INTERVAL_MS_DEFAULT 100
+#define BLDMS_TIER_BATCH_DEFAULT 16
+#define BLDMS_TIER_HIGH_PCT_DEFAULT 75  // migration to cold tier starts above this usage
+#define BLDMS_TIER_LOW_PCT_DEFAULT 50   // and stops below this one
+
+#define BLDMS_LOG_SEGMENT_BLOCKS_DEFAULT 16
+#define BLDMS_LOG_CLEAN_INTERVAL_MS_DEFAULT 1000
+#define BLDMS_LOG_CLEAN_PCT_DEFAULT 50 // segments with less valid data get cleaned
+
+#define BLDMS_READ_CHUNK_BLOCKS_DEFAULT 64 // blocks read() traverses before letting writers in, 0 for no limit
+#define BLDMS_READAHEAD_MIN_BLOCKS_DEFAULT 4    // first readahead window of sequential reads
+#define BLDMS_READAHEAD_MAX_BLOCKS_DEFAULT 64   // the window doubles up to this one, 0 disables readahead
+
+#define BLDMS_DIRTY_BUDGET_DEFAULT 1024 // dirty blocks before put_data() is paced, 0 for no limit
+#define BLDMS_DIRTY_MAX_PAUSE_MS_DEFAULT 200
+
+#define BLDMS_SCAN_WORKERS_DEFAULT 4    // workers scanning block headers at mount
+#define BLDMS_SCAN_BATCH_DEFAULT 128    // blocks read at once by each scan worker
+
 #ifdef MODULE
 extern char *BLDMS_NAME;
 extern int BLDMS_MINORS;
@@ -20,6 +44,23 @@ extern int BLDMS_NR_SECTORS_IN_BLOCK;
 extern int BLDMS_BLOCKSIZE;
 extern char *BLDMS_SYSCALL_DESCS_DIRNAME;
 extern char *BLDMS_DEV_NAME;
+extern char *BLDMS_STATS_DIRNAME;
+extern int BLDMS_COMPACT_INTERVAL_MS;
+extern int BLDMS_COMPACT_BATCH;
+extern int BLDMS_TIER_INTERVAL_MS;
+extern int BLDMS_TIER_BATCH;
+extern int BLDMS_TIER_HIGH_PCT;
+extern int BLDMS_TIER_LOW_PCT;
+extern int BLDMS_LOG_SEGMENT_BLOCKS;
+extern int BLDMS_LOG_CLEAN_INTERVAL_MS;
+extern int BLDMS_LOG_CLEAN_PCT;
+extern int BLDMS_READ_CHUNK_BLOCKS;
+extern int BLDMS_READAHEAD_MIN_BLOCKS;
+extern int BLDMS_READAHEAD_MAX_BLOCKS;
+extern int BLDMS_DIRTY_BUDGET;
+extern int BLDMS_DIRTY_MAX_PAUSE_MS;
+extern int BLDMS_SCAN_WORKERS;
+extern int BLDMS_SCAN_BATCH;
 #endif
 
 /**
@@ -116,4 +116,20 @@ int bldms_init_device(struct bldms_device *dev,
     return 0;
 }
 
+/**
+ * @return the bldms device backing the given block device, or NULL if it is
+ * not a bldms disk
+*/
+struct bldms_device *bldms_device_from_bdev(struct block_device *bdev){
+
+    struct bldms_device *dev;
 
+    if (bdev->bd_disk->fops->submit_bio != bldms_submit_bio || get_start_sect(bdev)){
+        return NULL;
+    }
+    dev = bdev->bd_disk->private_data;
+    if (!dev || !dev->online || !dev->data){
+        return NULL;
+    }
+    return dev;
+}
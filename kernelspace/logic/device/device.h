@@ -35,5 +35,6 @@ blk_status_t bldms_move_data(
 int bldms_move_bio(struct bldms_device *dev,
  struct bio *bio);
 blk_qc_t bldms_submit_bio(struct bio *bio);
+struct bldms_device *bldms_device_from_bdev(struct block_device *bdev);
 
 #endif // DEVICE_H_INCLUDED
\ No newline at end of file
@@ -43,6 +43,57 @@ module_param(BLDMS_SYSCALL_DESCS_DIRNAME, charp, 0444);
 char *BLDMS_DEV_NAME = BLDMS_DEV_NAME_DEFAULT;
 module_param(BLDMS_DEV_NAME, charp, 0444);
 
+char *BLDMS_STATS_DIRNAME = BLDMS_STATS_DIRNAME_DEFAULT;
+module_param(BLDMS_STATS_DIRNAME, charp, 0444);
+
+int BLDMS_COMPACT_INTERVAL_MS = BLDMS_COMPACT_INTERVAL_MS_DEFAULT;
+module_param(BLDMS_COMPACT_INTERVAL_MS, int, 0444);
+
+int BLDMS_COMPACT_BATCH = BLDMS_COMPACT_BATCH_DEFAULT;
+module_param(BLDMS_COMPACT_BATCH, int, 0444);
+
+int BLDMS_TIER_INTERVAL_MS = BLDMS_TIER_INTERVAL_MS_DEFAULT;
+module_param(BLDMS_TIER_INTERVAL_MS, int, 0444);
+
+int BLDMS_TIER_BATCH = BLDMS_TIER_BATCH_DEFAULT;
+module_param(BLDMS_TIER_BATCH, int, 0444);
+
+int BLDMS_TIER_HIGH_PCT = BLDMS_TIER_HIGH_PCT_DEFAULT;
+module_param(BLDMS_TIER_HIGH_PCT, int, 0444);
+
+int BLDMS_TIER_LOW_PCT = BLDMS_TIER_LOW_PCT_DEFAULT;
+module_param(BLDMS_TIER_LOW_PCT, int, 0444);
+
+int BLDMS_LOG_SEGMENT_BLOCKS = BLDMS_LOG_SEGMENT_BLOCKS_DEFAULT;
+module_param(BLDMS_LOG_SEGMENT_BLOCKS, int, 0444);
+
+int BLDMS_LOG_CLEAN_INTERVAL_MS = BLDMS_LOG_CLEAN_INTERVAL_MS_DEFAULT;
+module_param(BLDMS_LOG_CLEAN_INTERVAL_MS, int, 0444);
+
+int BLDMS_LOG_CLEAN_PCT = BLDMS_LOG_CLEAN_PCT_DEFAULT;
+module_param(BLDMS_LOG_CLEAN_PCT, int, 0444);
+
+int BLDMS_READ_CHUNK_BLOCKS = BLDMS_READ_CHUNK_BLOCKS_DEFAULT;
+module_param(BLDMS_READ_CHUNK_BLOCKS, int, 0444);
+
+int BLDMS_READAHEAD_MIN_BLOCKS = BLDMS_READAHEAD_MIN_BLOCKS_DEFAULT;
+module_param(BLDMS_READAHEAD_MIN_BLOCKS, int, 0444);
+
+int BLDMS_READAHEAD_MAX_BLOCKS = BLDMS_READAHEAD_MAX_BLOCKS_DEFAULT;
+module_param(BLDMS_READAHEAD_MAX_BLOCKS, int, 0444);
+
+int BLDMS_DIRTY_BUDGET = BLDMS_DIRTY_BUDGET_DEFAULT;
+module_param(BLDMS_DIRTY_BUDGET, int, 0444);
+
+int BLDMS_DIRTY_MAX_PAUSE_MS = BLDMS_DIRTY_MAX_PAUSE_MS_DEFAULT;
+module_param(BLDMS_DIRTY_MAX_PAUSE_MS, int, 0444);
+
+int BLDMS_SCAN_WORKERS = BLDMS_SCAN_WORKERS_DEFAULT;
+module_param(BLDMS_SCAN_WORKERS, int, 0444);
+
+int BLDMS_SCAN_BATCH = BLDMS_SCAN_BATCH_DEFAULT;
+module_param(BLDMS_SCAN_BATCH, int, 0444);
+
 #define BLDMS_NR_SECTORS_IN_BLOCK BLDMS_BLOCKSIZE / BLDMS_KERNEL_SECTOR_SIZE
 
 static int bldms_init(void){
@@ -2,12 +2,30 @@
 #include <linux/minmax.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/uio.h>
+#include <linux/blkdev.h>
+#include <linux/fadvise.h>
 
+#include "config.h"
 #include "vfs_supported.h"
 #include "block_layer/block_layer.h"
+#include "singlefilefs/singlefilefs.h"
 
 struct bldms_read_state *bldms_read_state_alloc(){
-    return kmalloc(sizeof(struct bldms_read_state), GFP_KERNEL);
+
+    struct bldms_read_state *read_state;
+
+    read_state = kmalloc(sizeof(struct bldms_read_state), GFP_KERNEL);
+    if (read_state){
+        mutex_init(&read_state->lock);
+        read_state->ra_advice = POSIX_FADV_NORMAL;
+        read_state->framed = false;
+        read_state->follow = false;
+        read_state->eof_seq = -1;
+    }
+    return read_state;
 }
 
 void bldms_read_state_free(struct bldms_read_state *read_state){
@@ -18,58 +36,561 @@ void bldms_read_state_init( struct bldms_block_layer *b_layer,
  struct bldms_read_state *read_state, struct file *filp){
 
     read_state ->stream_cursor = 0;
-    read_state ->stream_cursor_old = 0;
-    read_state ->off_old = filp ->f_pos;
+    read_state ->off_old = 0;
+    read_state ->off_stale = -1;
     read_state ->filp = filp;
     read_state ->b_i_start = b_layer->used_blocks.first_bi;
+    read_state ->b_i_done = false;
+    read_state ->pending = false;
+    bldms_readahead_reset(read_state);
+}
+
+/**
+ * Prefetches up to nr blocks following the given one in the stream, plugging
+ * the requests so that adjacent ones are merged.
+ * @param first, last: where to store the first and the last block prefetched,
+ * or -1 if none
+ * @return how many blocks have been prefetched, or -1 if the stream index can
+ * not tell which blocks follow the given one
+*/
+static int bldms_readahead_blocks(struct bldms_block_layer *b_layer, int from,
+ int nr, int *first, int *last){
+
+    int blocks[16];
+    struct blk_plug plug;
+    int done, got, i;
+
+    *first = -1;
+    *last = -1;
+    done = 0;
+    blk_start_plug(&plug);
+    while (done < nr){
+        got = bldms_stream_next(b_layer, from, blocks,
+         min(nr - done, (int)ARRAY_SIZE(blocks)));
+        if (got < 0){
+            done = done? done : -1;
+            break;
+        }
+        for (i = 0; i < got; i++){
+            bldms_prefetch_block(b_layer, blocks[i]);
+        }
+        if (!got) break;
+        if (*first == -1){
+            *first = blocks[0];
+        }
+        *last = blocks[got - 1];
+        from = *last;
+        done += got;
+    }
+    blk_finish_plug(&plug);
+    return done;
+}
+
+/**
+ * Starts a new readahead window, with the size given by the advice of the file
+ * session. Called whenever the reader does not go on from where it stopped.
+*/
+void bldms_readahead_reset(struct bldms_read_state *read_state){
+
+    if (read_state->ra_advice == POSIX_FADV_RANDOM || BLDMS_READAHEAD_MAX_BLOCKS <= 0){
+        read_state->ra_size = 0;
+    }
+    else if (read_state->ra_advice == POSIX_FADV_SEQUENTIAL){
+        read_state->ra_size = BLDMS_READAHEAD_MAX_BLOCKS;
+    }
+    else {
+        read_state->ra_size = clamp(BLDMS_READAHEAD_MIN_BLOCKS, 1,
+         BLDMS_READAHEAD_MAX_BLOCKS);
+    }
+    read_state->ra_last = -1;
+    read_state->ra_mark = -1;
+}
+
+/**
+ * Adaptive readahead, called on each block the reader reaches. The first block
+ * of each window is its mark: once the reader gets there, the next window is
+ * prefetched after the last one, twice as large up to BLDMS_READAHEAD_MAX_BLOCKS,
+ * so that one window is always in flight ahead of a sequential reader. Windows
+ * follow the stream index, so blocks are prefetched without reading the next
+ * links of the blocks before them.
+ * @return 0 if a window has just been started after the given block, else -1,
+ * in which case the caller still prefetches its next block: this keeps readers
+ * going even if the blocks which bound the window are invalidated
+*/
+static int bldms_readahead(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, int index){
+
+    int from, first, last, nr;
+
+    if (!read_state->ra_size){
+        return -1;
+    }
+    // the reader is in the window, which has still blocks left past the mark
+    if (read_state->ra_mark != -1 && index != read_state->ra_mark
+     && index != read_state->ra_last){
+        return -1;
+    }
+
+    from = index == read_state->ra_mark? read_state->ra_last : index;
+    nr = bldms_readahead_blocks(b_layer, from, read_state->ra_size, &first, &last);
+    // the end of the last window has been invalidated, we start from the reader
+    if (nr < 0 && from != index){
+        nr = bldms_readahead_blocks(b_layer, index, read_state->ra_size, &first,
+         &last);
+    }
+    if (nr < 0){
+        read_state->ra_mark = -1;
+        read_state->ra_last = -1;
+        return -1;
+    }
+    // at the end of the stream, the next block read tries again
+    read_state->ra_mark = first;
+    read_state->ra_last = last;
+    if (!nr){
+        return -1;
+    }
+    read_state->ra_size = min(2 * read_state->ra_size, BLDMS_READAHEAD_MAX_BLOCKS);
+    return 0;
+}
+
+/**
+ * Applies a POSIX_FADV_* advice given to the file session. Sequential reads
+ * start with the largest window, random ones have no readahead, and the blocks
+ * holding the given range are prefetched on POSIX_FADV_WILLNEED.
+*/
+void bldms_read_state_advise(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, loff_t len, int advice){
+
+    int index, first, last, nr;
+    loff_t cursor;
+    int reader_idx;
+
+    switch (advice){
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_RANDOM:
+        read_state->ra_advice = advice;
+        bldms_readahead_reset(read_state);
+        break;
+    case POSIX_FADV_WILLNEED:
+        if (BLDMS_READAHEAD_MAX_BLOCKS <= 0 || b_layer->log.enabled){
+            break;
+        }
+        // len 0 stands for the end of the file
+        nr = BLDMS_READAHEAD_MAX_BLOCKS;
+        if (len > 0){
+            nr = min_t(loff_t, nr, DIV_ROUND_UP(len, b_layer->block_size));
+        }
+        bldms_start_read(b_layer, &reader_idx);
+        if (bldms_stream_seek(b_layer, off, &index, &cursor) == 0){
+            bldms_prefetch_block(b_layer, index);
+            bldms_readahead_blocks(b_layer, index, nr - 1, &first, &last);
+        }
+        bldms_end_read(b_layer, reader_idx);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Switches the session between reads of the bare stream and framed reads,
+ * starting it over from the first block of the stream.
+ * Must be called with read_state->lock held.
+*/
+void bldms_read_state_set_framed(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, bool framed){
+
+    bldms_read_state_init(b_layer, read_state, read_state->filp);
+    read_state->framed = framed;
+}
+
+/**
+ * Reads the records of the valid data, in stream order, until the given
+ * iterator can not hold the next one: records are never split between reads.
+ * The file position counts the bytes of records returned, and reads go on from
+ * the record after the last one returned. Only position 0 can be read from
+ * otherwise, starting over from the first record.
+ * Must be called with read_state->lock held.
+ *
+ * Invalidations move the resume point of framed sessions as well, so the read
+ * and the read state lock are dropped every BLDMS_READ_CHUNK_BLOCKS records as
+ * bldms_read() does, and the read goes on from the resume point once back.
+ * @return bytes read, -EMSGSIZE if the iterator can not hold the next record,
+ * else another error
+*/
+ssize_t bldms_read_framed(struct bldms_block_layer *b_layer, struct iov_iter *to,
+ loff_t *off, struct bldms_read_state *read_state){
+
+    struct singlefilefs_record record;
+    struct bldms_block *b;
+    ssize_t read;
+    size_t len;
+    size_t copied;
+    bool faulted;
+    int nr_traversed;
+    int reader_idx;
+
+    if (*off != read_state->off_old){
+        if (*off != 0){
+            return -EINVAL;
+        }
+        bldms_read_state_set_framed(b_layer, read_state, true);
+    }
+    len = iov_iter_count(to);
+
+    b = bldms_block_alloc(b_layer->block_size);
+    if (!b){
+        return -ENOMEM;
+    }
+
+    read = 0;
+    faulted = false;
+    nr_traversed = 0;
+    bldms_start_read(b_layer, &reader_idx);
+
+    while (true){
+
+        if (BLDMS_READ_CHUNK_BLOCKS > 0 && nr_traversed == BLDMS_READ_CHUNK_BLOCKS){
+            bldms_end_read(b_layer, reader_idx);
+            mutex_unlock(&read_state->lock);
+
+            cond_resched();
+
+            mutex_lock(&read_state->lock);
+            bldms_start_read(b_layer, &reader_idx);
+            nr_traversed = 0;
+        }
+
+        // no resume point, every block of the stream is still to be returned
+        b->header.index = read_state->b_i_start;
+        if (b->header.index == -1){
+            b->header.index = READ_ONCE(b_layer->used_blocks.first_bi);
+            if (b->header.index == -1) break;
+            read_state->b_i_start = b->header.index;
+            read_state->b_i_done = false;
+        }
+        if (bldms_move_block(b_layer, b, READ) < 0){
+            pr_err("%s: failed to read block %d\n", __func__, b->header.index);
+            read = -1;
+            goto bldms_read_framed_exit;
+        }
+        nr_traversed ++;
+        if (bldms_readahead(b_layer, read_state, b->header.index) < 0){
+            bldms_prefetch_block(b_layer, b->header.next);
+        }
+
+        // resume points are moved off blocks before they are invalidated
+        if (!bldms_block_contains_valid_data(b_layer, b)){
+            pr_warn("%s: resume point %d holds no valid data\n", __func__,
+             b->header.index);
+            break;
+        }
+
+        if (read_state->b_i_done){
+            // the last block is kept, so that data appended after it is found
+            if (b->header.next == -1) break;
+            read_state->b_i_start = b->header.next;
+            read_state->b_i_done = false;
+            continue;
+        }
+
+        if (len - read < sizeof(record) + b->header.data_size){
+            if (!read){
+                read = -EMSGSIZE;
+            }
+            break;
+        }
+        record.index = b->header.index;
+        record.size = b->header.data_size;
+        copied = copy_to_iter(&record, sizeof(record), to);
+        if (copied == sizeof(record)){
+            copied += copy_to_iter(b->data, b->header.data_size, to);
+        }
+        if (copied < sizeof(record) + b->header.data_size){
+            // a record is returned whole or not at all
+            iov_iter_revert(to, copied);
+            faulted = true;
+            break;
+        }
+        read += copied;
+        read_state->b_i_done = true;
+    }
+
+    if (!read && faulted){
+        read = -EFAULT;
+    }
+    if (read > 0){
+        *off += read;
+    }
+    read_state->off_old = *off;
+    // invalidations must not move the position of framed sessions back
+    read_state->stream_cursor = *off;
+
+bldms_read_framed_exit:
+    bldms_end_read(b_layer, reader_idx);
+    bldms_block_free(b);
+    return read;
+}
+
+/**
+ * Finds where a read of the page cache of the-file starts, applying the changes
+ * invalidations made to the session as bldms_read() does. A read going on from
+ * where the last one stopped follows the data it was reading, even if data
+ * before it has been invalidated since then. The read state is not changed:
+ * bldms_read_state_save() records where the read stops.
+ * Must be called with read_state->lock held.
+ * @param nowait: true to give up if the stream index is locked
+ * @return the offset to read from, -EAGAIN if nowait and the stream index is
+ * locked, or -1 if there is no stream index to resolve offsets, so the-file can
+ * only be read with bldms_read()
+*/
+loff_t bldms_read_state_resume(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, bool nowait){
+
+    loff_t size, start;
+
+    if (b_layer->log.enabled){
+        return -1;
+    }
+    size = nowait? bldms_stream_size_nowait(b_layer) : bldms_stream_size(b_layer);
+    if (size < 0){
+        return size;
+    }
+
+    if (read_state->off_stale >= 0 && off == read_state->off_stale){
+        off = read_state->off_old;
+    }
+    if (off == read_state->off_old && read_state->b_i_start != -1){
+        start = nowait? bldms_stream_offset_nowait(b_layer, read_state->b_i_start)
+         : bldms_stream_offset(b_layer, read_state->b_i_start);
+        if (start == -EAGAIN){
+            return start;
+        }
+        if (start >= 0){
+            off = start + off - read_state->stream_cursor;
+        }
+    }
+    return off;
+}
+
+/**
+ * Stores in the read state where a read of the page cache of the-file stopped,
+ * with the block holding that offset, so that invalidations can move it. The
+ * position is pending until bldms_read_state_confirm() commits it.
+ * Must be called with read_state->lock held.
+ * @param nowait: true to give up if the stream index is locked
+ * @return 0 if success, or -EAGAIN if nowait and the stream index is locked, in
+ * which case the read state is left untouched
+*/
+int bldms_read_state_save(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, bool nowait){
+
+    int index;
+    loff_t cursor;
+    int res;
+
+    res = nowait? bldms_stream_seek_nowait(b_layer, off, &index, &cursor)
+     : bldms_stream_seek(b_layer, off, &index, &cursor);
+    if (res == -EAGAIN){
+        return res;
+    }
+    if (res < 0){
+        index = -1;
+        cursor = off;
+    }
+    read_state->b_i_next = index;
+    read_state->stream_cursor_next = cursor;
+    read_state->off_next = off;
+    read_state->off_next_stale = -1;
+    WRITE_ONCE(read_state->pending, true);
+    return 0;
+}
+
+/**
+ * @return the file position a read of the session leaves, once the vfs has
+ * updated it, or -1 if there is no pending position
+*/
+static loff_t bldms_read_state_next_pos(struct bldms_read_state *read_state){
+
+    if (!READ_ONCE(read_state->pending)){
+        return -1;
+    }
+    return read_state->off_next_stale >= 0? read_state->off_next_stale
+     : read_state->off_next;
+}
+
+/**
+ * @return the file position the session is at
+*/
+static loff_t bldms_read_state_pos(struct bldms_read_state *read_state){
+
+    return read_state->off_stale >= 0? read_state->off_stale : read_state->off_old;
+}
+
+/**
+ * Commits the position saved by the last read of the page cache if the file
+ * position has been moved there, that is if the read was not a positional one,
+ * or drops it if the file position is still where the session was.
+ * Must be called with read_state->lock held.
+ * @param f_pos: the file position of the session
+*/
+void bldms_read_state_confirm(struct bldms_read_state *read_state, loff_t f_pos){
+
+    if (!read_state->pending){
+        return;
+    }
+    if (f_pos == bldms_read_state_next_pos(read_state)){
+        read_state->b_i_start = read_state->b_i_next;
+        read_state->stream_cursor = read_state->stream_cursor_next;
+        read_state->off_old = read_state->off_next;
+        read_state->off_stale = read_state->off_next_stale;
+        WRITE_ONCE(read_state->pending, false);
+    }
+    else if (f_pos == bldms_read_state_pos(read_state)){
+        WRITE_ONCE(read_state->pending, false);
+    }
+}
+
+/**
+ * Tells whether a read at off may go on from where the session stopped, that
+ * is whether it starts at the position the session is at, or at the one its
+ * last read left. Any other read is a positional one, which must not move the
+ * session. Can be called without read_state->lock, at the price of a stale
+ * answer if the session is being read.
+*/
+bool bldms_read_state_at(struct bldms_read_state *read_state, loff_t off){
+
+    return off == READ_ONCE(read_state->off_old)
+     || off == READ_ONCE(read_state->off_stale)
+     || off == bldms_read_state_next_pos(read_state);
 }
 
-ssize_t bldms_read(struct bldms_block_layer *b_layer, char *buf, size_t len,
+/**
+ * Reads the stream of valid data, starting at *off, until the given iterator is
+ * full. The data of each block is copied straight to the iterator, so the memory
+ * needed does not depend on the length of the read.
+ * Must be called with read_state->lock held.
+ *
+ * The traversal of the used list is chunked: every BLDMS_READ_CHUNK_BLOCKS
+ * blocks the resume point is saved in the read state and both the read section
+ * and the read state lock are dropped, so that writers waiting for a grace
+ * period or invalidating the block we are about to read are not held up for
+ * the whole read. Once back, the traversal goes on from the resume point,
+ * which such writers may have moved.
+*/
+ssize_t bldms_read(struct bldms_block_layer *b_layer, struct iov_iter *to,
  loff_t *off, struct bldms_read_state *read_state) {
     
     ssize_t read;
+    size_t len;     // bytes requested by the caller
+    size_t copied;
+    bool faulted;
+    loff_t pos;    // where we are in the stream, *off is moved here at the end
+    loff_t stream_cursor;   // where the data of the current block starts in the stream
+    loff_t b_end;   // where the data of the current block ends in the stream
     loff_t b_start;    // where do we need to start reading data from block
     size_t b_len;   // how much data do we need to read from block
     struct bldms_block *b;  // block buffer
-    char *buf_cursor;    // where are we in the caller's buffer
-    loff_t stream_cursor;   // where are we in the stream
-    loff_t stream_cursor_old;
     /**
-     * true if we read the first block containing valid data with a stream position
-     * after the desired offset.
+     * True if the current block has been taken from the read state instead of
+     * following a next link in this read section. Such a block may have been
+     * invalidated without the read state noticing it.
     */
-    bool first_block_read;
+    bool resumed;
+    int nr_traversed; // blocks traversed in the current read section
+    int seek_index;
+    loff_t seek_cursor;
     int reader_idx;
-    int last_valid_block_i;
+
+    // messages of the log engine are not stored in linked blocks
+    if (b_layer->log.enabled){
+        return bldms_log_read(b_layer, to, off);
+    }
+    len = iov_iter_count(to);
     
     b = bldms_block_alloc(b_layer->block_size);
+    if (!b){
+        return -ENOMEM;
+    }
 
     /**
-     * We can leverage previous state if we are reading from an offset which is equal
-     * or after the saved one.
-     * TODO: implement backward traversing to adjust stream cursors if the new offset
-     * is before the saved one (unlikely case, but can happen indeed)
+     * Invalidations since the last read may have moved back the position where
+     * it stopped, since the data before it has shrunk: if the caller did not
+     * seek, it follows.
+    */
+    if (read_state->off_stale >= 0 && *off == read_state->off_stale){
+        *off = read_state->off_old;
+    }
+    read_state->off_stale = -1;
+
+    /**
+     * Reads going on from where the last one stopped just resume from the read
+     * state. Other ones find the block holding their offset in the stream index,
+     * in O(log n). If the index is not available, we can still leverage the read
+     * state if the offset is after the saved one, else we walk the used list from
+     * its head.
     */
     pr_debug("%s: off: %lld, read_state->off: %lld\n", __func__, *off, read_state->off_old);
-    if(*off < read_state->off_old){
+    if (*off != read_state->off_old
+     && bldms_stream_seek(b_layer, *off, &seek_index, &seek_cursor) == 0){
+        pr_debug("%s: seeking to block %d at %lld\n", __func__, seek_index, seek_cursor);
+        read_state->b_i_start = seek_index;
+        read_state->stream_cursor = seek_cursor;
+        read_state->off_old = *off;
+        bldms_readahead_reset(read_state);
+    }
+    else if(*off < read_state->off_old){
         pr_debug("%s: obsolete read state, reinitializing\n", __func__);
         bldms_read_state_init(b_layer, read_state, read_state->filp);
     }
     stream_cursor = read_state->stream_cursor;
-    stream_cursor_old = read_state->stream_cursor_old;
     b->header.index = read_state->b_i_start;
+    resumed = true;
 
     read = 0;
-    buf_cursor = buf;
-    first_block_read = false;
+    faulted = false;
+    pos = *off;
+    nr_traversed = 0;
 
     bldms_start_read(b_layer, &reader_idx);
 
-    // at worst case we need to read nr_blocks block entries
-    // (all blocks contain valid data)
-    bldms_blocks_foreach_index(b){
+    while (read < len){
 
-        if (read == len) break; // we read all the data requested by the caller
+        if (BLDMS_READ_CHUNK_BLOCKS > 0 && nr_traversed == BLDMS_READ_CHUNK_BLOCKS){
+            /**
+             * The current block has not been read yet, so it is where we resume
+             * from. Invalidating it will move the resume point to its next one.
+            */
+            read_state->b_i_start = b->header.index;
+            read_state->stream_cursor = stream_cursor;
+            read_state->off_old = pos;
+            bldms_end_read(b_layer, reader_idx);
+            mutex_unlock(&read_state->lock);
+
+            cond_resched();
+
+            mutex_lock(&read_state->lock);
+            bldms_start_read(b_layer, &reader_idx);
+            b->header.index = read_state->b_i_start;
+            stream_cursor = read_state->stream_cursor;
+            pos = read_state->off_old;
+            read_state->off_stale = -1;
+            resumed = true;
+            nr_traversed = 0;
+        }
+
+        /**
+         * A resume point which does not hold valid data anymore can not be
+         * trusted to lead back to the used list: we seek from its head instead.
+        */
+        if (b->header.index == -1){
+            if (!resumed) break;
+            b->header.index = READ_ONCE(b_layer->used_blocks.first_bi);
+            stream_cursor = 0;
+            resumed = false;
+            if (b->header.index == -1) break;
+        }
         
         /**
          * Chooses the current block with valid data to work with, locking it from other
@@ -80,7 +601,16 @@ ssize_t bldms_read(struct bldms_block_layer *b_layer, char *buf, size_t len,
             read = -1;
             goto bldms_read_exit;
         }
+        nr_traversed ++;
         pr_debug("%s: b_i: %d\n", __func__, b->header.index);
+        /**
+         * Blocks ahead are requested to the device right away, so that their
+         * fetch overlaps with the copy of the current one. Without readahead,
+         * the next block of the list is.
+        */
+        if (bldms_readahead(b_layer, read_state, b->header.index) < 0){
+            bldms_prefetch_block(b_layer, b->header.next);
+        }
         /**
          * Consider the following race condition:
          * read():                      invalidate_data():
@@ -100,106 +630,67 @@ ssize_t bldms_read(struct bldms_block_layer *b_layer, char *buf, size_t len,
          * data.
          * We do not account for state changes happening after the following check
         */
-        if(!bldms_block_contains_valid_data(b_layer, b)) continue;
-        last_valid_block_i = b->header.index;
+        if(!bldms_block_contains_valid_data(b_layer, b)){
+            if (resumed){
+                b->header.index = -1;
+                continue;
+            }
+            if (b->header.next == -1) break;
+            b->header.index = b->header.next;
+            continue;
+        }
+        resumed = false;
 
         pr_debug("%s: data in block %d is %s\n", __func__, b->header.index,
          (char *)b->data);
 
         /**
-         * Where are we in the stream?
+         * b_data: [--------][------xxxxxxxx][---]
+         *                   ^      ^       ^
+         *       stream_cursor      pos     b_end
          * 
-         * Stream cursor is updated in such a way that it is always pointing the end
-         * of data of a block.
+         * Blocks ending before pos are skipped, otherwise we copy from pos until
+         * the end of the block or until we have read len bytes.
         */
-        stream_cursor_old = stream_cursor;
-        stream_cursor += b->header.data_size;
-        pr_debug("%s: stream_cursor: %lld\n", __func__, stream_cursor);
-        pr_debug("%s: *off is %lld\n", __func__, *off);
-        pr_debug("%s: *off+len is %lld\n", __func__, *off+len);   
-        if (stream_cursor < *off){
-            /**
-             * b_data: [--------][---------------][---]
-             *                  ^                    ^
-             **                 stream_cursor        *off
-             * 
-             * we are before the desired stream offset, we skip this valid block
-            */
-            pr_debug("%s: before desired offset", __func__);
-            continue;
-        }
-        else if(stream_cursor >= *off && !first_block_read){     
-            /**
-             * b_data: [------------------]
-             *               ^            ^
-             *               *off         stream_cursor
-             * 
-             * We have passed the desired offset, but we are still in the block where
-             * such offset falls, so we need to start reading from the offset until
-             * we reach the end of the block.
-            */
-            pr_debug("%s: first block read\n", __func__);
-            first_block_read = true;
-            b_start = b->header.data_size - stream_cursor + *off;
-            b_len = min((size_t)(b->header.data_size - b_start), len);
+        b_end = stream_cursor + b->header.data_size;
+        if (b_end > pos){
+            b_start = max(pos - stream_cursor, (loff_t)0);
+            b_len = min((size_t)(b_end - stream_cursor - b_start), len - read);
             pr_debug("%s: b_start: %lld, b_len: %lu\n", __func__, b_start, b_len);
+            copied = copy_to_iter(b->data + b_start, b_len, to);
+            read += copied;
+            pos = stream_cursor + b_start + copied;
+            // the caller's buffer faulted
+            if (copied < b_len){
+                faulted = true;
+                break;
+            }
+            // len has been reached before the end of the block
+            if (pos < b_end) break;
         }
-        else if(stream_cursor >= *off && first_block_read && stream_cursor < *off + len){
-            /**
-             * b_data: [-------][--][----------------------]
-             *              ^      ^                  ^
-             *              *off   stream_cursor      *off + len
-             * 
-             * We are reading blocks in range between the desired offset and the
-             * requested length. We can read all data from the block. 
-             */
-            pr_debug("%s: in range\n", __func__);
-            b_start = 0;
-            b_len = b->header.data_size;
-        }
-        else if(stream_cursor >= *off && first_block_read && stream_cursor >= *off + len){
-            /**
-             * b_data: [------------------]
-             *               ^            ^
-             *               *off + len   stream_cursor
-             * 
-             * We reached the final block. We start reading data from the start of the
-             * block until we consume all the remaining bytes to read.
-            */
-            pr_debug("%s: last block read\n", __func__);
-            b_start = 0;
-            b_len = *off + len - stream_cursor_old;        
-        }
-        else {
-            // We should never reach this block since all prevoius guards should
-            // exhaust the possible cases
-            pr_err("%s: invalid stream cursor position, this should never happen!\n\
-             b_i: %d, first_block_read: %d, stream_cursor_old: %lld,\
-              stream_cursor: %lld, *off: %lld, len: %lu, *off+len: %lld\n",
-              __func__, b->header.index, first_block_read, stream_cursor_old, stream_cursor, *off,
-               len, *off+len);
-            return -1;
-        }
-
-        // we copy the data in caller's buffer and update cursors
-        memcpy(buf_cursor, b->data + b_start, b_len);
-        pr_debug("%s: data copied is %s\n", __func__, buf_cursor);
-        buf_cursor += b_len;
-        read += b_len;
+
+        /**
+         * The last block is kept as resume point, so that data appended after
+         * it is found by following its next link later.
+        */
+        if (b->header.next == -1) break;
+        stream_cursor = b_end;
+        b->header.index = b->header.next;
     }
     
     /**
     * Publish updates to read state
     */
-    *off += read;
+    *off = pos;
     read_state->stream_cursor = stream_cursor;
-    read_state->stream_cursor_old = stream_cursor_old;
-    read_state->off_old = *off;
-    read_state->b_i_start = last_valid_block_i;
+    read_state->off_old = pos;
+    read_state->b_i_start = b->header.index;
+    if (!read && faulted){
+        read = -EFAULT;
+    }
 
-    pr_debug("%s: saved read state: stream_cursor: %lld, stream_cursor_old: %lld,\
-     off: %lld, b_i_start: %d\n", __func__, read_state->stream_cursor,
-      read_state->stream_cursor_old, read_state->off_old, read_state->b_i_start);
+    pr_debug("%s: saved read state: stream_cursor: %lld, off: %lld, b_i_start: %d\n",
+     __func__, read_state->stream_cursor, read_state->off_old, read_state->b_i_start);
 
 bldms_read_exit:
     pr_debug("%s: read %ld bytes\n", __func__, read);
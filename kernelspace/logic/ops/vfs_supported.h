@@ -11,10 +11,50 @@ struct bldms_read_state{
     struct file *filp;  // file session owning this read state
     struct list_head list_node;
     struct rcu_head rcu;
-    loff_t stream_cursor;   // should be at the end of the block where off is placed
-    loff_t stream_cursor_old; // should be at the start of the block where off is placed
+    int b_i_start; // read loading this state will resume from this block index
+    loff_t stream_cursor;   // where the data of block b_i_start starts in the stream
     loff_t off_old; // where the read storing this state stopped reading the stream
-    int b_i_start; // read loading this state will start from this block index
+    /**
+     * File position the read storing this state left, if invalidations moved
+     * off_old back since then, else -1
+    */
+    loff_t off_stale;
+    /**
+     * Where the last read of the page cache stopped, with the same meaning as
+     * the fields above. The vfs does not tell read() from pread(), so it is
+     * only committed once the file position shows that the vfs moved it there,
+     * and dropped if the file position stayed where the session was.
+    */
+    bool pending;
+    int b_i_next;
+    loff_t stream_cursor_next;
+    loff_t off_next;
+    loff_t off_next_stale;
+    /**
+     * Readahead window: how many blocks the next window prefetches, 0 if
+     * disabled, the last block prefetched, and the block which starts the next
+     * window once read, -1 if none. The advice is the last POSIX_FADV_* given
+     * to the file session.
+    */
+    int ra_size;
+    int ra_last;
+    int ra_mark;
+    int ra_advice;
+    /**
+     * True if reads return records, made of a struct singlefilefs_record and
+     * the data of a block, instead of the bare stream. Framed reads resume from
+     * block b_i_start, whose record has already been returned if b_i_done.
+    */
+    bool framed;
+    bool b_i_done;
+    /**
+     * True if reads at the end of the stream wait for new data. eof_seq is the
+     * data_seq of the block layer when the last read found the end of the
+     * stream, -1 if it returned data, so that poll() tells whether new data
+     * has been appended since then.
+    */
+    bool follow;
+    s64 eof_seq;
     /**
      * Locking at read_state level is useful to synchronize invalidate
      * ops and read op to same file session.
@@ -27,13 +67,25 @@ struct bldms_read_state{
     struct mutex lock;
 };
 
-ssize_t bldms_read(struct bldms_block_layer *b_layer, char *buf, size_t len,
+ssize_t bldms_read(struct bldms_block_layer *b_layer, struct iov_iter *to,
  loff_t *off, struct bldms_read_state *read_state);
 
 struct bldms_read_state *bldms_read_state_alloc(void);
 void bldms_read_state_init( struct bldms_block_layer *b_layer,
  struct bldms_read_state *read_state, struct file *filp);
+ssize_t bldms_read_framed(struct bldms_block_layer *b_layer, struct iov_iter *to,
+ loff_t *off, struct bldms_read_state *read_state);
+void bldms_read_state_set_framed(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, bool framed);
+loff_t bldms_read_state_resume(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, bool nowait);
+int bldms_read_state_save(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, bool nowait);
+void bldms_read_state_confirm(struct bldms_read_state *read_state, loff_t f_pos);
+bool bldms_read_state_at(struct bldms_read_state *read_state, loff_t off);
+void bldms_readahead_reset(struct bldms_read_state *read_state);
+void bldms_read_state_advise(struct bldms_block_layer *b_layer,
+ struct bldms_read_state *read_state, loff_t off, loff_t len, int advice);
 void bldms_read_state_free(struct bldms_read_state *read_state);
-void bldms_read_state_update(struct bldms_read_state read_state);
 
 #endif // VFS_SUPPORTED_H_INCLUDED
\ No newline at end of file
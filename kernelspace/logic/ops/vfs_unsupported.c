@@ -10,6 +10,61 @@
 
 static struct bldms_block_layer *b_layer;
 
+/**
+ * Counterparts of the syscalls for devices formatted for the log engine.
+ * The caller holds a reference to the block layer, taken before finding out
+ * which engine the mounted device uses.
+*/
+static int bldms_log_invalidate_data(int offset){
+
+    return bldms_log_invalidate(b_layer, offset);
+}
+
+static int bldms_log_get_data(int offset, __user char *destination, size_t size){
+
+    int res;
+    u8 *buffer;
+
+    size = min(size, b_layer->block_size);
+    buffer = kmalloc(size, GFP_KERNEL);
+    if (!buffer){
+        res = -ENOMEM;
+        goto bldms_log_get_data_exit;
+    }
+    res = bldms_log_get(b_layer, offset, buffer, size);
+    if (res > 0 && copy_to_user(destination, buffer, res)){
+        pr_err("%s: failed to copy data to user\n", __func__);
+        res = -1;
+    }
+
+bldms_log_get_data_exit:
+    kfree(buffer);
+    return res;
+}
+
+static int bldms_log_put_data(__user char *source, size_t size){
+
+    int res;
+    u8 *buffer;
+
+    buffer = kmalloc(size, GFP_KERNEL);
+    if (!buffer){
+        res = -ENOMEM;
+        goto bldms_log_put_data_exit;
+    }
+    if (copy_from_user(buffer, source, size)){
+        pr_err("%s: failed to copy data from user\n", __func__);
+        res = -1;
+        goto bldms_log_put_data_exit;
+    }
+    res = bldms_log_put(b_layer, buffer, size);
+
+bldms_log_put_data_exit:
+    kfree(buffer);
+    bldms_dirty_throttle(b_layer);
+    return res;
+}
+
 /**
  * int invalidate_data(int offset) used to invalidate data in a block at a given offset;
  * invalidation means that data should logically disappear from the device;
@@ -26,27 +81,29 @@ __SYSCALL_DEFINEx(1, _invalidate_data, int, offset){
     // cannot op on reserved blocks
     bldms_abort_op_if(offset < b_layer->start_data_index, "%s: invalid offset %d\n",
      __func__, offset);
-    
+
     bldms_block_layer_use(b_layer);
-    bldms_start_write(b_layer);
+    if (b_layer->log.enabled){
+        res = bldms_log_invalidate_data(offset);
+        bldms_block_layer_put(b_layer);
+        return res;
+    }
+
+    /**
+     * Invalidations lock only the block and its neighbours, so the ones of non
+     * adjacent blocks run in parallel
+    */
+    bldms_start_write_shared(b_layer);
 
-    // reads block state
     block = bldms_block_alloc(b_layer->block_size);
     block->header.index = offset;
-    res = bldms_move_block(b_layer, block, READ);
-    if (res < 0){
-        pr_err("%s: failed to read block %d from device\n", __func__, offset);
-        invalidate_result = -1;
-        goto invalidate_data_exit;
-    }
-
+    res = bldms_invalidate_block(b_layer, block);
     // can't invalidate a block twice
-    if (!bldms_block_contains_valid_data(b_layer, block)){
+    if (res == -ENODATA){
         pr_err("%s: block %d contains no valid data\n", __func__, offset);
         invalidate_result = -ENODATA;
         goto invalidate_data_exit;
     }
-    res = bldms_invalidate_block(b_layer, block);
     if(res < 0){
         pr_err("%s: failed to invalidate block %d\n", __func__, offset);
         invalidate_result = -1;
@@ -55,7 +112,8 @@ __SYSCALL_DEFINEx(1, _invalidate_data, int, offset){
     
 
 invalidate_data_exit:
-    bldms_end_write(b_layer);
+    bldms_end_write_shared(b_layer);
+    bldms_block_free(block);
     bldms_block_layer_put(b_layer);
     return invalidate_result;
 }
@@ -80,6 +138,11 @@ __SYSCALL_DEFINEx(3, _get_data, int, offset, __user char *, destination, size_t,
     int reader_id;
 
     bldms_block_layer_use(b_layer);
+    if (b_layer->log.enabled){
+        res = bldms_log_get_data(offset, destination, size);
+        bldms_block_layer_put(b_layer);
+        return res;
+    }
     
     buffer = kzalloc(b_layer->block_size, GFP_KERNEL);
 
@@ -104,6 +167,7 @@ __SYSCALL_DEFINEx(3, _get_data, int, offset, __user char *, destination, size_t,
         data_copied = -ENODATA;
         goto get_data_exit;
     }
+    bldms_tier_touch(b_layer, offset);
     
     // copy data from block to destination
     data_copied = bldms_block_memcpy(block, buffer, size,
@@ -125,16 +189,12 @@ get_data_exit:
 }
 
 /**
- *  int put_data(char * source, size_t size) used to put into one free block of the
- * block- device size bytes of the user-space data identified by the source pointer,
- * this operation
- * must be executed all or nothing; the system call returns an integer representing
- * the offset
- * of the device (the block index) where data have been put; if there is currently
- * no room
- * available on the device, the service should simply return the ENOMEM error;
+ * Puts size bytes of user data in a block, returning the block index or an
+ * error. If the device is mounted as a ring buffer and there are no free
+ * blocks, the block holding the oldest valid data is recycled in the same
+ * write section, and its index is stored in *evicted (else -1).
 */
-__SYSCALL_DEFINEx(2, _put_data, __user char *, source, size_t, size){
+static int bldms_put_data(__user char *source, size_t size, int *evicted){
     
     int block_index;
     struct bldms_block *block;
@@ -142,15 +202,28 @@ __SYSCALL_DEFINEx(2, _put_data, __user char *, source, size_t, size){
     int copied_size;
     u8 *buffer;
 
+    *evicted = -1;
     bldms_block_layer_use(b_layer);
+    if (b_layer->log.enabled){
+        res = bldms_log_put_data(source, size);
+        bldms_block_layer_put(b_layer);
+        return res;
+    }
     buffer = kzalloc(size, GFP_KERNEL);
+    block = NULL;
     bldms_start_write(b_layer);
     
     pr_debug("%s: put called", __func__);
     
-    // obtain a free block
-    res = bldms_get_free_block_any_index(b_layer, &block);
-    if (block->header.index < 0){
+    // obtain a free block, or the oldest one if we can overwrite it
+    res = bldms_get_free_block_any_index(b_layer, size, &block);
+    if (res < 0 && b_layer->ring){
+        res = bldms_get_oldest_block(b_layer, &block);
+        if (res == 0){
+            *evicted = block->header.index;
+        }
+    }
+    if (res < 0){
         pr_err("%s: no free blocks available\n", __func__);
         block_index = -ENOMEM;
         goto put_data_exit;
@@ -172,7 +245,12 @@ __SYSCALL_DEFINEx(2, _put_data, __user char *, source, size_t, size){
         block_index = -1;
         goto put_data_exit;
     }
-    res = bldms_validate_block(b_layer, block);
+    if (*evicted == -1){
+        res = bldms_validate_block(b_layer, block);
+    }
+    else {
+        res = bldms_recycle_block(b_layer, block);
+    }
     if (res < 0){
         pr_err("%s: failed to validate block %d\n", __func__, block->header.index);
         block_index = -1;
@@ -182,14 +260,56 @@ __SYSCALL_DEFINEx(2, _put_data, __user char *, source, size_t, size){
     block_index = block->header.index;
     
 put_data_exit:
+    if (block_index < 0){
+        *evicted = -1;
+    }
     kfree(buffer);
     bldms_end_write(b_layer);
+    // a burst of puts is slowed down before the dirty backlog grows too much
+    bldms_dirty_throttle(b_layer);
     bldms_block_layer_put(b_layer);
     bldms_block_free(block);
     pr_debug("%s: put returning %d\n", __func__, block_index);
     return block_index;
 }
 
+/**
+ *  int put_data(char * source, size_t size) used to put into one free block of the
+ * block- device size bytes of the user-space data identified by the source pointer,
+ * this operation
+ * must be executed all or nothing; the system call returns an integer representing
+ * the offset
+ * of the device (the block index) where data have been put; if there is currently
+ * no room
+ * available on the device, the service should simply return the ENOMEM error;
+*/
+__SYSCALL_DEFINEx(2, _put_data, __user char *, source, size_t, size){
+
+    int evicted;
+
+    return bldms_put_data(source, size, &evicted);
+}
+
+/**
+ * int put_data_evict(char * source, size_t size, int * evicted) behaves like
+ * put_data(), additionally storing in evicted the offset of the data which has been
+ * overwritten to make room for the new one, or -1 if no data was overwritten.
+ * Data can be overwritten only if the device is mounted with the ring option.
+*/
+__SYSCALL_DEFINEx(3, _put_data_evict, __user char *, source, size_t, size,
+ __user int *, evicted){
+
+    int block_index;
+    int evicted_index;
+
+    block_index = bldms_put_data(source, size, &evicted_index);
+    if (block_index >= 0 && put_user(evicted_index, evicted)){
+        pr_err("%s: failed to copy evicted offset to user\n", __func__);
+        return -EFAULT;
+    }
+    return block_index;
+}
+
 int bldms_vfs_unsupported_init(struct bldms_block_layer *b_layer_ref){
     
     struct usctm_syscall_tbl *syscall_tbl;
@@ -211,6 +331,9 @@ int bldms_vfs_unsupported_init(struct bldms_block_layer *b_layer_ref){
     usctm_register_syscall(syscall_tbl,
      (unsigned long) usctm_get_syscall_symbol(invalidate_data),
      usctm_get_string_from_symbol(invalidate_data));
+    usctm_register_syscall(syscall_tbl,
+     (unsigned long) usctm_get_syscall_symbol(put_data_evict),
+     usctm_get_string_from_symbol(put_data_evict));
     
     return 0;
 }
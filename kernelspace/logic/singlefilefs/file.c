@@ -9,6 +9,14 @@
 #include <linux/kernel.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/uio.h>
+#include <linux/fadvise.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/bvec.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
 #include "singlefilefs.h"
 #include "block_layer/block_layer.h"
 #include "ops/vfs_supported.h"
@@ -41,6 +49,8 @@ int onefilefs_open(struct inode *inode, struct file *filp){
         mutex_unlock(&b_layer->read_states.w_lock);
         filp->private_data = (void*)read_state;
     }
+    // reads can be asked not to wait, see onefilefs_read_iter()
+    filp->f_mode |= FMODE_NOWAIT;
 
     return 0;
     
@@ -56,7 +66,7 @@ int onefilefs_release(struct inode *inode, struct file *filp){
     struct bldms_read_state *read_state;
 
     b_layer = inode->i_sb->s_fs_info;
-    bldms_if_mounted(b_layer, bldms_block_layer_put(b_layer));
+    bldms_block_layer_put(b_layer);
     pr_debug("%s: release operation called\n",SINGLEFILEFS_NAME);
     
     // free the read state after non-blockingly waiting for a grace period
@@ -72,40 +82,130 @@ int onefilefs_release(struct inode *inode, struct file *filp){
     return 0;
 }
 
-ssize_t onefilefs_read(struct file * filp, char __user * buf, size_t len, loff_t * off) {
+/**
+ * Reads the-file with the given read state, which must be locked. Reads are
+ * served by the page cache of the-file, whose pages are assembled from the
+ * stream by onefilefs_readpage(), so repeated and concurrent reads of the same
+ * data do not go to the blocks again. Devices without a stream index are read
+ * block by block, so that no kernel buffer as large as the read is needed.
+ *
+ * Reads which must not wait are served only by pages already in the page
+ * cache, and only if the stream index is not locked, else they fail with
+ * -EAGAIN leaving the read state and the iterator as they found them, so that
+ * the caller can retry them where waiting is fine.
+*/
+static ssize_t onefilefs_read_session(struct kiocb *iocb, struct iov_iter *to,
+ struct bldms_block_layer *b_layer, struct bldms_read_state *read_state){
+
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    loff_t ki_pos;
+    ssize_t read;
+    loff_t pos;
+
+    if (read_state->framed){
+        return nowait? -EAGAIN : bldms_read_framed(b_layer, to, &iocb->ki_pos,
+         read_state);
+    }
+
+    // the last read was a positional one if the vfs did not move the file position
+    bldms_read_state_confirm(read_state, READ_ONCE(iocb->ki_filp->f_pos));
+
+    ki_pos = iocb->ki_pos;
+    pos = bldms_read_state_resume(b_layer, read_state, iocb->ki_pos, nowait);
+    if (pos == -EAGAIN){
+        return pos;
+    }
+    if (pos < 0){
+        if (nowait){
+            return -EAGAIN;
+        }
+        read = bldms_read(b_layer, to, &iocb->ki_pos, read_state);
+        // messages of the log engine have no blocks to follow, only an offset
+        if (read >= 0 && b_layer->log.enabled){
+            bldms_read_state_save(b_layer, read_state, iocb->ki_pos, false);
+        }
+        return read;
+    }
+
+    // pages missing from the page cache would be read synchronously
+    if (nowait){
+        iocb->ki_flags |= IOCB_NOIO;
+    }
+    iocb->ki_pos = pos;
+    read = generic_file_read_iter(iocb, to);
+    if (read != -EAGAIN
+     && bldms_read_state_save(b_layer, read_state, iocb->ki_pos, nowait) == 0){
+        return read;
+    }
+
+    // the data read, if any, is read again when the read is retried
+    if (read > 0){
+        iov_iter_revert(to, read);
+    }
+    iocb->ki_pos = ki_pos;
+    return -EAGAIN;
+}
 
-    struct inode * the_inode = filp->f_inode;
+/**
+ * Reads the-file at the offset of the caller, with no read state. The page
+ * cache is filled by onefilefs_readpage(), which finds the blocks holding each
+ * page through the stream index, shared by every reader, and messages of the
+ * log engine are found through its own index.
+*/
+static ssize_t onefilefs_read_positional(struct kiocb *iocb, struct iov_iter *to,
+ struct bldms_block_layer *b_layer){
+
+    if (b_layer->log.enabled){
+        if (iocb->ki_flags & IOCB_NOWAIT){
+            return -EAGAIN;
+        }
+        return bldms_log_read(b_layer, to, &iocb->ki_pos);
+    }
+    // pages missing from the page cache would be read synchronously
+    if (iocb->ki_flags & IOCB_NOWAIT){
+        iocb->ki_flags |= IOCB_NOIO;
+    }
+    return generic_file_read_iter(iocb, to);
+}
+
+/**
+ * Reads the-file into the iterator of the caller. Also serves readv(),
+ * preadv2(), and splice() and sendfile() through generic_file_splice_read(),
+ * which hands pages of the page cache to the pipe without copying them.
+ * Sessions following the stream sleep at its end until new data is appended,
+ * unless the file is non blocking.
+ * Reads with IOCB_NOWAIT, such as the ones io_uring submits inline, complete
+ * right away if their data is in the page cache, else they fail with -EAGAIN
+ * instead of waiting for the read state, for blocks or for new data.
+*/
+ssize_t onefilefs_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+
+    struct file *filp = iocb->ki_filp;
+    struct inode * the_inode = file_inode(filp);
     uint64_t file_size = the_inode->i_size;
     struct bldms_block_layer *b_layer = the_inode->i_sb->s_fs_info;
     ssize_t read = 0;
-    char *my_buffer;
     struct bldms_read_state *read_state;
+    s64 seq;
     int reader_idx;
     
-    printk("%s: read operation called with len %ld - and offset %lld (the current file size is %lld)",SINGLEFILEFS_NAME, len, *off, file_size);
+    pr_debug("%s: read operation called with len %ld - and offset %lld (the current file size is %lld)\n",SINGLEFILEFS_NAME, iov_iter_count(to), iocb->ki_pos, file_size);
 
     might_sleep();
-    my_buffer = kzalloc(len * sizeof(char), GFP_KERNEL);
-
-    // lock the file position to avoid threads sharing same fd to concurrently 
-    // corrupt it
-    if (mutex_lock_interruptible(&filp ->f_pos_lock)){
-        pr_err("%s: interrupted while waiting to lock the file position\n",__func__);
-        read = -EINTR;
-        goto onefilefs_read_exit;
-    }
 
     // check if we are reading in range
     // FIXME: use file_size
     ////if (*off >= file_size || *off < 0) return 0;
-    if (*off < 0) {
-        mutex_unlock(&filp ->f_pos_lock);
-        read = -EINVAL;
-        goto onefilefs_read_exit;
+    if (iocb->ki_pos < 0) {
+        return -EINVAL;
     }
-        
+    if (!iov_iter_count(to)){
+        return 0;
+    }
+
     /**
-     * Perform actual read with corresponding read state
+     * Perform actual read with corresponding read state. Threads sharing the
+     * file position are already serialized by the vfs.
     */
     reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
     // read_state pointer should be safe to dereference until we exit from the reader
@@ -114,26 +214,287 @@ ssize_t onefilefs_read(struct file * filp, char __user * buf, size_t len, loff_t
     if (!read_state){
         pr_err("%s: read state is NULL\n",__func__);
         read = -EFAULT;
-        goto onefilefs_read_exit;
+        goto onefilefs_read_iter_exit;
+    }
+    /**
+     * Reads not starting where the session is, such as most pread(), do not go
+     * on from the session cursor and do not move it: they are served without
+     * the session, so that threads sharing the file do not wait for each other.
+     * Positional reads starting there anyway are told apart later, by the file
+     * position the vfs leaves. Framed sessions have no offsets to read at, so
+     * they are always used.
+    */
+    if (!READ_ONCE(read_state->framed)
+     && !bldms_read_state_at(read_state, iocb->ki_pos)){
+        read = onefilefs_read_positional(iocb, to, b_layer);
+        goto onefilefs_read_iter_exit;
+    }
+
+    if (iocb->ki_flags & IOCB_NOWAIT){
+        if (!mutex_trylock(&read_state->lock)){
+            read = -EAGAIN;
+            goto onefilefs_read_iter_exit;
+        }
+    }
+    else {
+        mutex_lock(&read_state->lock);
+    }
+    while (true){
+        // appends from now on are not missed by the read or by the wait
+        seq = atomic64_read(&b_layer->data_seq);
+        read = onefilefs_read_session(iocb, to, b_layer, read_state);
+        WRITE_ONCE(read_state->eof_seq, read? -1 : seq);
+        if (read || !read_state->follow){
+            break;
+        }
+        if (filp->f_flags & O_NONBLOCK || iocb->ki_flags & IOCB_NOWAIT){
+            read = -EAGAIN;
+            break;
+        }
+        /**
+         * The wait can be as long as no one puts data, so it must not hold up
+         * the grace periods of read states: the read state is looked up again
+         * once we are woken.
+        */
+        mutex_unlock(&read_state->lock);
+        srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+        if (wait_event_interruptible(b_layer->data_wait,
+         atomic64_read(&b_layer->data_seq) != seq)){
+            return -ERESTARTSYS;
+        }
+        reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
+        read_state = (struct bldms_read_state*)filp->private_data;
+        if (!read_state){
+            pr_err("%s: read state is NULL\n",__func__);
+            read = -EFAULT;
+            goto onefilefs_read_iter_exit;
+        }
+        mutex_lock(&read_state->lock);
     }
-    mutex_lock(&read_state->lock);
-    read = bldms_read(b_layer, my_buffer, len, off, read_state);
     mutex_unlock(&read_state->lock);
+
+onefilefs_read_iter_exit:
     srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+    return read;
+}
 
-    mutex_unlock(&filp ->f_pos_lock);
+/**
+ * Tells whether a read of the file session would return data, that is unless
+ * its last read found the end of the stream and nothing has been appended since
+ * then.
+*/
+__poll_t onefilefs_poll(struct file *filp, poll_table *wait){
 
-    if (read > 0 && copy_to_user(buf, my_buffer, read)){       
-        pr_err("%s: failed to copy data to user\n",__func__);
-        read = -EFAULT;
-        goto onefilefs_read_exit;   
+    struct bldms_block_layer *b_layer = file_inode(filp)->i_sb->s_fs_info;
+    struct bldms_read_state *read_state;
+    __poll_t mask = 0;
+    int reader_idx;
+
+    poll_wait(filp, &b_layer->data_wait, wait);
+
+    reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
+    read_state = (struct bldms_read_state*)filp->private_data;
+    if (read_state && READ_ONCE(read_state->eof_seq)
+     != atomic64_read(&b_layer->data_seq)){
+        mask = EPOLLIN | EPOLLRDNORM;
     }
+    srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+    return mask;
+}
 
-onefilefs_read_exit:
-    kfree(my_buffer);
-    return read;
+/**
+ * Tunes the readahead of the file session, both the one of the page cache of
+ * the-file and the one of the blocks read by bldms_read().
+*/
+int onefilefs_fadvise(struct file *filp, loff_t offset, loff_t len, int advice){
+
+    struct bldms_block_layer *b_layer = file_inode(filp)->i_sb->s_fs_info;
+    struct bldms_read_state *read_state;
+    int reader_idx;
+    int res;
+
+    switch (advice){
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_SEQUENTIAL:
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_WILLNEED:
+    case POSIX_FADV_NOREUSE:
+    case POSIX_FADV_DONTNEED:
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    // the log engine has no stream index to fill pages of the-file with
+    if (!b_layer->log.enabled){
+        res = generic_fadvise(filp, offset, len, advice);
+        if (res < 0){
+            return res;
+        }
+    }
+
+    reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
+    read_state = (struct bldms_read_state*)filp->private_data;
+    if (read_state){
+        mutex_lock(&read_state->lock);
+        bldms_read_state_advise(b_layer, read_state, offset, len, advice);
+        mutex_unlock(&read_state->lock);
+    }
+    srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+    return 0;
+}
+
+/**
+ * Handles the ioctls of the-file, defined in singlefilefs.h.
+ * SINGLEFILEFS_IOC_SET_FRAMED switches the file session between reads of the
+ * bare stream and reads of records, each one made of a struct
+ * singlefilefs_record and the data of a block. SINGLEFILEFS_IOC_SET_FOLLOW
+ * makes reads of the session at the end of the stream wait for new data.
+*/
+long onefilefs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg){
+
+    struct bldms_block_layer *b_layer = file_inode(filp)->i_sb->s_fs_info;
+    struct bldms_read_state *read_state;
+    int framed, follow;
+    int reader_idx;
+    long res = 0;
+
+    switch (cmd){
+    case SINGLEFILEFS_IOC_SET_FRAMED:
+        if (get_user(framed, (int __user *)arg)){
+            return -EFAULT;
+        }
+        // messages of the log engine are not stored in linked blocks
+        if (b_layer->log.enabled){
+            return -EOPNOTSUPP;
+        }
+        reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
+        read_state = (struct bldms_read_state*)filp->private_data;
+        if (!read_state){
+            res = -EFAULT;
+        }
+        else {
+            mutex_lock(&read_state->lock);
+            bldms_read_state_set_framed(b_layer, read_state, framed != 0);
+            mutex_unlock(&read_state->lock);
+        }
+        srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+        return res;
+    case SINGLEFILEFS_IOC_SET_FOLLOW:
+        if (get_user(follow, (int __user *)arg)){
+            return -EFAULT;
+        }
+        reader_idx = srcu_read_lock(&b_layer->read_states.srcu);
+        read_state = (struct bldms_read_state*)filp->private_data;
+        if (!read_state){
+            res = -EFAULT;
+        }
+        else {
+            mutex_lock(&read_state->lock);
+            read_state->follow = follow != 0;
+            mutex_unlock(&read_state->lock);
+        }
+        srcu_read_unlock(&b_layer->read_states.srcu, reader_idx);
+        return res;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/**
+ * Fills a page of the-file with the stream of valid data, for reads and
+ * mappings of the file. The read goes through a read state of its own, which invalidations do
+ * not track: pages of the stream they move are dropped anyway.
+*/
+int onefilefs_readpage(struct file *filp, struct page *page){
+
+    struct inode *the_inode = page->mapping->host;
+    struct bldms_block_layer *b_layer = the_inode->i_sb->s_fs_info;
+    struct bldms_read_state *read_state;
+    struct bio_vec bvec = {
+        .bv_page = page,
+        .bv_len = PAGE_SIZE,
+        .bv_offset = 0
+    };
+    struct iov_iter to;
+    loff_t off = page_offset(page);
+    ssize_t read;
+    int res = 0;
+
+    read_state = bldms_read_state_alloc();
+    if (!read_state){
+        res = -ENOMEM;
+        goto onefilefs_readpage_exit;
+    }
+    bldms_read_state_init(b_layer, read_state, filp);
+
+    iov_iter_bvec(&to, READ, &bvec, 1, PAGE_SIZE);
+    mutex_lock(&read_state->lock);
+    read = bldms_read(b_layer, &to, &off, read_state);
+    mutex_unlock(&read_state->lock);
+    bldms_read_state_free(read_state);
+    if (read < 0){
+        pr_err("%s: failed to read page %lu\n", __func__, page->index);
+        res = -EIO;
+        goto onefilefs_readpage_exit;
+    }
+
+    // the tail of the last page of the stream
+    zero_user_segment(page, read, PAGE_SIZE);
+    SetPageUptodate(page);
+
+onefilefs_readpage_exit:
+    if (res < 0){
+        SetPageError(page);
+    }
+    unlock_page(page);
+    return res;
+}
+
+/**
+ * Maps the-file read only. Pages are filled on fault by onefilefs_readpage()
+ * and shared by all mappings. The log engine does not keep a stream index, so
+ * its devices can not be mapped.
+*/
+int onefilefs_mmap(struct file *filp, struct vm_area_struct *vma){
+
+    struct bldms_block_layer *b_layer = file_inode(filp)->i_sb->s_fs_info;
+
+    if (b_layer->log.enabled){
+        return -EOPNOTSUPP;
+    }
+    return generic_file_readonly_mmap(filp, vma);
 }
 
+/**
+ * Follows a change of the stream of valid data from the given offset onward:
+ * the size of the-file becomes the one of the stream, and cached pages from the
+ * one holding the offset are unmapped and dropped, so that the next fault on
+ * them reads the stream again.
+*/
+void onefilefs_stream_changed(struct bldms_block_layer *b_layer, loff_t from){
+
+    struct inode *the_inode;
+    loff_t size;
+
+    // nothing to do until the-file has been looked up
+    the_inode = ilookup(b_layer->sb, SINGLEFILEFS_FILE_INODE_NUMBER);
+    if (!the_inode){
+        return;
+    }
+
+    // changes may be reported out of order, the size is read again under the lock
+    inode_lock(the_inode);
+    size = bldms_stream_size(b_layer);
+    if (size >= 0){
+        i_size_write(the_inode, size);
+    }
+    from = round_down(from, PAGE_SIZE);
+    unmap_mapping_range(the_inode->i_mapping, from, 0, 1);
+    truncate_inode_pages_range(the_inode->i_mapping, from, -1);
+    inode_unlock(the_inode);
+    iput(the_inode);
+}
 
 struct dentry *onefilefs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
     
@@ -141,6 +502,7 @@ struct dentry *onefilefs_lookup(struct inode *parent_inode, struct dentry *child
     struct super_block *sb = parent_inode->i_sb;
     struct buffer_head *bh = NULL;
     struct inode *the_inode = NULL;
+    loff_t file_size;
 
     printk("%s: running the lookup inode-function for name %s",SINGLEFILEFS_NAME,child_dentry->d_name.name);
 
@@ -176,6 +538,13 @@ struct dentry *onefilefs_lookup(struct inode *parent_inode, struct dentry *child
 	the_inode->i_size = FS_specific_inode->file_size;
         brelse(bh);
 
+        // the-file is as large as the stream of valid data, which pages map
+        file_size = bldms_stream_size(sb->s_fs_info);
+        if (file_size >= 0){
+            the_inode->i_size = file_size;
+        }
+        the_inode->i_mapping->a_ops = &singlefilefs_aops;
+
         d_add(child_dentry, the_inode);
 	dget(child_dentry);
 
@@ -194,9 +563,19 @@ const struct inode_operations singlefilefs_inode_ops = {
     .lookup = onefilefs_lookup,
 };
 
+const struct address_space_operations singlefilefs_aops = {
+    .readpage = onefilefs_readpage,
+};
+
 const struct file_operations singlefilefs_file_operations = {
     .owner = THIS_MODULE,
-    .read = onefilefs_read,
+    .read_iter = onefilefs_read_iter,
+    .fadvise = onefilefs_fadvise,
+    .mmap = onefilefs_mmap,
+    .splice_read = generic_file_splice_read,
+    .unlocked_ioctl = onefilefs_ioctl,
+    .poll = onefilefs_poll,
+    .compat_ioctl = compat_ptr_ioctl,
     .open = onefilefs_open,
     .release = onefilefs_release,
     .write = onefilefs_write,
@@ -13,10 +13,14 @@
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/wait.h>
+#include <linux/parser.h>
+#include <linux/crc32.h>
+#include <linux/mm.h>
 
 #include "singlefilefs.h"
 #include "config.h"
 #include "block_layer/block_layer.h"
+#include "device/device.h"
 #include "ops/vfs_unsupported.h"
 
 /**
@@ -25,12 +29,6 @@
 */
 static struct bldms_block_layer b_layer;
 
-/**
- * wait queue to put the thread to wait for remaining operations on device
- * before unmounting it
-*/
-DECLARE_WAIT_QUEUE_HEAD(unmount_queue);
-
 static struct super_operations singlefilefs_super_ops = {
 };
 
@@ -38,13 +36,364 @@ static struct super_operations singlefilefs_super_ops = {
 static struct dentry_operations singlefilefs_dentry_ops = {
 };
 
+/**
+ * Mount options, given as a comma separated list:
+ *  - ring: when the device is full, put_data() overwrites the oldest valid data
+ *  - hot=<path>: stores new data in the block device at path, which acts as a
+ *    faster tier in front of the mounted one. Blocks in the hot tier, and the
+ *    links of their neighbours, reach the mounted device only when they are
+ *    demoted, so they are lost if the system stops without unmounting it
+ *  - promote: brings back to the hot tier blocks read with get_data()
+ *  - stripe=<path>: one for each additional device the data blocks are striped
+ *    on, in the order they were formatted
+ *  - mirror=<path>: keeps a copy of the device in the block device at path,
+ *    which also serves reads
+ *  - dirty_budget=<n>: dirty blocks allowed before put_data() is paced, 0 for no
+ *    limit. Defaults to BLDMS_DIRTY_BUDGET
+*/
+enum {
+    Opt_ring,
+    Opt_hot,
+    Opt_promote,
+    Opt_stripe,
+    Opt_mirror,
+    Opt_dirty_budget,
+    Opt_err
+};
+
+static const match_table_t singlefilefs_tokens = {
+    {Opt_ring, "ring"},
+    {Opt_hot, "hot=%s"},
+    {Opt_promote, "promote"},
+    {Opt_stripe, "stripe=%s"},
+    {Opt_mirror, "mirror=%s"},
+    {Opt_dirty_budget, "dirty_budget=%d"},
+    {Opt_err, NULL}
+};
+
+/**
+ * Options which are only needed while mounting
+*/
+struct singlefilefs_mount_opts {
+    char *hot_path;
+    bool promote;
+    char *stripe_paths[BLDMS_MAX_STRIPES];
+    int nr_stripe_paths;
+    char *mirror_path;
+    int dirty_budget;
+};
+
+static void singlefilefs_free_options(struct singlefilefs_mount_opts *opts){
+
+    int i;
+
+    kfree(opts->hot_path);
+    kfree(opts->mirror_path);
+    for (i = 0; i < opts->nr_stripe_paths; i++){
+        kfree(opts->stripe_paths[i]);
+    }
+}
+
+static int singlefilefs_parse_options(char *options,
+ struct bldms_block_layer *b_layer, struct singlefilefs_mount_opts *opts){
+
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    // options are not sticky among mounts
+    b_layer->ring = false;
+    opts->dirty_budget = BLDMS_DIRTY_BUDGET;
+
+    if (!options){
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL){
+        if (!*p){
+            continue;
+        }
+        switch(match_token(p, singlefilefs_tokens, args)){
+            case Opt_ring:
+                b_layer->ring = true;
+                break;
+            case Opt_hot:
+                kfree(opts->hot_path);
+                opts->hot_path = match_strdup(&args[0]);
+                if (!opts->hot_path){
+                    return -ENOMEM;
+                }
+                break;
+            case Opt_promote:
+                opts->promote = true;
+                break;
+            case Opt_stripe:
+                if (opts->nr_stripe_paths == BLDMS_MAX_STRIPES){
+                    pr_err("%s: too many stripe devices\n", __func__);
+                    return -EINVAL;
+                }
+                opts->stripe_paths[opts->nr_stripe_paths] = match_strdup(&args[0]);
+                if (!opts->stripe_paths[opts->nr_stripe_paths]){
+                    return -ENOMEM;
+                }
+                opts->nr_stripe_paths ++;
+                break;
+            case Opt_mirror:
+                kfree(opts->mirror_path);
+                opts->mirror_path = match_strdup(&args[0]);
+                if (!opts->mirror_path){
+                    return -ENOMEM;
+                }
+                break;
+            case Opt_dirty_budget:
+                if (match_int(&args[0], &opts->dirty_budget) || opts->dirty_budget < 0){
+                    pr_err("%s: invalid dirty budget\n", __func__);
+                    return -EINVAL;
+                }
+                break;
+            default:
+                pr_err("%s: unrecognized mount option %s\n", __func__, p);
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Snapshot of the block index.
+ *
+ * On clean unmount the block map and the stream index are written in the
+ * blocks following the data blocks, if the device has room for them, and the
+ * superblock is marked clean. The next mount loads them from there instead of
+ * scanning the header of every block. The mark is dropped as soon as the device
+ * is mounted, so that a device which has not been cleanly unmounted is always
+ * scanned.
+ *
+ * The snapshot is an array of ints: the logical block held by each physical
+ * block, if blocks have ever been relocated, followed by the index and the data
+ * size of each block of the stream, in stream order.
+*/
+
+// region reserved to the snapshot of the mounted device at format time
+static int snapshot_block;
+static int snapshot_nr_blocks;
+
+/**
+ * Marks the snapshot of the device as clean or not, waiting for the superblock
+ * to reach the device.
+ * @return 0 if success, else -1
+*/
+static int singlefilefs_snapshot_mark(struct super_block *sb, bool clean,
+ int nr_entries, int nr_stream, u32 crc){
+
+    struct buffer_head *bh;
+    struct singlefilefs_sb_info *sb_disk;
+    int res;
+
+    bh = sb_bread(sb, SINGLEFILEFS_SB_BLOCK_NUMBER);
+    if (!bh){
+        pr_err("%s: error reading superblock from disk\n",__func__);
+        return -1;
+    }
+    sb_disk = (struct singlefilefs_sb_info *)bh->b_data;
+    sb_disk->snapshot_clean = clean;
+    sb_disk->snapshot_nr_entries = nr_entries;
+    sb_disk->snapshot_nr_stream = nr_stream;
+    sb_disk->snapshot_crc = crc;
+    mark_buffer_dirty(bh);
+    res = sync_dirty_buffer(bh);
+    brelse(bh);
+    return res? -1 : 0;
+}
+
+/**
+ * Checks that the region reserved to the snapshot lies between the data blocks
+ * and the end of the device, so that a corrupted superblock can not make the
+ * snapshot overwrite data.
+ * @return true if the region can hold the snapshot
+*/
+static bool singlefilefs_snapshot_fits(struct super_block *sb, int nr_dev_blocks){
+
+    sector_t dev_blocks;
+
+    if (snapshot_nr_blocks <= 0 || snapshot_block < nr_dev_blocks){
+        return false;
+    }
+    dev_blocks = i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+    return (sector_t)snapshot_block + snapshot_nr_blocks <= dev_blocks;
+}
+
+/**
+ * Loads the block map and the stream index from the snapshot of the last clean
+ * unmount.
+ * @param nr_entries: map entries of the snapshot, 0 if blocks were never
+ * relocated
+ * @param nr_stream: blocks of the stream
+ * @param has_map: false if blocks of the device can not be relocated
+ * @return 0 if success, else -1
+*/
+static int singlefilefs_snapshot_load(struct super_block *sb, int nr_entries,
+ int nr_stream, u32 crc, bool has_map){
+
+    struct buffer_head *bh;
+    int *snapshot;
+    size_t size, copied, len;
+    int nr_snapshot_blocks;
+    int i;
+    int res;
+
+    if (nr_entries != 0 && (!has_map || nr_entries != b_layer.nr_blocks)){
+        pr_err("%s: snapshot has %d map entries, but the device has %d blocks\n",
+         __func__, nr_entries, b_layer.nr_blocks);
+        return -1;
+    }
+    if (nr_stream < 0 || nr_stream > b_layer.nr_blocks){
+        pr_err("%s: snapshot has %d stream entries\n",__func__, nr_stream);
+        return -1;
+    }
+
+    size = (nr_entries + 2 * (size_t)nr_stream) * sizeof(int);
+    snapshot = kvmalloc(max(size, sizeof(int)), GFP_KERNEL);
+    if (!snapshot){
+        pr_err("%s: error allocating snapshot\n",__func__);
+        return -1;
+    }
+    res = -1;
+    nr_snapshot_blocks = DIV_ROUND_UP(size, sb->s_blocksize);
+    if (nr_snapshot_blocks > snapshot_nr_blocks){
+        pr_err("%s: snapshot of %d blocks does not fit the %d blocks reserved to it\n",
+         __func__, nr_snapshot_blocks, snapshot_nr_blocks);
+        goto singlefilefs_snapshot_load_exit;
+    }
+    for (i = 0; i < nr_snapshot_blocks; i++){
+        sb_breadahead(sb, snapshot_block + i);
+    }
+    copied = 0;
+    for (i = 0; i < nr_snapshot_blocks; i++){
+        bh = sb_bread(sb, snapshot_block + i);
+        if (!bh){
+            pr_err("%s: error reading snapshot block %d\n",__func__, snapshot_block + i);
+            goto singlefilefs_snapshot_load_exit;
+        }
+        len = min(size - copied, (size_t)sb->s_blocksize);
+        memcpy((u8 *)snapshot + copied, bh->b_data, len);
+        copied += len;
+        brelse(bh);
+    }
+    if (crc32_le(~0, (u8 *)snapshot, size) != crc){
+        pr_err("%s: snapshot checksum mismatch\n",__func__);
+        goto singlefilefs_snapshot_load_exit;
+    }
+    if (has_map && bldms_block_map_load(&b_layer, nr_entries? snapshot : NULL) < 0){
+        goto singlefilefs_snapshot_load_exit;
+    }
+    res = bldms_stream_import(&b_layer, snapshot + nr_entries, nr_stream);
+    if (res < 0){
+        bldms_block_map_clean(&b_layer);
+    }
+
+singlefilefs_snapshot_load_exit:
+    kvfree(snapshot);
+    return res;
+}
+
+/**
+ * Writes the snapshot of the block map and of the stream index, and marks it
+ * clean once it and the rest of the device are on disk. If the snapshot does
+ * not fit the region reserved to it at format time, as on devices formatted
+ * with no region at all, it stays unclean and the next mount scans it.
+*/
+static void singlefilefs_snapshot_save(struct super_block *sb){
+
+    struct buffer_head *bh;
+    const int *logical;
+    int *stream;
+    u8 *src;
+    size_t map_size, size, copied, len;
+    int nr_entries, nr_stream;
+    int nr_snapshot_blocks;
+    u32 crc;
+    int i;
+
+    nr_stream = bldms_stream_export(&b_layer, &stream);
+    if (nr_stream < 0){
+        pr_err("%s: error exporting stream index, next mount will scan the device\n",
+         __func__);
+        return;
+    }
+    logical = bldms_block_map_snapshot(&b_layer);
+    nr_entries = logical? b_layer.nr_blocks : 0;
+    map_size = nr_entries * sizeof(int);
+    size = map_size + 2 * (size_t)nr_stream * sizeof(int);
+    nr_snapshot_blocks = DIV_ROUND_UP(size, sb->s_blocksize);
+    if (nr_snapshot_blocks > snapshot_nr_blocks){
+        pr_info("%s: snapshot needs %d blocks, but %d are reserved to it, next mount will scan the device\n",
+         __func__, nr_snapshot_blocks, snapshot_nr_blocks);
+        goto singlefilefs_snapshot_save_exit;
+    }
+
+    copied = 0;
+    crc = ~0;
+    for (i = 0; i < nr_snapshot_blocks; i++){
+        bh = sb_getblk(sb, snapshot_block + i);
+        if (!bh){
+            pr_err("%s: error getting snapshot block %d\n",__func__, snapshot_block + i);
+            goto singlefilefs_snapshot_save_exit;
+        }
+        len = min(size - copied, (size_t)sb->s_blocksize);
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        // the block can straddle the map and the stream
+        if (copied < map_size){
+            memcpy(bh->b_data, (const u8 *)logical + copied, min(len, map_size - copied));
+        }
+        if (copied + len > map_size){
+            src = (u8 *)stream + max(copied, map_size) - map_size;
+            memcpy(bh->b_data + max(copied, map_size) - copied, src,
+             copied + len - max(copied, map_size));
+        }
+        crc = crc32_le(crc, (u8 *)bh->b_data, len);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        brelse(bh);
+        copied += len;
+    }
+
+    // the clean mark must not reach the device before what it vouches for
+    if (sync_blockdev(sb->s_bdev)){
+        pr_err("%s: error syncing device\n",__func__);
+        goto singlefilefs_snapshot_save_exit;
+    }
+    if (singlefilefs_snapshot_mark(sb, true, nr_entries, nr_stream, crc) < 0){
+        pr_err("%s: error marking snapshot clean\n",__func__);
+    }
+
+singlefilefs_snapshot_save_exit:
+    kvfree(stream);
+}
+
 int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {   
 
     struct inode *root_inode;
     struct buffer_head *bh;
     struct singlefilefs_sb_info *sb_disk;
     struct timespec64 curr_time;
+    struct singlefilefs_mount_opts opts = {};
     uint64_t magic;
+    int nr_stripes;
+    int nr_dev_blocks;
+    struct singlefilefs_zone_info zones[SINGLEFILEFS_MAX_ZONES];
+    int nr_zones;
+    int zone_dev_blocks;
+    int z;
+    struct bldms_device *ram_dev;
+    bool log_engine;
+    bool snapshot_clean;
+    int snapshot_nr_entries;
+    int snapshot_nr_stream;
+    u32 snapshot_crc;
+    int res;
 
     //Unique identifier of the filesystem
     sb->s_magic = SINGLEFILEFS_MAGIC;
@@ -75,7 +424,29 @@ int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {
         return -EBADF;
     }
 
-    b_layer.nr_blocks = sb_disk->nr_blocks;
+    // devices formatted without striping may hold anything in nr_stripes
+    nr_stripes = sb_disk->nr_stripes;
+    if (nr_stripes < 1 || nr_stripes > BLDMS_MAX_STRIPES){
+        nr_stripes = 1;
+    }
+    log_engine = sb_disk->engine == BLDMS_ENGINE_LOG;
+    if (log_engine){
+        nr_stripes = 1;
+    }
+    // same for zones, which the log engine has no use for
+    nr_zones = sb_disk->nr_zones;
+    if (nr_zones < 0 || nr_zones > SINGLEFILEFS_MAX_ZONES || log_engine){
+        nr_zones = 0;
+    }
+    memcpy(zones, sb_disk->zones, sizeof(zones));
+    snapshot_clean = sb_disk->snapshot_clean == 1;
+    snapshot_nr_entries = sb_disk->snapshot_nr_entries;
+    snapshot_nr_stream = sb_disk->snapshot_nr_stream;
+    snapshot_crc = sb_disk->snapshot_crc;
+    snapshot_block = sb_disk->snapshot_block;
+    snapshot_nr_blocks = sb_disk->snapshot_nr_blocks;
+    nr_dev_blocks = sb_disk->nr_blocks;
+    b_layer.nr_blocks = sb_disk->nr_blocks * nr_stripes;
     b_layer.free_blocks.first_bi = sb_disk->first_free_bi;//2;
     b_layer.free_blocks.last_bi = sb_disk->last_free_bi;//BLDMS_NBLOCKS_DEFAULT - 1;
     b_layer.used_blocks.first_bi = sb_disk->first_used_bi; //-1;
@@ -128,16 +499,174 @@ int singlefilefs_fill_super(struct super_block *sb, void *data, int silent) {
     //unlock the inode to make it usable
     unlock_new_inode(root_inode);
 
+    res = singlefilefs_parse_options(data, &b_layer, &opts);
+    if (res){
+        pr_err("%s: error parsing mount options\n",__func__);
+        singlefilefs_free_options(&opts);
+        return res;
+    }
+
+    // zones of a failed mount may be still there
+    bldms_zones_clear(&b_layer);
+
+    // the log engine manages data blocks on its own
+    if (log_engine){
+        if (b_layer.ring || opts.hot_path || opts.mirror_path || opts.nr_stripe_paths){
+            pr_err("%s: mount options not supported by the log engine\n",__func__);
+            singlefilefs_free_options(&opts);
+            return -EINVAL;
+        }
+        singlefilefs_free_options(&opts);
+        if (bldms_log_load(&b_layer, sb, BLDMS_LOG_SEGMENT_BLOCKS) < 0){
+            pr_err("%s: error loading log\n",__func__);
+            return -EIO;
+        }
+        bldms_dirty_start(&b_layer, opts.dirty_budget, BLDMS_DIRTY_MAX_PAUSE_MS);
+        bldms_block_layer_register_sb(&b_layer, sb);
+        bldms_log_start_cleaner(&b_layer, BLDMS_LOG_CLEAN_INTERVAL_MS,
+         BLDMS_LOG_CLEAN_PCT);
+        return 0;
+    }
+
+    /**
+     * Blocks of zones are smaller than device blocks, so they cannot be relocated,
+     * tiered or mirrored, and the ring could evict blocks too small for new data
+    */
+    if (nr_zones){
+        if (b_layer.ring || opts.hot_path || opts.mirror_path || opts.nr_stripe_paths){
+            pr_err("%s: mount options not supported on devices with zones\n",__func__);
+            singlefilefs_free_options(&opts);
+            return -EINVAL;
+        }
+        zone_dev_blocks = b_layer.start_data_index;
+        for (z = 0; z < nr_zones; z++){
+            res = bldms_zones_add(&b_layer, zones[z].slot_size, zones[z].nr_blocks,
+             zones[z].first_free_bi, zones[z].last_free_bi);
+            if (res < 0){
+                break;
+            }
+            zone_dev_blocks += zones[z].nr_blocks;
+        }
+        if (res < 0 || zone_dev_blocks > nr_dev_blocks){
+            pr_err("%s: zones do not fit in the device\n",__func__);
+            singlefilefs_free_options(&opts);
+            bldms_zones_clear(&b_layer);
+            return -EBADF;
+        }
+        b_layer.nr_blocks = res;
+    }
+
+    if (opts.nr_stripe_paths + 1 != nr_stripes){
+        pr_err("%s: device is striped on %d devices, but %d were given\n",__func__,
+         nr_stripes, opts.nr_stripe_paths + 1);
+        singlefilefs_free_options(&opts);
+        return -EINVAL;
+    }
+    if (bldms_block_locks_alloc(&b_layer) < 0){
+        singlefilefs_free_options(&opts);
+        return -ENOMEM;
+    }
+    // blocks are located through the device of the superblock, even with no scan
+    b_layer.sb = sb;
+    if (bldms_stripes_attach(&b_layer, sb, opts.stripe_paths, opts.nr_stripe_paths,
+     b_layer.nr_blocks / nr_stripes) < 0){
+        pr_err("%s: error opening stripe devices\n",__func__);
+        res = -EINVAL;
+        goto singlefilefs_fill_super_exit;
+    }
+
+    /**
+     * find out where each block is stored in the device, and check the lists of
+     * blocks. Blocks of a striped or zoned device are never relocated, so they
+     * have no map. A cleanly unmounted device is trusted, and its map and its
+     * stream index are loaded from the snapshot.
+    */
+    if (!singlefilefs_snapshot_fits(sb, nr_dev_blocks)){
+        snapshot_nr_blocks = 0;
+    }
+    if (snapshot_clean && singlefilefs_snapshot_load(sb, snapshot_nr_entries,
+     snapshot_nr_stream, snapshot_crc, nr_stripes == 1 && !nr_zones) == 0){
+        pr_info("%s: device was cleanly unmounted, skipping scan\n",__func__);
+    }
+    else {
+        res = bldms_block_scan(&b_layer, sb, BLDMS_SCAN_WORKERS, BLDMS_SCAN_BATCH);
+        if (res < 0){
+            pr_err("%s: error scanning blocks\n",__func__);
+            res = -EIO;
+            goto singlefilefs_fill_super_stripes;
+        }
+    }
+    // from now on the device may change, and the snapshot is stale
+    if (singlefilefs_snapshot_mark(sb, false, 0, 0, 0) < 0){
+        pr_err("%s: error dropping snapshot clean mark\n",__func__);
+        res = -EIO;
+        goto singlefilefs_fill_super_stripes;
+    }
+
+    if (opts.mirror_path){
+        if (nr_stripes > 1 || bldms_mirror_attach(&b_layer, sb, opts.mirror_path) < 0){
+            pr_err("%s: error attaching mirror device\n",__func__);
+            res = -EINVAL;
+            goto singlefilefs_fill_super_stripes;
+        }
+    }
+
+    // new data goes to the hot device, if any
+    if (opts.hot_path){
+        res = bldms_tier_attach(&b_layer, sb, opts.hot_path, opts.promote,
+         BLDMS_TIER_INTERVAL_MS, BLDMS_TIER_BATCH, BLDMS_TIER_HIGH_PCT,
+         BLDMS_TIER_LOW_PCT);
+        if (res < 0){
+            pr_err("%s: error attaching hot device\n",__func__);
+            res = -EINVAL;
+            goto singlefilefs_fill_super_mirror;
+        }
+        pr_warn("%s: data in the hot tier is not durable until it is demoted or the device is unmounted\n",
+         __func__);
+    }
+
+    /**
+     * If we are mounted on a bldms RAM disk, with no other device in the way,
+     * data blocks are accessed straight in its memory instead of going through
+     * the page cache of the block device.
+    */
+    ram_dev = bldms_device_from_bdev(sb->s_bdev);
+    if (ram_dev && !opts.hot_path && !opts.mirror_path && nr_stripes == 1 &&
+     (size_t)ram_dev->data_size >= (size_t)nr_dev_blocks * b_layer.block_size){
+        // cached copies of data blocks would go stale from now on
+        invalidate_bdev(sb->s_bdev);
+        bldms_block_layer_set_direct(&b_layer, ram_dev->data, ram_dev->data_size);
+        pr_info("%s: accessing RAM disk memory directly\n", __func__);
+    }
+    singlefilefs_free_options(&opts);
+
+    bldms_dirty_start(&b_layer, opts.dirty_budget, BLDMS_DIRTY_MAX_PAUSE_MS);
+
     // store ref to sb to make it accessible by non-VFS functions
     bldms_block_layer_register_sb(&b_layer, sb);
 
+    if (nr_stripes == 1 && !nr_zones){
+        bldms_compact_start(&b_layer, BLDMS_COMPACT_INTERVAL_MS, BLDMS_COMPACT_BATCH);
+    }
+
     return 0;
+
+    // devices are released in the reverse order they were attached
+singlefilefs_fill_super_mirror:
+    bldms_mirror_detach(&b_layer);
+singlefilefs_fill_super_stripes:
+    bldms_stripes_detach(&b_layer);
+    bldms_block_map_clean(&b_layer);
+singlefilefs_fill_super_exit:
+    singlefilefs_free_options(&opts);
+    return res;
 }
 
 int singlefilefs_blayer_save_state(struct bldms_block_layer *b_layer){
     
     struct buffer_head *sb_disk_bh;
     struct singlefilefs_sb_info *sb_disk;
+    int z;
 
     might_sleep();
 
@@ -157,6 +686,10 @@ int singlefilefs_blayer_save_state(struct bldms_block_layer *b_layer){
     sb_disk->last_free_bi = b_layer->free_blocks.last_bi;
     sb_disk->first_used_bi = b_layer->used_blocks.first_bi;
     sb_disk->last_used_bi = b_layer->used_blocks.last_bi;
+    for (z = 0; z < b_layer->zones.nr_zones; z++){
+        sb_disk->zones[z].first_free_bi = b_layer->zones.zone[z].free_blocks.first_bi;
+        sb_disk->zones[z].last_free_bi = b_layer->zones.zone[z].free_blocks.last_bi;
+    }
 
     mark_buffer_dirty(sb_disk_bh);
     brelse(sb_disk_bh);
@@ -166,19 +699,41 @@ int singlefilefs_blayer_save_state(struct bldms_block_layer *b_layer){
 
 static void singlefilefs_kill_superblock(struct super_block *s) {
     
+    bool snapshot;
+
     might_sleep();
 
-    spin_lock(&b_layer.mounted_lock);
-    b_layer.mounted = false;
-    spin_unlock(&b_layer.mounted_lock);
+    // only a device which has been mounted with linked blocks has a snapshot
+    snapshot = b_layer.mounted && !b_layer.log.enabled;
 
     // wait for all operations on the device to finish
-    wait_event_interruptible(unmount_queue, atomic_read(&b_layer.users) == 0);
+    bldms_block_layer_unregister_sb(&b_layer);
+
+    bldms_compact_stop(&b_layer);
+    bldms_log_unload(&b_layer);
+    bldms_dirty_stop(&b_layer);
+
+    // every block goes back to the mounted device before its state is saved
+    bldms_tier_detach(&b_layer);
+    bldms_stripes_detach(&b_layer);
 
     // save b_layer state to device
     if(b_layer.save_state(&b_layer)){
         pr_err("%s: error saving block layer state\n",__func__);
     }
+    bldms_mirror_detach(&b_layer);
+    bldms_zones_clear(&b_layer);
+
+    // page cache readers of the device must see what was written directly
+    if (b_layer.direct.data){
+        bldms_block_layer_set_direct(&b_layer, NULL, 0);
+        sync_blockdev(s->s_bdev);
+        invalidate_bdev(s->s_bdev);
+    }
+
+    if (snapshot){
+        singlefilefs_snapshot_save(s);
+    }
     
     bldms_block_layer_clean(&b_layer);
     kill_block_super(s);
@@ -226,8 +781,12 @@ int singlefilefs_init(size_t block_size, int nr_blocks) {
     int ret;
 
     //init block layer
-    bldms_block_layer_init(&b_layer, block_size, nr_blocks);
+    if (bldms_block_layer_init(&b_layer, block_size, nr_blocks) < 0){
+        pr_err("%s: unable to initialize block layer\n", __func__);
+        return -1;
+    }
     b_layer.save_state = singlefilefs_blayer_save_state;
+    b_layer.stream_changed = onefilefs_stream_changed;
 
     // reserves superblock and inode blocks
     bldms_reserve_first_blocks(&b_layer, 2);
@@ -239,6 +798,13 @@ int singlefilefs_init(size_t block_size, int nr_blocks) {
     }
     pr_info("%s: vfs unsupported operations initialized\n", BLDMS_NAME);
 
+    if (bldms_block_layer_stats_init(&b_layer, BLDMS_STATS_DIRNAME) < 0){
+        pr_err("%s: unable to initialize block layer stats\n", __func__);
+        return -1;
+    }
+    pr_info("%s: block layer stats can be found at /sys/kernel/%s\n", BLDMS_NAME,
+     BLDMS_STATS_DIRNAME);
+
 
     //register filesystem
     ret = register_filesystem(&onefilefs_type);
@@ -257,6 +823,9 @@ void singlefilefs_exit(void) {
     bldms_vfs_unsupported_cleanup();
     pr_debug("%s: vfs unsupported operations cleaned up\n", __func__);
 
+    bldms_block_layer_stats_cleanup();
+    bldms_block_layer_exit(&b_layer);
+
     //unregister filesystem
     ret = unregister_filesystem(&onefilefs_type);
 
@@ -94,6 +94,7 @@ static int test_block_move(void){
     }
 
 test_block_move_exit:
+    bldms_block_layer_exit(b_layer);
     kfree(b_layer);
     bldms_block_free(block_expected);
     bldms_block_free(block_actual);
@@ -7,6 +7,7 @@
 
 static const char *syscall_descs_folder = "/sys/kernel/bldms_syscalls";
 static const char *parameters_folder = "/sys/module/bldms/parameters";
+static const char *stats_folder = "/sys/kernel/bldms_stats";
 
 int build_pseudofile_path(const char * prefix, char *pseudofile_name, char *pseudofile_path){
 
@@ -75,6 +76,16 @@ int get_string_param(char *param_name, char *buf){
 
 }
 
+int get_int_stat(char *stat_name){
+
+    char stat_path[256];
+
+    memset(stat_path, 0, 256);
+    build_pseudofile_path(stats_folder, stat_name, stat_path);
+
+    return get_int_from_pseudofile(stat_path);
+}
+
 int call_kernelspace_test(int test_index){
 
     int test_driver_desc = get_syscall_desc("test_driver");
@@ -105,4 +116,11 @@ int invalidate_data(int offset){
     ON_ERROR_LOG_AND_RETURN((invalidate_data_desc < 0), -1, "Failed to get invalidate_data syscall descriptor\n");
     
     return syscall(invalidate_data_desc, offset);
+}
+int put_data_evict(char * source, size_t size, int *evicted){
+
+    int put_data_evict_desc = get_syscall_desc("put_data_evict");
+    ON_ERROR_LOG_AND_RETURN((put_data_evict_desc < 0), -1, "Failed to get put_data_evict syscall descriptor\n");
+    
+    return syscall(put_data_evict_desc, source, size, evicted);
 }
\ No newline at end of file
@@ -7,7 +7,9 @@ int call_kernelspace_test(int test_index);
 int put_data(char * source, size_t size);
 int get_data(int offset, char * destination, size_t size);
 int invalidate_data(int offset);
+int put_data_evict(char * source, size_t size, int *evicted);
 int get_int_param(char *param_name);
 int get_string_param(char *param_name, char *buf);
+int get_int_stat(char *stat_name);
 
 #endif // API_H_INCLUDED
\ No newline at end of file
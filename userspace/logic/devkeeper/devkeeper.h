@@ -4,7 +4,17 @@
 #include <stdint.h>
 
 int devkeeper_mount_device(char *dev_path, char *mount_point);
+int devkeeper_mount_device_opts(char *dev_path, char *mount_point, char *options);
 int devkeeper_format_device(char * dev_path, int block_size, int nr_blocks);
+int devkeeper_format_striped_devices(char **dev_paths, int nr_devs, int block_size,
+ int nr_blocks);
+int devkeeper_format_log_device(char *dev_path, int block_size, int nr_blocks);
+int devkeeper_format_zoned_device(char *dev_path, int block_size,
+ const int *slot_sizes, const int *zone_blocks, int nr_zones);
+int devkeeper_snapshot_blocks(int block_size, int nr_blocks, int nr_devs);
 int devkeeper_create_mountpoint(char *mount_point, unsigned int mode);
+int devkeeper_umount_device(char *mount_point);
+int devkeeper_create_loop_device(char *file_path, int size, char *loop_path);
+int devkeeper_destroy_loop_device(char *loop_path, char *file_path);
 
 #endif // DEVKEEPER_H
\ No newline at end of file
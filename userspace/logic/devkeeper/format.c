@@ -13,80 +13,333 @@
 #define BLDMS_BLOCKSIZE get_int_param("BLDMS_BLOCKSIZE")
 #define BLDMS_NBLOCKS get_int_param("BLDMS_NBLOCKS")
 
+/**
+ * Writes the header of a data block of block_size bytes with invalid data at
+ * the given byte position of the device
+*/
+static int devkeeper_write_invalid_block_at(int fd, int block_size, off_t pos,
+ int index, int prev, int next){
+
+    struct bldms_block b;
+    uint8_t serialized_buffer[block_size];
+    size_t written;
+
+    memset(&b, 0, sizeof(b));
+    memset(serialized_buffer, 0, block_size);
+    b.header.state = BLDMS_BLOCK_STATE_INVALID;
+    b.header.header_size = bldms_calc_block_header_size(b.header);
+    b.header.data_capacity = block_size - b.header.header_size;
+    b.header.index = index;
+    b.header.prev = prev;
+    b.header.next = next;
+    bldms_block_serialize(&b, serialized_buffer);
+
+    lseek(fd, pos, SEEK_SET);
+    written = write(fd, serialized_buffer, b.header.header_size);
+    if(written != b.header.header_size){
+        LOG_ERROR("Expected to write %d bytes of block header %d, but wrote %d\n", 
+            b.header.header_size, index, written);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the header of a data block with invalid data at the given position
+ * of the device
+*/
+static int devkeeper_write_invalid_block(int fd, int block_size, off_t block_nr,
+ int index, int prev, int next){
+
+    return devkeeper_write_invalid_block_at(fd, block_size, block_nr * block_size,
+     index, prev, next);
+}
+
+/**
+ * Returns how many of the last of the nr_blocks blocks of each of nr_devs devices
+ * are reserved to the snapshot that the filesystem writes when it is unmounted:
+ * an int for each block, for the block map, and two for each block of the stream
+ * index. Devices too small to spare them have no snapshot, and are scanned at
+ * every mount.
+*/
+int devkeeper_snapshot_blocks(int block_size, int nr_blocks, int nr_devs){
+
+    int nr_snapshot_blocks;
+
+    nr_snapshot_blocks = (3 * nr_blocks * nr_devs * sizeof(int) + block_size - 1) / block_size;
+    if (nr_blocks - nr_snapshot_blocks <= 2){
+        return 0;
+    }
+    return nr_snapshot_blocks;
+}
+
 /**
  * Formats a device with the singlefilefs filesystem
 */
 int devkeeper_format_device(char * dev_path, int block_size, int nr_blocks){
 
-    int fd;
+    return devkeeper_format_striped_devices(&dev_path, 1, block_size, nr_blocks);
+}
+
+/**
+ * Formats nr_devs devices with the singlefilefs filesystem, striping data blocks
+ * over them. Each device holds nr_blocks blocks, and the superblock is stored
+ * in the first one, which is the device to mount. The others must be given
+ * in the same order with the stripe=<path> mount option.
+ * 
+ * The last devkeeper_snapshot_blocks() blocks of each device hold no data, and
+ * those of the first one are left to the snapshot. Block i of device d has
+ * offset d * nr_blocks + i, where nr_blocks does not count them. Free blocks are
+ * linked alternating devices, so consecutive put_data() calls use them in
+ * round-robin.
+*/
+int devkeeper_format_striped_devices(char **dev_paths, int nr_devs, int block_size,
+ int nr_blocks){
+
+    int fds[nr_devs];
     struct singlefilefs_sb_info sb_info;
     size_t written;
 	struct singlefilefs_inode root_inode;
 	struct singlefilefs_inode file_inode;
-    struct bldms_block b;
-    uint8_t serialized_buffer[block_size];
-    
-    b.data = malloc(1);
-    
+    int nr_data_blocks;
+    int nr_snapshot_blocks;
+    int prev, index, next;
+    int d, i;
+    int res;
+
+    ON_ERROR_LOG_AND_RETURN((nr_devs < 1), -1, "At least one device is needed\n");
+
+    nr_snapshot_blocks = devkeeper_snapshot_blocks(block_size, nr_blocks, nr_devs);
+    nr_blocks -= nr_snapshot_blocks;
+    nr_data_blocks = (nr_blocks - 2) * nr_devs;
+    memset(&sb_info, 0, sizeof(sb_info));
     sb_info.magic = SINGLEFILEFS_MAGIC;
     sb_info.nr_blocks = nr_blocks;
+    sb_info.snapshot_block = nr_blocks;
+    sb_info.snapshot_nr_blocks = nr_snapshot_blocks;
     sb_info.first_free_bi = 2;
-    sb_info.last_free_bi = nr_blocks - 1;
+    sb_info.last_free_bi = (nr_devs - 1) * nr_blocks + nr_blocks - 1;
     sb_info.first_used_bi = -1;
     sb_info.last_used_bi = -1;
+    sb_info.nr_stripes = nr_devs;
     
-    // prepare disk
-    fd = open(dev_path, O_TRUNC | O_WRONLY);
-    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
-    lseek(fd, SINGLEFILEFS_SB_BLOCK_NUMBER * block_size, SEEK_SET);
+    // prepare disks
+    for (d = 0; d < nr_devs; d++){
+        fds[d] = open(dev_paths[d], O_TRUNC | O_WRONLY);
+        if (fds[d] < 0){
+            LOG_ERROR("Failed to open device at %s\n", dev_paths[d]);
+            nr_devs = d;
+            res = -1;
+            goto devkeeper_format_exit;
+        }
+    }
+    lseek(fds[0], SINGLEFILEFS_SB_BLOCK_NUMBER * block_size, SEEK_SET);
 
     // write serialized sb_info to disk
-    written = write(fd, &sb_info, sizeof(sb_info));
+    written = write(fds[0], &sb_info, sizeof(sb_info));
     if(written != sizeof(sb_info)){
-        LOG_ERROR("Failed to write superblock to device %s\n", dev_path);
-        close(fd);
-        return -1;
+        LOG_ERROR("Failed to write superblock to device %s\n", dev_paths[0]);
+        res = -1;
+        goto devkeeper_format_exit;
     }
     logMsg(LOG_TAG_D, "Super block written succesfully\n");
 
     // write file inode
-    lseek(fd, SINGLEFILEFS_FILE_INODE_BLOCK * block_size, SEEK_SET);
+    lseek(fds[0], SINGLEFILEFS_FILE_INODE_BLOCK * block_size, SEEK_SET);
 	file_inode.mode = S_IFREG;
 	file_inode.inode_no = SINGLEFILEFS_FILE_INODE_NUMBER;
-	file_inode.file_size = block_size * nr_blocks; // make room for all the blocks
-	written = write(fd, (char *)&file_inode, sizeof(file_inode));
+	file_inode.file_size = block_size * nr_blocks * nr_devs; // make room for all the blocks
+	written = write(fds[0], (char *)&file_inode, sizeof(file_inode));
 
 	if (written != sizeof(root_inode)) {
 		LOG_ERROR("The file inode was not written properly.\n");
-		close(fd);
-		return -1;
+        res = -1;
+        goto devkeeper_format_exit;
 	}
 
+    // reserved blocks of the other devices hold no data
+    res = 0;
+    for (d = 1; d < nr_devs && !res; d++){
+        for (i = 0; i < 2 && !res; i++){
+            res = devkeeper_write_invalid_block(fds[d], block_size, i,
+             d * nr_blocks + i, -1, -1);
+        }
+    }
+
     // initialize each data block as an invalid one
+    for (i = 0; i < nr_data_blocks && !res; i++){
+        d = i % nr_devs;
+        index = d * nr_blocks + 2 + i / nr_devs;
+        prev = (i == 0)? -1 : ((i - 1) % nr_devs) * nr_blocks + 2 + (i - 1) / nr_devs;
+        next = (i == nr_data_blocks - 1)? -1 :
+         ((i + 1) % nr_devs) * nr_blocks + 2 + (i + 1) / nr_devs;
+        res = devkeeper_write_invalid_block(fds[d], block_size, index % nr_blocks,
+         index, prev, next);
+    }
+
+devkeeper_format_exit:
+    for (d = 0; d < nr_devs; d++){
+        close(fds[d]);
+    }
+    return res;
+
+}
 
+/**
+ * Formats a device with the singlefilefs filesystem, storing messages with the
+ * log-structured engine. Data blocks are zeroed, so that the log is empty
+ * whatever the size of its segments. The log is rebuilt from its segments at
+ * every mount, so no room is reserved to the snapshot.
+*/
+int devkeeper_format_log_device(char *dev_path, int block_size, int nr_blocks){
+
+    int fd;
+    struct singlefilefs_sb_info sb_info;
+	struct singlefilefs_inode file_inode;
+    uint8_t zeroes[block_size];
+    size_t written;
+    int res;
+
+    memset(&sb_info, 0, sizeof(sb_info));
+    sb_info.magic = SINGLEFILEFS_MAGIC;
+    sb_info.nr_blocks = nr_blocks;
+    sb_info.first_free_bi = -1;
+    sb_info.last_free_bi = -1;
+    sb_info.first_used_bi = -1;
+    sb_info.last_used_bi = -1;
+    sb_info.nr_stripes = 1;
+    sb_info.engine = BLDMS_ENGINE_LOG;
+
+    fd = open(dev_path, O_TRUNC | O_WRONLY);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
+    res = -1;
+
+    lseek(fd, SINGLEFILEFS_SB_BLOCK_NUMBER * block_size, SEEK_SET);
+    written = write(fd, &sb_info, sizeof(sb_info));
+    if(written != sizeof(sb_info)){
+        LOG_ERROR("Failed to write superblock to device %s\n", dev_path);
+        goto devkeeper_format_log_device_exit;
+    }
+
+    lseek(fd, SINGLEFILEFS_FILE_INODE_BLOCK * block_size, SEEK_SET);
+    memset(&file_inode, 0, sizeof(file_inode));
+	file_inode.mode = S_IFREG;
+	file_inode.inode_no = SINGLEFILEFS_FILE_INODE_NUMBER;
+	file_inode.file_size = block_size * nr_blocks;
+	written = write(fd, (char *)&file_inode, sizeof(file_inode));
+	if (written != sizeof(file_inode)) {
+		LOG_ERROR("The file inode was not written properly.\n");
+        goto devkeeper_format_log_device_exit;
+	}
+
+    memset(zeroes, 0, block_size);
+    lseek(fd, 2 * block_size, SEEK_SET);
     for (int i = 2; i < nr_blocks; i++){
-        lseek(fd, block_size - written, SEEK_CUR);
-        memset(&b, 0, sizeof(b));
-        memset(serialized_buffer, 0, block_size);
-        b.header.state = BLDMS_BLOCK_STATE_INVALID;
-        b.header.header_size = bldms_calc_block_header_size(b.header);
-        b.header.data_capacity = block_size - b.header.header_size;
-        b.header.index = i;
-        b.header.prev = (i == 2)? -1 : i - 1;
-        b.header.next = (i == nr_blocks - 1)? -1 : i + 1;
-        bldms_block_serialize(&b, serialized_buffer);
-        written = write(fd, serialized_buffer, b.header.header_size);
-        if(written != b.header.header_size){
-            LOG_ERROR("Expected to write %d bytes of block header %d, but wrote %d\n", 
-                b.header.header_size, i, written);
-            close(fd);
-            return -1;
+        written = write(fd, zeroes, block_size);
+        if (written != (size_t)block_size){
+            LOG_ERROR("Failed to zero block %d\n", i);
+            goto devkeeper_format_log_device_exit;
         }
+    }
+    res = 0;
+
+devkeeper_format_log_device_exit:
+    close(fd);
+    return res;
+}
+
+/**
+ * Formats a device with the singlefilefs filesystem, carving its data blocks
+ * into zones of blocks of different sizes. Zone z is made of zone_blocks[z]
+ * device blocks, each one holding block_size / slot_sizes[z] data blocks;
+ * slot sizes must be powers of 2 not larger than block_size. Zones follow
+ * each other in the given order, and so do the offsets of their blocks.
+ * Each zone has its own free list, so that put_data() can store a message in
+ * the zone with the smallest blocks that fit it. The snapshot, which has no
+ * block map, takes the device blocks that follow the last zone, so the device
+ * must be large enough to hold them too.
+*/
+int devkeeper_format_zoned_device(char *dev_path, int block_size,
+ const int *slot_sizes, const int *zone_blocks, int nr_zones){
+
+    int fd;
+    struct singlefilefs_sb_info sb_info;
+	struct singlefilefs_inode file_inode;
+    size_t written;
+    off_t pos;
+    int first_index, nr_slots, nr_blocks;
+    int z, i;
+    int res;
 
+    ON_ERROR_LOG_AND_RETURN((nr_zones < 1 || nr_zones > SINGLEFILEFS_MAX_ZONES), -1,
+     "Between 1 and %d zones are supported\n", SINGLEFILEFS_MAX_ZONES);
+    for (z = 0; z < nr_zones; z++){
+        ON_ERROR_LOG_AND_RETURN((slot_sizes[z] <= 0 || slot_sizes[z] > block_size
+         || (slot_sizes[z] & (slot_sizes[z] - 1)) || zone_blocks[z] <= 0), -1,
+         "Invalid zone of %d blocks of %d bytes\n", zone_blocks[z], slot_sizes[z]);
+    }
+
+    memset(&sb_info, 0, sizeof(sb_info));
+    sb_info.magic = SINGLEFILEFS_MAGIC;
+    sb_info.first_free_bi = -1;
+    sb_info.last_free_bi = -1;
+    sb_info.first_used_bi = -1;
+    sb_info.last_used_bi = -1;
+    sb_info.nr_stripes = 1;
+    sb_info.nr_zones = nr_zones;
+    nr_blocks = 2;
+    first_index = 2;
+    for (z = 0; z < nr_zones; z++){
+        nr_slots = zone_blocks[z] * (block_size / slot_sizes[z]);
+        sb_info.zones[z].slot_size = slot_sizes[z];
+        sb_info.zones[z].nr_blocks = zone_blocks[z];
+        sb_info.zones[z].first_free_bi = first_index;
+        sb_info.zones[z].last_free_bi = first_index + nr_slots - 1;
+        first_index += nr_slots;
+        nr_blocks += zone_blocks[z];
     }
-    free(b.data);
+    sb_info.nr_blocks = nr_blocks;
+    sb_info.snapshot_block = nr_blocks;
+    sb_info.snapshot_nr_blocks = (2 * (first_index - 2) * sizeof(int) + block_size - 1)
+     / block_size;
 
+    fd = open(dev_path, O_TRUNC | O_WRONLY);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
+    res = -1;
 
-    return 0;
+    lseek(fd, SINGLEFILEFS_SB_BLOCK_NUMBER * block_size, SEEK_SET);
+    written = write(fd, &sb_info, sizeof(sb_info));
+    if(written != sizeof(sb_info)){
+        LOG_ERROR("Failed to write superblock to device %s\n", dev_path);
+        goto devkeeper_format_zoned_device_exit;
+    }
+
+    lseek(fd, SINGLEFILEFS_FILE_INODE_BLOCK * block_size, SEEK_SET);
+    memset(&file_inode, 0, sizeof(file_inode));
+	file_inode.mode = S_IFREG;
+	file_inode.inode_no = SINGLEFILEFS_FILE_INODE_NUMBER;
+	file_inode.file_size = block_size * nr_blocks;
+	written = write(fd, (char *)&file_inode, sizeof(file_inode));
+	if (written != sizeof(file_inode)) {
+		LOG_ERROR("The file inode was not written properly.\n");
+        goto devkeeper_format_zoned_device_exit;
+	}
+
+    // blocks of each zone are linked in their own free list, in offset order
+    pos = 2 * block_size;
+    res = 0;
+    for (z = 0; z < nr_zones && !res; z++){
+        first_index = sb_info.zones[z].first_free_bi;
+        nr_slots = sb_info.zones[z].last_free_bi - first_index + 1;
+        for (i = 0; i < nr_slots && !res; i++){
+            res = devkeeper_write_invalid_block_at(fd, slot_sizes[z], pos,
+             first_index + i, (i == 0)? -1 : first_index + i - 1,
+             (i == nr_slots - 1)? -1 : first_index + i + 1);
+            pos += slot_sizes[z];
+        }
+    }
 
-}
\ No newline at end of file
+devkeeper_format_zoned_device_exit:
+    close(fd);
+    return res;
+}
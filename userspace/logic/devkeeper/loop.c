@@ -0,0 +1,77 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+
+#include "logger/logger.h"
+#include "devkeeper.h"
+
+/**
+ * Creates a file of size bytes at file_path and attaches it to a free loop
+ * device, so that it can be used as an additional device of singlefilefs
+ * (hot tier, mirror or stripe). The path of the loop device is written in
+ * loop_path, which must hold at least 32 chars.
+*/
+int devkeeper_create_loop_device(char *file_path, int size, char *loop_path){
+
+    int file_fd, ctl_fd, loop_fd;
+    int loop_nr;
+    int res;
+
+    file_fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(file_fd < 0, -1, "Failed to create %s", file_path);
+    res = -1;
+    if (ftruncate(file_fd, size) < 0){
+        LOG_ERRNO(1, "Failed to resize %s", file_path);
+        goto devkeeper_create_loop_device_exit;
+    }
+
+    ctl_fd = open("/dev/loop-control", O_RDWR);
+    if (ctl_fd < 0){
+        LOG_ERRNO(1, "Failed to open loop control");
+        goto devkeeper_create_loop_device_exit;
+    }
+    loop_nr = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+    close(ctl_fd);
+    if (loop_nr < 0){
+        LOG_ERRNO(1, "No free loop device");
+        goto devkeeper_create_loop_device_exit;
+    }
+
+    sprintf(loop_path, "/dev/loop%d", loop_nr);
+    loop_fd = open(loop_path, O_RDWR);
+    if (loop_fd < 0){
+        LOG_ERRNO(1, "Failed to open %s", loop_path);
+        goto devkeeper_create_loop_device_exit;
+    }
+    if (ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0){
+        LOG_ERRNO(1, "Failed to attach %s to %s", file_path, loop_path);
+    }
+    else {
+        res = 0;
+    }
+    close(loop_fd);
+
+devkeeper_create_loop_device_exit:
+    close(file_fd);
+    return res;
+}
+
+/**
+ * Detaches the loop device at loop_path from its file, and removes the file
+*/
+int devkeeper_destroy_loop_device(char *loop_path, char *file_path){
+
+    int loop_fd;
+    int res;
+
+    loop_fd = open(loop_path, O_RDWR);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(loop_fd < 0, -1, "Failed to open %s", loop_path);
+    res = ioctl(loop_fd, LOOP_CLR_FD, 0);
+    close(loop_fd);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(res < 0, -1, "Failed to detach %s", loop_path);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(unlink(file_path) < 0, -1, "Failed to remove %s", file_path);
+
+    return 0;
+}
@@ -10,16 +10,37 @@
 */
 int devkeeper_mount_device(char *dev_path, char *mount_point){
 
+    return devkeeper_mount_device_opts(dev_path, mount_point, NULL);
+}
+
+/**
+ * Mounts a device containing the singlefilefs filesystem with the given comma
+ * separated singlefilefs mount options (ex: "ring")
+*/
+int devkeeper_mount_device_opts(char *dev_path, char *mount_point, char *options){
+
     unsigned long mount_flags;
 
     mount_flags = MS_NODEV | MS_NOEXEC | MS_NOSUID;    
     ON_ERROR_LOG_ERRNO_AND_RETURN(mount(dev_path, mount_point, SINGLEFILEFS_FS_NAME,
-     mount_flags, NULL), -1, "Failed to mount device at %s:", dev_path);
+     mount_flags, options), -1, "Failed to mount device at %s:", dev_path);
     
     return 0;
 
 }
 
+/**
+ * Unmounts the singlefilefs filesystem mounted at mount_point, which writes the
+ * snapshot that lets the next mount skip the scan of the device
+*/
+int devkeeper_umount_device(char *mount_point){
+
+    ON_ERROR_LOG_ERRNO_AND_RETURN(umount(mount_point), -1,
+     "Failed to unmount %s:", mount_point);
+
+    return 0;
+}
+
 /**
  * Creates a dir at mount_point with the permissions provided that can be used as
  * a mount point with devkeeper_mount_device()
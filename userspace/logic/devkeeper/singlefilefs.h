@@ -9,6 +9,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
 
 #define SINGLEFILEFS_NAME "SINGLE FILE FS"
 
@@ -26,6 +27,8 @@
 #define SINGLEFILEFS_UNIQUE_FILE_NAME "the-file"
 #define SINGLEFILEFS_FS_NAME "singlefilefs"
 
+#define BLDMS_ENGINE_LOG 0x4c4f47 // keep in synch with kernelspace block_layer.h
+
 //inode definition
 struct singlefilefs_inode {
 	mode_t mode;//not exploited
@@ -45,6 +48,27 @@ struct singlefilefs_dir_record {
 };
 
 
+//ioctls of the-file
+#define SINGLEFILEFS_IOC_MAGIC 'b'
+#define SINGLEFILEFS_IOC_SET_FRAMED _IOW(SINGLEFILEFS_IOC_MAGIC, 1, int)	// 1 to read records, 0 to read the bare stream
+#define SINGLEFILEFS_IOC_SET_FOLLOW _IOW(SINGLEFILEFS_IOC_MAGIC, 2, int)	// 1 to wait for new data at the end of the stream
+
+//header of each record read from the-file in framed mode, followed by its data
+struct singlefilefs_record {
+	int32_t index;	// block the data is stored in, the offset of get_data() and invalidate_data()
+	uint32_t size;	// bytes of data following the header
+};
+
+#define SINGLEFILEFS_MAX_ZONES 4
+
+//size-class zone definition on disk
+struct singlefilefs_zone_info {
+	int slot_size;	// bytes of each data block of the zone, header included
+	int nr_blocks;	// device blocks the zone is made of
+	int first_free_bi;
+	int last_free_bi;
+};
+
 //superblock definition on disk
 struct singlefilefs_sb_info {
 	uint64_t magic;	// magic number to recognize the fs
@@ -53,6 +77,16 @@ struct singlefilefs_sb_info {
 	int last_free_bi;
 	int first_used_bi;
 	int last_used_bi;
+	int nr_stripes;	// devices the data blocks are striped on, each with nr_blocks blocks
+	int engine;	// BLDMS_ENGINE_LOG if data blocks hold a log, else they are linked blocks
+	int nr_zones;	// zones the data blocks are carved into, 0 if data blocks have the device block size
+	struct singlefilefs_zone_info zones[SINGLEFILEFS_MAX_ZONES];
+	int snapshot_clean;	// 1 if the device was cleanly unmounted, so its snapshot can be trusted
+	int snapshot_nr_entries;	// block map entries of the snapshot, 0 if blocks were never relocated
+	int snapshot_nr_stream;	// blocks of the stream index in the snapshot, following the block map entries
+	uint32_t snapshot_crc;	// crc32 of the snapshot entries
+	int snapshot_block;	// first block of the region reserved to the snapshot in the first device, after the data blocks
+	int snapshot_nr_blocks;	// blocks reserved to the snapshot, 0 if the device has no room for it
 	
 };
 
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "test_suites.h"
+#include "logger/logger.h"
+#include "api/api.h"
+#include "devkeeper/devkeeper.h"
+#include "../../kernelspace/logic/config.h"
+
+/**
+ * Tests of features which use more than one device. Additional devices are
+ * loop devices backed by files in the current dir.
+*/
+
+static const char *expected = "Hello World!";
+static char actual[256];
+
+#define TEST_HOT_SLOTS 8
+#define TEST_HOT_HIGH_WM (TEST_HOT_SLOTS * BLDMS_TIER_HIGH_PCT_DEFAULT / 100)
+
+/**
+ * Waits for the migration worker to bring the hot tier back under its high
+ * watermark, so that new blocks find a free slot
+*/
+static int wait_hot_tier_drained(){
+
+    int i;
+
+    for (i = 0; i < 20 && get_int_stat("tier_hot_used") > TEST_HOT_HIGH_WM; i++){
+        usleep(BLDMS_TIER_INTERVAL_MS_DEFAULT * 1000);
+    }
+    ON_ERROR_LOG_AND_RETURN((get_int_stat("tier_hot_used") > TEST_HOT_HIGH_WM), -1,
+     "The hot tier was not drained\n");
+    return 0;
+}
+
+int test_tier(){
+
+    char dev_path[64];
+    char hot_path[32];
+    char options[64];
+    char *hot_file = "./test_hot.img";
+    char *mount_point = "./test_mount_tier";
+    char BLDMS_DEV_NAME[32];
+    int nr_cycles;
+    int block_index;
+    int hot_used, demoted, promoted;
+    int res;
+    int i;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    memset(actual, 0, 256);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_loop_device(hot_file,
+     TEST_HOT_SLOTS * BLDMS_BLOCKSIZE_DEFAULT, hot_path), -1, "Failed to create hot device\n");
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1,
+     "Failed to create mount point at %s\n", mount_point);
+    sprintf(options, "hot=%s,promote", hot_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device_opts(dev_path, mount_point, options), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    /**
+     * Put and invalidate well past the room of the admission queue, twice the
+     * slots: every new block must still be admitted to the hot tier, so that
+     * each one is either still there or has been demoted
+    */
+    demoted = get_int_stat("tier_demoted");
+    nr_cycles = 4 * 2 * TEST_HOT_SLOTS;
+    for (i = 0; i < nr_cycles; i++){
+        block_index = put_data((char *)expected, strlen(expected));
+        if (block_index < 0 || invalidate_data(block_index) < 0
+         || wait_hot_tier_drained() < 0){
+            LOG_ERROR("Failed put/invalidate cycle %d\n", i);
+            goto test_tier_exit;
+        }
+    }
+    hot_used = get_int_stat("tier_hot_used");
+    demoted = get_int_stat("tier_demoted") - demoted;
+    if (hot_used + demoted != nr_cycles){
+        LOG_ERROR("Expected %d admissions, Actual: %d hot + %d demoted\n", nr_cycles,
+         hot_used, demoted);
+        goto test_tier_exit;
+    }
+
+    // unmounting demotes every block, and a read of a cold block promotes it
+    block_index = put_data((char *)expected, strlen(expected));
+    if (block_index < 0 || devkeeper_umount_device(mount_point) < 0
+     || devkeeper_mount_device_opts(dev_path, mount_point, options) < 0){
+        LOG_ERROR("Failed to put data and mount %s again\n", dev_path);
+        goto test_tier_exit;
+    }
+    promoted = get_int_stat("tier_promoted");
+    if (get_data(block_index, actual, strlen(expected)) != (int)strlen(expected)
+     || strcmp(expected, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", expected, actual);
+        goto test_tier_exit;
+    }
+    usleep(2 * BLDMS_TIER_INTERVAL_MS_DEFAULT * 1000);
+    if (get_int_stat("tier_promoted") - promoted != 1 || get_int_stat("tier_hot_used") != 1){
+        LOG_ERROR("Expected the block read to be promoted to the hot tier\n");
+        goto test_tier_exit;
+    }
+    res = 0;
+
+test_tier_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_destroy_loop_device(hot_path, hot_file), -1,
+     "Failed to destroy hot device\n");
+    return res;
+}
+
+int test_stripes(){
+
+    char dev_path[64];
+    char stripe_path[32];
+    char options[64];
+    char *dev_paths[2];
+    char *stripe_file = "./test_stripe.img";
+    char *mount_point = "./test_mount_stripes";
+    char BLDMS_DEV_NAME[32];
+    int nr_dev_blocks;
+    int indexes[4];
+    int res;
+    int i;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_loop_device(stripe_file,
+     BLDMS_NBLOCKS_DEFAULT * BLDMS_BLOCKSIZE_DEFAULT, stripe_path), -1,
+     "Failed to create stripe device\n");
+    dev_paths[0] = dev_path;
+    dev_paths[1] = stripe_path;
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_striped_devices(dev_paths, 2,
+     BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1, "Failed to format striped devices\n");
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1,
+     "Failed to create mount point at %s\n", mount_point);
+    sprintf(options, "stripe=%s", stripe_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device_opts(dev_path, mount_point, options), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // consecutive blocks alternate devices, and block i of device d has offset d * nr_blocks + i
+    nr_dev_blocks = BLDMS_NBLOCKS_DEFAULT - devkeeper_snapshot_blocks(BLDMS_BLOCKSIZE_DEFAULT,
+     BLDMS_NBLOCKS_DEFAULT, 2);
+    for (i = 0; i < 4; i++){
+        indexes[i] = put_data((char *)expected, strlen(expected));
+        if (indexes[i] < 0){
+            LOG_ERROR("Failed to put data\n");
+            goto test_stripes_exit;
+        }
+        if ((indexes[i] >= nr_dev_blocks) != (i % 2)){
+            LOG_ERROR("Expected block %d on device %d, Actual: offset %d\n", i, i % 2,
+             indexes[i]);
+            goto test_stripes_exit;
+        }
+    }
+    for (i = 0; i < 4; i++){
+        memset(actual, 0, 256);
+        if (get_data(indexes[i], actual, strlen(expected)) != (int)strlen(expected)
+         || strcmp(expected, actual) != 0){
+            LOG_ERROR("Block %d, Expected: %s, Actual: %s\n", indexes[i], expected, actual);
+            goto test_stripes_exit;
+        }
+    }
+    res = 0;
+
+test_stripes_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_destroy_loop_device(stripe_path, stripe_file), -1,
+     "Failed to destroy stripe device\n");
+    return res;
+}
+
+int test_mirror(){
+
+    char dev_path[64];
+    char mirror_path[32];
+    char options[64];
+    char *mirror_file = "./test_mirror.img";
+    char *mount_point = "./test_mount_mirror";
+    char BLDMS_DEV_NAME[32];
+    int block_index;
+    int res;
+    int i;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_loop_device(mirror_file,
+     BLDMS_NBLOCKS_DEFAULT * BLDMS_BLOCKSIZE_DEFAULT, mirror_path), -1,
+     "Failed to create mirror device\n");
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1,
+     "Failed to create mount point at %s\n", mount_point);
+    sprintf(options, "mirror=%s", mirror_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device_opts(dev_path, mount_point, options), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // 2 is BLDMS_MIRROR_ONLINE, reached once the first resync is done
+    for (i = 0; i < 20 && get_int_stat("mirror_state") != 2; i++){
+        usleep(100 * 1000);
+    }
+    if (get_int_stat("mirror_state") != 2){
+        LOG_ERROR("The mirror did not come online\n");
+        goto test_mirror_exit;
+    }
+
+    // reads of blocks not in memory are balanced between the two sides
+    block_index = put_data((char *)expected, strlen(expected));
+    if (block_index < 0){
+        LOG_ERROR("Failed to put data\n");
+        goto test_mirror_exit;
+    }
+    for (i = 0; i < 8; i++){
+        memset(actual, 0, 256);
+        if (get_data(block_index, actual, strlen(expected)) != (int)strlen(expected)
+         || strcmp(expected, actual) != 0){
+            LOG_ERROR("Read %d with mirror, Expected: %s, Actual: %s\n", i, expected, actual);
+            goto test_mirror_exit;
+        }
+    }
+
+    // detaching the mirror leaves the data on the primary device
+    if (devkeeper_umount_device(mount_point) < 0
+     || devkeeper_mount_device(dev_path, mount_point) < 0){
+        LOG_ERROR("Failed to mount %s again without mirror\n", dev_path);
+        goto test_mirror_exit;
+    }
+    memset(actual, 0, 256);
+    if (get_data(block_index, actual, strlen(expected)) != (int)strlen(expected)
+     || strcmp(expected, actual) != 0){
+        LOG_ERROR("Read without mirror, Expected: %s, Actual: %s\n", expected, actual);
+        goto test_mirror_exit;
+    }
+    res = 0;
+
+test_mirror_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_destroy_loop_device(mirror_path, mirror_file), -1,
+     "Failed to destroy mirror device\n");
+    return res;
+}
+
+int test_dirty_budget(){
+
+    char dev_path[32];
+    char *dev_file = "./test_dirty.img";
+    char *mount_point = "./test_mount_dirty";
+    int indexes[8];
+    int res;
+    int i;
+
+    // the RAM disk is accessed directly, with no dirty buffers to account
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_loop_device(dev_file,
+     BLDMS_NBLOCKS_DEFAULT * BLDMS_BLOCKSIZE_DEFAULT, dev_path), -1,
+     "Failed to create device\n");
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1,
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device_opts(dev_path, mount_point, "dirty_budget=2"), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // a burst well past the budget is paced, not refused
+    for (i = 0; i < 8; i++){
+        indexes[i] = put_data((char *)expected, strlen(expected));
+        if (indexes[i] < 0){
+            LOG_ERROR("Failed to put data %d\n", i);
+            goto test_dirty_budget_exit;
+        }
+    }
+
+    // background writeback catches up once the burst is over
+    for (i = 0; i < 20 && get_int_stat("dirty_blocks") > 0; i++){
+        usleep(BLDMS_DIRTY_MAX_PAUSE_MS_DEFAULT * 1000 / 10);
+    }
+    if (get_int_stat("dirty_blocks") > 0){
+        LOG_ERROR("Expected no dirty blocks, Actual: %d\n", get_int_stat("dirty_blocks"));
+        goto test_dirty_budget_exit;
+    }
+    for (i = 0; i < 8; i++){
+        memset(actual, 0, 256);
+        if (get_data(indexes[i], actual, strlen(expected)) != (int)strlen(expected)
+         || strcmp(expected, actual) != 0){
+            LOG_ERROR("Block %d, Expected: %s, Actual: %s\n", indexes[i], expected, actual);
+            goto test_dirty_budget_exit;
+        }
+    }
+    res = 0;
+
+test_dirty_budget_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_destroy_loop_device(dev_path, dev_file), -1,
+     "Failed to destroy device\n");
+    return res;
+}
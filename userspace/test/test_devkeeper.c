@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "test_suites.h"
@@ -6,6 +8,7 @@
 #include "logger/logger.h"
 #include "../../kernelspace/logic/config.h"
 #include "api/api.h"
+#include "devkeeper/singlefilefs.h"
 
 int test_devkeeper(){
 
@@ -28,6 +31,18 @@ int test_devkeeper(){
     return 0;
 }
 
+/**
+ * Unmounts the device mounted by test_devkeeper(), so that the following tests
+ * can format it again
+*/
+int test_umount(){
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device("./test_mount"), -1,
+     "Failed to unmount ./test_mount\n");
+
+    return 0;
+}
+
 int test_mount_twice(){
     char dev_path[64];
     char *mount_point_1 = "./test_mount_1";
@@ -56,4 +71,77 @@ int test_mount_twice(){
 
     return 0;
     
-}
\ No newline at end of file
+}
+int test_scan_repair(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_repair";
+    char BLDMS_DEV_NAME[32];
+    const char *msgs[] = {"m0-", "m1-", "m2-"};
+    const char *expected = "m0-m1-m2-";
+    char actual[16];
+    struct singlefilefs_sb_info sb_info;
+    int b_indexes[3];
+    int fd;
+    int res;
+    int i;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1,
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+    for (i = 0; i < 3; i++){
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+        ON_ERROR_LOG_AND_RETURN((b_indexes[i] < 0), -1, "Failed to put data\n");
+    }
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+
+    // as after a crash, the superblock does not know about the blocks put, and the
+    // device is scanned
+    fd = open(dev_path, O_RDWR);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
+    res = pread(fd, &sb_info, sizeof(sb_info),
+     SINGLEFILEFS_SB_BLOCK_NUMBER * BLDMS_BLOCKSIZE_DEFAULT) == sizeof(sb_info)? 0 : -1;
+    sb_info.first_used_bi = -1;
+    sb_info.last_used_bi = -1;
+    sb_info.snapshot_clean = 0;
+    if (!res && pwrite(fd, &sb_info, sizeof(sb_info),
+     SINGLEFILEFS_SB_BLOCK_NUMBER * BLDMS_BLOCKSIZE_DEFAULT) != sizeof(sb_info)){
+        res = -1;
+    }
+    close(fd);
+    ON_ERROR_LOG_AND_RETURN(res, -1, "Failed to rewrite superblock of %s\n", dev_path);
+
+    // the mount rebuilds the lists from the headers of the blocks
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device with broken lists at %s\n", dev_path);
+    res = -1;
+    memset(actual, 0, sizeof(actual));
+    fd = open("./test_mount_repair/the-file", O_RDONLY);
+    if (fd < 0 || read(fd, actual, sizeof(actual) - 1) != (ssize_t)strlen(expected)
+     || strcmp(expected, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", expected, actual);
+        goto test_scan_repair_exit;
+    }
+    if (invalidate_data(b_indexes[1]) < 0
+     || put_data((char *)msgs[1], strlen(msgs[1])) < 0){
+        LOG_ERROR("Failed to change the repaired lists\n");
+        goto test_scan_repair_exit;
+    }
+    res = 0;
+
+test_scan_repair_exit:
+    if (fd >= 0){
+        close(fd);
+    }
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}
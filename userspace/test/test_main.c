@@ -14,5 +14,29 @@ int main(){
     //ON_ERROR_LOG_AND_RETURN(test_mount_twice(), EXIT_FAILURE, "Test failed\n");
     //ON_ERROR_LOG_AND_RETURN(test_vfs_read(), EXIT_FAILURE, "Test failed\n");
     ON_ERROR_LOG_AND_RETURN(test_vfs_read_stateful(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_read_chunked(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_invalidate_parallel(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_seek_back(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_readv(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_read_sequential(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_mmap(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_reread(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_sendfile(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_read_framed(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_poll(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_read_nowait(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_vfs_pread(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_umount(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_compact(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_put_ring(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_tier(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_stripes(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_mirror(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_log_engine(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_direct(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_put_zones(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_dirty_budget(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_scan_repair(), EXIT_FAILURE, "Test failed\n");
+    ON_ERROR_LOG_AND_RETURN(test_snapshot(), EXIT_FAILURE, "Test failed\n");
     
 }
@@ -6,10 +6,34 @@ int test_syscall(void);
 int test_block_serialize(void);
 int test_block_move(void);
 int test_put_get();
+int test_compact();
 int test_invalidate();
+int test_put_ring();
+int test_log_engine();
+int test_direct();
+int test_put_zones();
+int test_snapshot();
+int test_tier();
+int test_stripes();
+int test_mirror();
+int test_dirty_budget();
 int test_devkeeper();
+int test_umount();
+int test_scan_repair();
 int test_mount_twice();
 int test_vfs_read();
 int test_vfs_read_stateful();
+int test_vfs_read_chunked();
+int test_vfs_invalidate_parallel();
+int test_vfs_seek_back();
+int test_vfs_readv();
+int test_vfs_read_sequential();
+int test_vfs_mmap();
+int test_vfs_reread();
+int test_vfs_read_nowait();
+int test_vfs_sendfile();
+int test_vfs_read_framed();
+int test_vfs_poll();
+int test_vfs_pread();
 
 #endif // TEST_SUITES_H_INCLUDED
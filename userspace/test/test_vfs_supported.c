@@ -1,11 +1,20 @@
+#define _GNU_SOURCE // preadv2()
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include "test_suites.h"
 #include "logger/logger.h"
 #include "api/api.h"
+#include "devkeeper/singlefilefs.h"
 
 static int count_msgs(const char **msgs){
     int count = 0;
@@ -126,4 +135,722 @@ int test_vfs_read_stateful(){
     }
     close(fd);
     return res;
-}
\ No newline at end of file
+}
+int test_vfs_read_chunked(){
+
+    const int nr_msgs = 10;
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char msgs[nr_msgs][16];
+    char expected[nr_msgs * 16];
+    char actual[nr_msgs * 16];
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    // the traversal drops its read section every BLDMS_READ_CHUNK_BLOCKS blocks
+    if (get_int_param("BLDMS_READ_CHUNK_BLOCKS") <= 0
+     || get_int_param("BLDMS_READ_CHUNK_BLOCKS") >= nr_msgs){
+        logMsg(LOG_TAG_W, "Reads fit in one chunk, load the module with a smaller BLDMS_READ_CHUNK_BLOCKS to test chunks\n");
+    }
+
+    memset(expected, 0, sizeof(expected));
+    memset(actual, 0, sizeof(actual));
+
+    for (int i = 0; i < nr_msgs; i ++){
+        sprintf(msgs[i], "message %d-", i);
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data(msgs[i], strlen(msgs[i]));
+    }
+
+    // a single read spans every chunk, resuming where the previous one stopped
+    fd = open(the_file, O_RDONLY);
+    if (read(fd, actual, sizeof(actual)) != expected_i
+     || memcmp(expected, actual, expected_i) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+struct invalidate_arg{
+    pthread_barrier_t *barrier;
+    int b_index;
+    int res;
+};
+
+static void *invalidate_thread(void *data){
+
+    struct invalidate_arg *arg = data;
+
+    pthread_barrier_wait(arg->barrier);
+    arg->res = invalidate_data(arg->b_index);
+    return NULL;
+}
+
+/**
+ * Invalidates the blocks at b_indexes, all at once from one thread each
+ * @return 0 if every invalidation succeeded, else -1
+*/
+static int invalidate_parallel(const int *b_indexes, int nr_indexes){
+
+    pthread_t threads[nr_indexes];
+    struct invalidate_arg args[nr_indexes];
+    pthread_barrier_t barrier;
+    int res = 0;
+
+    pthread_barrier_init(&barrier, NULL, nr_indexes);
+    for (int i = 0; i < nr_indexes; i ++){
+        args[i].barrier = &barrier;
+        args[i].b_index = b_indexes[i];
+        pthread_create(&threads[i], NULL, invalidate_thread, &args[i]);
+    }
+    for (int i = 0; i < nr_indexes; i ++){
+        pthread_join(threads[i], NULL);
+        if (args[i].res < 0){
+            printf("failed to invalidate block %d\n", b_indexes[i]);
+            res = -1;
+        }
+    }
+    pthread_barrier_destroy(&barrier);
+    return res;
+}
+
+/**
+ * Reads the whole stream of the-file and compares it with expected
+ * @return 0 if they match, else -1
+*/
+static int read_stream(const char *the_file, const char *expected){
+
+    char actual[256];
+    ssize_t read_size;
+    int fd;
+
+    memset(actual, 0, sizeof(actual));
+    fd = open(the_file, O_RDONLY);
+    read_size = read(fd, actual, sizeof(actual) - 1);
+    close(fd);
+    if (read_size != (ssize_t)strlen(expected) || strcmp(expected, actual) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        return -1;
+    }
+    return 0;
+}
+
+int test_vfs_invalidate_parallel(){
+
+    const char *msgs[] = {
+        "m0-", "m1-", "m2-", "m3-", "m4-", "m5-", "m6-", "m7-",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    int indexes[nr_msgs];
+    int res = -1;
+
+    for (int i = 0; i < nr_msgs; i ++){
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    // no two blocks are neighbours in the used list, so relinks are disjoint
+    for (int i = 0; i < nr_msgs / 2; i ++){
+        indexes[i] = b_indexes[2 * i];
+    }
+    if (invalidate_parallel(indexes, nr_msgs / 2) < 0
+     || read_stream(the_file, "m1-m3-m5-m7-") < 0){
+        goto test_vfs_invalidate_parallel_exit;
+    }
+
+    // now they are, and the neighbour of each one may be invalidated with it
+    for (int i = 0; i < nr_msgs / 2 - 1; i ++){
+        indexes[i] = b_indexes[2 * i + 1];
+    }
+    if (invalidate_parallel(indexes, nr_msgs / 2 - 1) < 0
+     || read_stream(the_file, "m7-") < 0){
+        goto test_vfs_invalidate_parallel_exit;
+    }
+    res = 0;
+
+test_vfs_invalidate_parallel_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    return res;
+}
+
+int test_vfs_seek_back(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    const int first_len = strlen(msgs[0]);
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    fd = open(the_file, O_RDONLY);
+    read(fd, actual, size_msgs(msgs));
+
+    // a read behind the last one finds the block holding its offset
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (lseek(fd, first_len + 2, SEEK_SET) != first_len + 2
+     || read(fd, actual, size_msgs(msgs)) != size_msgs(msgs) - first_len - 2
+     || strcmp(expected + first_len + 2, actual) != 0){
+        printf("expected: %s\n", expected + first_len + 2);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_seek_back_exit;
+    }
+
+    // back to the start of the stream
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (lseek(fd, 0, SEEK_SET) != 0
+     || read(fd, actual, first_len) != first_len
+     || memcmp(expected, actual, first_len) != 0){
+        printf("expected: %.*s\n", first_len, expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+test_vfs_seek_back_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_readv(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    const int first_len = strlen(msgs[0]) + 2;
+    struct iovec iov[2];
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    // the first buffer ends in the middle of a block, the second one takes the rest
+    iov[0].iov_base = actual;
+    iov[0].iov_len = first_len;
+    iov[1].iov_base = actual + first_len;
+    iov[1].iov_len = size_msgs(msgs) - first_len;
+    fd = open(the_file, O_RDONLY);
+    if (readv(fd, iov, 2) != size_msgs(msgs) || strcmp(expected, actual) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_read_sequential(){
+
+    const int nr_msgs = 8;
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char msgs[nr_msgs][16];
+    char expected[nr_msgs * 16];
+    char actual[nr_msgs * 16];
+    ssize_t read_size;
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+    int actual_i = 0;
+
+    memset(expected, 0, sizeof(expected));
+    memset(actual, 0, sizeof(actual));
+
+    for (int i = 0; i < nr_msgs; i ++){
+        sprintf(msgs[i], "message %d-", i);
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data(msgs[i], strlen(msgs[i]));
+    }
+
+    // small reads front to back grow the readahead window past the blocks read
+    fd = open(the_file, O_RDONLY);
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0
+     || posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) != 0){
+        printf("failed to advise sequential access\n");
+        res = -1;
+        goto test_vfs_read_sequential_exit;
+    }
+    while ((read_size = read(fd, actual + actual_i, 3)) > 0){
+        actual_i += read_size;
+    }
+    if (actual_i != expected_i || strcmp(expected, actual) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+test_vfs_read_sequential_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_mmap(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char *mapped;
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    // pages of the mapping are filled with the stream on fault
+    fd = open(the_file, O_RDONLY);
+    mapped = mmap(NULL, size_msgs(msgs), PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED){
+        printf("failed to map the-file\n");
+        res = -1;
+        goto test_vfs_mmap_exit;
+    }
+    if (memcmp(expected, mapped, size_msgs(msgs)) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %.*s\n", size_msgs(msgs), mapped);
+        res = -1;
+    }
+    munmap(mapped, size_msgs(msgs));
+
+test_vfs_mmap_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_reread(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    int expected_size;
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    // the first read fills the page cache with the stream
+    fd = open(the_file, O_RDONLY);
+    if (read(fd, actual, size_msgs(msgs)) != size_msgs(msgs)
+     || strcmp(expected, actual) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_reread_exit;
+    }
+
+    // pages from the invalidated block on are dropped, and rebuilt by the next read
+    invalidate_data(b_indexes[1]);
+    sprintf(expected, "%s%s", msgs[0], msgs[2]);
+    expected_size = strlen(expected);
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (lseek(fd, 0, SEEK_SET) != 0
+     || read(fd, actual, size_msgs(msgs)) != expected_size
+     || strcmp(expected, actual) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+test_vfs_reread_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_read_nowait(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    struct iovec iov;
+    ssize_t read_size;
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    // a read which would block returns EAGAIN, else what it read is the stream
+    iov.iov_base = actual;
+    iov.iov_len = size_msgs(msgs);
+    fd = open(the_file, O_RDONLY);
+    read_size = preadv2(fd, &iov, 1, 0, RWF_NOWAIT);
+    if (read_size < 0? errno != EAGAIN
+     : read_size == 0 || memcmp(expected, actual, read_size) != 0){
+        printf("expected: EAGAIN or %s\n", expected);
+        printf("actual: %ld bytes, %s\n", read_size, actual);
+        res = -1;
+    }
+
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_sendfile(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    int pipe_fds[2];
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    fd = open(the_file, O_RDONLY);
+    if (pipe(pipe_fds) < 0){
+        printf("failed to create pipe\n");
+        res = -1;
+        goto test_vfs_sendfile_exit;
+    }
+
+    // the stream goes to the pipe without passing through user space
+    if (sendfile(pipe_fds[1], fd, NULL, size_msgs(msgs)) != size_msgs(msgs)){
+        printf("sendfile moved less data than expected\n");
+        res = -1;
+    }
+    read(pipe_fds[0], actual, size_msgs(msgs));
+    if (res == 0 && memcmp(expected, actual, size_msgs(msgs)) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+
+test_vfs_sendfile_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_read_framed(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    const size_t buf_size = size_msgs(msgs) + nr_msgs * sizeof(struct singlefilefs_record);
+    char buf[buf_size];
+    struct singlefilefs_record record;
+    int framed = 1;
+    int fd;
+    int res = 0;
+    ssize_t read_size;
+    size_t buf_i = 0;
+
+    for(int i = 0; i < nr_msgs; i ++){
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    fd = open(the_file, O_RDONLY);
+    if (ioctl(fd, SINGLEFILEFS_IOC_SET_FRAMED, &framed) < 0){
+        printf("failed to switch to framed mode\n");
+        res = -1;
+        goto test_vfs_read_framed_exit;
+    }
+
+    // every record fits in one read, each one keeps the boundaries of its message
+    read_size = read(fd, buf, buf_size);
+    if (read_size != (ssize_t)buf_size){
+        printf("expected %lu bytes of records, read %ld\n", buf_size, read_size);
+        res = -1;
+        goto test_vfs_read_framed_exit;
+    }
+    for (int i = 0; i < nr_msgs; i ++){
+        memcpy(&record, buf + buf_i, sizeof(record));
+        buf_i += sizeof(record);
+        if (record.index != b_indexes[i] || record.size != strlen(msgs[i])
+         || memcmp(buf + buf_i, msgs[i], record.size) != 0){
+            printf("record %d: expected block %d of %lu bytes, got block %d of %u bytes\n",
+             i, b_indexes[i], strlen(msgs[i]), record.index, record.size);
+            res = -1;
+        }
+        buf_i += record.size;
+    }
+
+    // no more records
+    if (read(fd, buf, buf_size) != 0){
+        printf("expected no more records\n");
+        res = -1;
+    }
+
+test_vfs_read_framed_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_poll(){
+
+    const char *msg = "message 1-";
+    const char *the_file = "./test_mount/the-file";
+    char actual[strlen(msg) + 1];
+    struct pollfd pfd;
+    int follow = 1;
+    int b_index = -1;
+    int fd;
+    int res = 0;
+
+    memset(actual, 0, strlen(msg) + 1);
+
+    fd = open(the_file, O_RDONLY | O_NONBLOCK);
+    if (ioctl(fd, SINGLEFILEFS_IOC_SET_FOLLOW, &follow) < 0){
+        printf("failed to switch to follow mode\n");
+        res = -1;
+        goto test_vfs_poll_exit;
+    }
+
+    // at the end of the stream, a non blocking follower is told to come back
+    if (read(fd, actual, strlen(msg)) != -1 || errno != EAGAIN){
+        printf("expected EAGAIN at the end of the stream\n");
+        res = -1;
+        goto test_vfs_poll_exit;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 0){
+        printf("expected the-file not to be readable\n");
+        res = -1;
+        goto test_vfs_poll_exit;
+    }
+
+    b_index = put_data((char *)msg, strlen(msg));
+    if (poll(&pfd, 1, 1000) != 1 || !(pfd.revents & POLLIN)){
+        printf("expected the-file to be readable after put_data\n");
+        res = -1;
+        goto test_vfs_poll_exit;
+    }
+    if (read(fd, actual, strlen(msg)) != (ssize_t)strlen(msg) || strcmp(msg, actual) != 0){
+        printf("expected: %s\n", msg);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+test_vfs_poll_exit:
+    if (b_index >= 0){
+        invalidate_data(b_index);
+    }
+    close(fd);
+    return res;
+}
+
+int test_vfs_pread(){
+
+    const char *msgs[] = {
+        "message 1-",
+        "mess2-",
+        "m3",
+        NULL,
+    };
+    const int nr_msgs = count_msgs(msgs);
+    int b_indexes[nr_msgs];
+    const char *the_file = "./test_mount/the-file";
+    char expected[size_msgs(msgs) + 1];
+    char actual[size_msgs(msgs) + 1];
+    const int first_len = strlen(msgs[0]);
+    int fd;
+    int res = 0;
+    int expected_i = 0;
+
+    memset(expected, 0, size_msgs(msgs) + 1);
+    memset(actual, 0, size_msgs(msgs) + 1);
+
+    for(int i = 0; i < nr_msgs; i ++){
+        memcpy(expected + expected_i, msgs[i], strlen(msgs[i]));
+        expected_i += strlen(msgs[i]);
+        b_indexes[i] = put_data((char *)msgs[i], strlen(msgs[i]));
+    }
+
+    fd = open(the_file, O_RDONLY);
+
+    // a positional read gets the data at its offset
+    if (pread(fd, actual, size_msgs(msgs) - first_len, first_len)
+     != size_msgs(msgs) - first_len
+     || memcmp(expected + first_len, actual, size_msgs(msgs) - first_len) != 0){
+        printf("expected: %s\n", expected + first_len);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_pread_exit;
+    }
+
+    // even when it starts where the session is
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (pread(fd, actual, first_len, 0) != first_len
+     || memcmp(expected, actual, first_len) != 0){
+        printf("expected: %.*s\n", first_len, expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_pread_exit;
+    }
+
+    // and leaves the session where it was
+    memset(actual, 0, size_msgs(msgs) + 1);
+    read(fd, actual, size_msgs(msgs));
+    if (memcmp(expected, actual, size_msgs(msgs)) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_pread_exit;
+    }
+
+    // also when the session is in the middle of the stream
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (lseek(fd, 0, SEEK_SET) != 0 || read(fd, actual, first_len) != first_len
+     || pread(fd, actual + first_len, size_msgs(msgs) - first_len, first_len)
+     != size_msgs(msgs) - first_len
+     || memcmp(expected, actual, size_msgs(msgs)) != 0){
+        printf("expected: %s\n", expected);
+        printf("actual: %s\n", actual);
+        res = -1;
+        goto test_vfs_pread_exit;
+    }
+    memset(actual, 0, size_msgs(msgs) + 1);
+    if (read(fd, actual, size_msgs(msgs)) != size_msgs(msgs) - first_len
+     || memcmp(expected + first_len, actual, size_msgs(msgs) - first_len) != 0){
+        printf("expected: %s\n", expected + first_len);
+        printf("actual: %s\n", actual);
+        res = -1;
+    }
+
+test_vfs_pread_exit:
+    for (int i = 0; i < nr_msgs; i ++){
+        invalidate_data(b_indexes[i]);
+    }
+    close(fd);
+    return res;
+}
@@ -1,6 +1,13 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "test_suites.h"
 #include "logger/logger.h"
 #include "api/api.h"
+#include "devkeeper/devkeeper.h"
+#include "devkeeper/singlefilefs.h"
+#include "../../kernelspace/logic/config.h"
 
 static const char *expected = "Hello World!";
 static char actual[256];
@@ -45,4 +52,386 @@ int test_invalidate(){
      ENODATA, get_res_errno);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int test_compact(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_compact";
+    char BLDMS_DEV_NAME[32];
+    int indexes[6];
+    int passes;
+    int moved;
+    int res;
+    int i;
+
+    if (get_int_param("BLDMS_COMPACT_INTERVAL_MS") <= 0){
+        logMsg(LOG_TAG_W, "Compaction is disabled, load the module with BLDMS_COMPACT_INTERVAL_MS to test it\n");
+        return 0;
+    }
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // every other block is freed, leaving holes between valid blocks
+    for (i = 0; i < 6; i++){
+        indexes[i] = put_data((char *)expected, strlen(expected));
+        if (indexes[i] < 0){
+            LOG_ERROR("Failed to put data\n");
+            goto test_compact_exit;
+        }
+    }
+    for (i = 0; i < 6; i += 2){
+        if (invalidate_data(indexes[i]) < 0){
+            LOG_ERROR("Failed to invalidate block %d\n", indexes[i]);
+            goto test_compact_exit;
+        }
+    }
+
+    // wait for two full passes, and for valid blocks to be moved in the holes
+    moved = get_int_stat("compact_blocks_moved");
+    passes = get_int_stat("compact_passes");
+    for (i = 0; i < 50 && get_int_stat("compact_passes") < passes + 2; i++){
+        usleep(get_int_param("BLDMS_COMPACT_INTERVAL_MS") * 1000);
+    }
+    if (get_int_stat("compact_blocks_moved") == moved){
+        LOG_ERROR("Expected valid blocks to be relocated\n");
+        goto test_compact_exit;
+    }
+
+    // offsets are not affected by relocations
+    for (i = 1; i < 6; i += 2){
+        memset(actual, 0, 256);
+        if (get_data(indexes[i], actual, strlen(expected)) != (int)strlen(expected)
+         || strcmp(expected, actual) != 0){
+            LOG_ERROR("Block %d, Expected: %s, Actual: %s\n", indexes[i], expected, actual);
+            goto test_compact_exit;
+        }
+    }
+    res = 0;
+
+test_compact_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}
+
+int test_put_ring(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_ring";
+    char BLDMS_DEV_NAME[32];
+    int first_index;
+    int block_index;
+    int evicted;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device_opts(dev_path, mount_point, "ring"), -1,
+     "Failed to mount device at %s\n", dev_path);
+
+    // fill all the data blocks of the device, the snapshot region holds none
+    first_index = put_data((char *)expected, strlen(expected));
+    ON_ERROR_LOG_AND_RETURN((first_index < 0), -1, "Failed to put data\n");
+    for (int i = 1; i < BLDMS_NBLOCKS_DEFAULT - 2 - devkeeper_snapshot_blocks(
+     BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT, 1); i ++){
+        ON_ERROR_LOG_AND_RETURN((put_data((char *)expected, strlen(expected)) < 0), -1,
+         "Failed to put data\n");
+    }
+
+    // the oldest message makes room for the new one
+    block_index = put_data_evict((char *)expected, strlen(expected), &evicted);
+    ON_ERROR_LOG_AND_RETURN((block_index < 0), -1, "Failed to put data in a full device\n");
+    ON_ERROR_LOG_AND_RETURN((evicted != first_index || block_index != first_index), -1,
+     "Expected eviction of %d, Actual: evicted %d, put in %d\n", first_index, evicted,
+     block_index);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return 0;
+}
+
+int test_log_engine(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_log";
+    char BLDMS_DEV_NAME[32];
+    int first_index;
+    int second_index;
+    int get_res;
+    int res;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    memset(actual, 0, 256);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_log_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // messages are appended one after the other, with increasing offsets
+    first_index = put_data((char *)expected, strlen(expected));
+    second_index = put_data((char *)expected, strlen(expected));
+    if (first_index < 0 || second_index != first_index + 1){
+        LOG_ERROR("Failed to put data: got offsets %d and %d\n", first_index, second_index);
+        goto test_log_engine_exit;
+    }
+
+    get_res = get_data(second_index, actual, strlen(expected));
+    if (get_res != (int)strlen(expected) || strcmp(expected, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", expected, actual);
+        goto test_log_engine_exit;
+    }
+
+    if (invalidate_data(first_index) < 0){
+        LOG_ERROR("Failed to invalidate data\n");
+        goto test_log_engine_exit;
+    }
+    get_res = get_data(first_index, actual, strlen(expected));
+    if (get_res != -1 || errno != ENODATA){
+        LOG_ERROR("Expected: %d, Actual: %d\n", ENODATA, errno);
+        goto test_log_engine_exit;
+    }
+    res = 0;
+
+test_log_engine_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}
+
+/**
+ * @return 1 if the device at dev_path holds data anywhere in its blocks, 0 if
+ * not, -1 on error
+*/
+static int device_contains(char *dev_path, const char *data, int len){
+
+    static char block[BLDMS_BLOCKSIZE_DEFAULT];
+    int found;
+    int fd;
+    int i, j;
+
+    fd = open(dev_path, O_RDONLY);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
+    found = 0;
+    for (i = 0; i < BLDMS_NBLOCKS_DEFAULT && !found; i++){
+        if (pread(fd, block, sizeof(block), (off_t)i * sizeof(block)) != sizeof(block)){
+            LOG_ERROR("Failed to read block %d of %s\n", i, dev_path);
+            found = -1;
+            break;
+        }
+        for (j = 0; j + len <= (int)sizeof(block) && !found; j++){
+            found = memcmp(block + j, data, len) == 0;
+        }
+    }
+    close(fd);
+    return found;
+}
+
+int test_direct(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_direct";
+    char BLDMS_DEV_NAME[32];
+    // not put by other tests, which may have left their data on the device
+    const char *direct_data = "Hello RAM disk!";
+    int block_index;
+    int get_res;
+    int res;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    memset(actual, 0, 256);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+
+    // mounted on the RAM disk alone, data blocks are written to its memory directly
+    block_index = put_data((char *)direct_data, strlen(direct_data));
+    ON_ERROR_LOG_AND_RETURN((block_index < 0), -1, "Failed to put data\n");
+    get_res = get_data(block_index, actual, strlen(direct_data));
+    ON_ERROR_LOG_AND_RETURN((get_res != (int)strlen(direct_data) || strcmp(direct_data, actual) != 0), -1,
+     "Expected: %s, Actual: %s\n", direct_data, actual);
+
+    // after unmount, readers of the device through the page cache see the same data
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN((device_contains(dev_path, direct_data, strlen(direct_data)) != 1), -1,
+     "Expected the data put to be on %s\n", dev_path);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s again\n", dev_path);
+    memset(actual, 0, 256);
+    res = 0;
+    get_res = get_data(block_index, actual, strlen(direct_data));
+    if (get_res != (int)strlen(direct_data) || strcmp(direct_data, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", direct_data, actual);
+        res = -1;
+    }
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}
+
+int test_put_zones(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_zones";
+    char BLDMS_DEV_NAME[32];
+    const int slot_sizes[] = {256, 1024, BLDMS_BLOCKSIZE_DEFAULT};
+    const int zone_blocks[] = {1, 1, 4};
+    static char large[2048];
+    static char large_actual[2048];
+    int small_index;
+    int large_index;
+    int get_res;
+    int res;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    memset(actual, 0, 256);
+    memset(large, 'x', sizeof(large));
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_zoned_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT,
+     slot_sizes, zone_blocks, 3), -1, "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+    res = -1;
+
+    // the first zone holds 16 blocks of 256 bytes, starting after the reserved blocks
+    small_index = put_data((char *)expected, strlen(expected));
+    if (small_index < 2 || small_index >= 2 + 16){
+        LOG_ERROR("Expected a block of the 256 bytes zone, Actual: %d\n", small_index);
+        goto test_put_zones_exit;
+    }
+
+    // too large for the first two zones
+    large_index = put_data(large, sizeof(large));
+    if (large_index < 2 + 16 + 4){
+        LOG_ERROR("Expected a block of the largest zone, Actual: %d\n", large_index);
+        goto test_put_zones_exit;
+    }
+
+    get_res = get_data(small_index, actual, strlen(expected));
+    if (get_res != (int)strlen(expected) || strcmp(expected, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", expected, actual);
+        goto test_put_zones_exit;
+    }
+    get_res = get_data(large_index, large_actual, sizeof(large));
+    if (get_res != (int)sizeof(large) || memcmp(large, large_actual, sizeof(large)) != 0){
+        LOG_ERROR("Large data mismatch\n");
+        goto test_put_zones_exit;
+    }
+    res = 0;
+
+test_put_zones_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}
+
+/**
+ * Reads the superblock of the device at dev_path
+*/
+static int read_sb_info(char *dev_path, struct singlefilefs_sb_info *sb_info){
+
+    int fd;
+    ssize_t read_res;
+
+    fd = open(dev_path, O_RDONLY);
+    ON_ERROR_LOG_ERRNO_AND_RETURN(fd < 0, -1, "Failed to open device at %s", dev_path);
+    read_res = pread(fd, sb_info, sizeof(*sb_info),
+     SINGLEFILEFS_SB_BLOCK_NUMBER * BLDMS_BLOCKSIZE_DEFAULT);
+    close(fd);
+    ON_ERROR_LOG_AND_RETURN((read_res != sizeof(*sb_info)), -1,
+     "Failed to read superblock of %s\n", dev_path);
+
+    return 0;
+}
+
+int test_snapshot(){
+
+    char dev_path[64];
+    char *mount_point = "./test_mount_snapshot";
+    char BLDMS_DEV_NAME[32];
+    struct singlefilefs_sb_info sb_info;
+    int block_index;
+    int get_res;
+    int res;
+
+    memset(BLDMS_DEV_NAME, 0, 32);
+    memset(actual, 0, 256);
+    get_string_param("BLDMS_DEV_NAME", BLDMS_DEV_NAME);
+    sprintf(dev_path, "/dev/%s", BLDMS_DEV_NAME);
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_format_device(dev_path, BLDMS_BLOCKSIZE_DEFAULT, BLDMS_NBLOCKS_DEFAULT), -1,
+     "Failed to format device at %s\n", dev_path);
+    ON_ERROR_LOG_AND_RETURN(read_sb_info(dev_path, &sb_info), -1, "Failed to read superblock\n");
+    ON_ERROR_LOG_AND_RETURN((sb_info.snapshot_nr_blocks <= 0
+     || sb_info.snapshot_block + sb_info.snapshot_nr_blocks > BLDMS_NBLOCKS_DEFAULT), -1,
+     "Expected a snapshot region in the device, Actual: %d blocks from %d\n",
+     sb_info.snapshot_nr_blocks, sb_info.snapshot_block);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_create_mountpoint(mount_point, 0777), -1, 
+     "Failed to create mount point at %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s\n", dev_path);
+
+    block_index = put_data((char *)expected, strlen(expected));
+    ON_ERROR_LOG_AND_RETURN((block_index < 0), -1, "Failed to put data\n");
+
+    // a clean unmount leaves a snapshot that the next mount loads instead of scanning
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    ON_ERROR_LOG_AND_RETURN(read_sb_info(dev_path, &sb_info), -1, "Failed to read superblock\n");
+    ON_ERROR_LOG_AND_RETURN((sb_info.snapshot_clean != 1), -1,
+     "Expected a clean snapshot after unmount, so that the scan is skipped\n");
+
+    ON_ERROR_LOG_AND_RETURN(devkeeper_mount_device(dev_path, mount_point), -1,
+     "Failed to mount device at %s again\n", dev_path);
+    res = -1;
+    get_res = get_data(block_index, actual, strlen(expected));
+    if (get_res != (int)strlen(expected) || strcmp(expected, actual) != 0){
+        LOG_ERROR("Expected: %s, Actual: %s\n", expected, actual);
+        goto test_snapshot_exit;
+    }
+
+    // the device may change from now on, so the snapshot is no longer trusted
+    if (read_sb_info(dev_path, &sb_info) < 0 || sb_info.snapshot_clean != 0){
+        LOG_ERROR("Expected the snapshot clean mark to be dropped at mount\n");
+        goto test_snapshot_exit;
+    }
+    res = 0;
+
+test_snapshot_exit:
+    ON_ERROR_LOG_AND_RETURN(devkeeper_umount_device(mount_point), -1,
+     "Failed to unmount %s\n", mount_point);
+    return res;
+}